@@ -249,6 +249,7 @@ int translate_uri(request * req)
    char *req_urip;
    alias *current;
    char *p;
+   int in_pack = 0;
    int uri_len, ret, len;	/* FIXME-andreou *//* Goes in pair with the one at L263 */
 
    req_urip = req->request_uri;
@@ -358,6 +359,7 @@ int translate_uri(request * req)
       /* the 'l2 + 1' is there so we copy the '\0' as well */
       memcpy(buffer, req->document_root, l1);
       memcpy(buffer + l1, req->request_uri, l2 + 1);
+      in_pack = (req->pack != NULL);
    } else {
       /* not aliased.  not userdir.  not part of document_root.  BAIL */
       send_r_bad_request(req);
@@ -377,6 +379,18 @@ int translate_uri(request * req)
       return 0;
    }
 
+   if (in_pack) {
+      /* The document root is a pack (see pack.c); init_get() looks
+       * up the request_uri in it. There are no CGIs in packs.
+       */
+      if (req->method == M_POST) {
+	 send_r_bad_request(req);
+	 return 0;
+      }
+      req->from_pack = 1;
+      return 1;
+   }
+
    /* FIXME -- script_name here equals req->request_uri */
    /* script_name could end up as /cgi-bin/bob/extra_path */
 
@@ -0,0 +1,388 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the async I/O threads. An open() or stat() on a
+ * slow disk (or NFS) blocks the server thread, and every connection it
+ * serves. Thus init_get() hands the open() and fstat() of the requested
+ * file (and the lookup of the directory index) to these threads. The
+ * request waits in the ASYNC_OPEN status, and is woken up when its
+ * server thread reads the eventfd (or pipe) that the async thread
+ * writes to.
+ */
+
+#define _GNU_SOURCE		/* readahead() */
+
+#include "boa.h"
+#include "ssl.h"
+#include <stdint.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+
+int async_io_threads = 0;
+int async_io_prefetch = 0;
+
+#ifdef ENABLE_SMP
+
+static struct async_open *async_queue = NULL;	/* jobs to be done */
+static struct async_open **async_queue_tail = &async_queue;
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+
+/* AsyncIOThreads may change on SIGHUP, but the threads do not */
+static int async_io_started = 0;
+
+/* Reads small files (that are going to be mmaped) to the page
+ * cache, so that the server thread does not wait on page faults.
+ */
+static void prefetch_file(int fd, struct stat *s)
+{
+   if (!S_ISREG(s->st_mode) || s->st_size == 0 ||
+       s->st_size > max_file_size_cache)
+      return;
+
+#ifdef HAVE_READAHEAD
+   readahead(fd, 0, s->st_size);
+#elif defined(HAVE_POSIX_FADVISE)
+   posix_fadvise(fd, 0, s->st_size, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/* Does the work of init_get(), that may block.
+ */
+static void do_async_open(struct async_open *job)
+{
+   int len;
+
+   job->fd = docroot_open(job->docroot, job->pathname);
+   if (job->fd == -1) {
+      job->error = errno;
+      return;
+   }
+
+   if (fstat(job->fd, &job->statbuf) == -1) {
+      /* this is quite impossible, since the file
+       * was opened before.
+       */
+      close(job->fd);
+      job->fd = -1;
+      job->error = ENOENT;
+      return;
+   }
+
+   if (S_ISDIR(job->statbuf.st_mode)) {
+      /* get_dir() looks for the index file, only if the
+       * pathname ends in '/'. Otherwise a redirect is sent.
+       */
+      len = strlen(job->pathname);
+      if (job->pathname[len - 1] == '/') {
+	 job->index = find_and_open_directory_index(job->docroot,
+						    job->pathname, len,
+						    &job->index_fd);
+	 job->index_error = errno;
+	 if (job->index_fd != -1)
+	    fstat(job->index_fd, &job->index_statbuf);
+	 job->index_done = 1;
+      }
+   } else if (async_io_prefetch)
+      prefetch_file(job->fd, &job->statbuf);
+}
+
+static void *async_io_thread(void *arg)
+{
+   struct async_open *job;
+   server_params *params;
+   uint64_t one = 1;
+
+   while (1) {
+      pthread_mutex_lock(&async_lock);
+      while (async_queue == NULL)
+	 pthread_cond_wait(&async_cond, &async_lock);
+      job = async_queue;
+      async_queue = job->next;
+      if (async_queue == NULL)
+	 async_queue_tail = &async_queue;
+      pthread_mutex_unlock(&async_lock);
+
+      if (job->func != NULL) {
+	 /* nobody waits for it */
+	 job->func(job->arg);
+	 free(job);
+	 continue;
+      }
+
+      do_async_open(job);
+
+      /* job may be freed as soon as it is on the done list */
+      params = job->params;
+
+      pthread_mutex_lock(&async_lock);
+      job->next = params->async_done;
+      params->async_done = job;
+      pthread_mutex_unlock(&async_lock);
+
+      /* if this fails, the eventfd (or pipe) is already readable */
+      write(params->async_fd[1], &one, sizeof(one));
+   }
+
+   return NULL;
+}
+
+/* Creates the eventfd, or a pipe, through which the async threads
+ * wake up the given server thread.
+ */
+static int create_async_fd(server_params * params)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+   params->async_fd[0] = eventfd(0, 0);
+   if (params->async_fd[0] != -1) {
+      params->async_fd[1] = params->async_fd[0];
+      if (set_nonblock_fd(params->async_fd[0]) == -1 ||
+	  set_cloexec_fd(params->async_fd[0]) == -1)
+	 return -1;
+      return 0;
+   }
+#endif
+
+   if (pipe(params->async_fd) == -1)
+      return -1;
+
+   if (set_nonblock_fd(params->async_fd[0]) == -1 ||
+       set_nonblock_fd(params->async_fd[1]) == -1 ||
+       set_cloexec_fd(params->async_fd[0]) == -1 ||
+       set_cloexec_fd(params->async_fd[1]) == -1)
+      return -1;
+
+   return 0;
+}
+
+/*
+ * Name: init_async_fd
+ * Description: Creates the eventfd of the server thread params, if
+ * it does not have one yet. Also used by the TLS handshake threads.
+ *
+ * Returns: 0, or -1 on error.
+ */
+int init_async_fd(server_params * params)
+{
+   if (params->async_fd[0] != -1)
+      return 0;
+
+   return create_async_fd(params);
+}
+
+/*
+ * Name: init_async_io
+ * Description: Starts the async I/O threads, if AsyncIOThreads
+ * was set, for the n server threads in params.
+ */
+void init_async_io(server_params * params, int n)
+{
+   pthread_attr_t attr;
+   pthread_t tid;
+   int i;
+
+   if (async_io_threads <= 0)
+      return;
+
+   for (i = 0; i < n; i++) {
+      if (init_async_fd(&params[i]) == -1) {
+	 DIE("could not create the async I/O eventfd");
+      }
+   }
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+   for (i = 0; i < async_io_threads; i++) {
+      if (pthread_create(&tid, &attr, &async_io_thread, NULL) != 0) {
+	 log_error_time();
+	 fprintf(stderr, "Could not dispatch async I/O threads.\n");
+	 exit(1);
+      }
+   }
+
+   pthread_attr_destroy(&attr);
+   async_io_started = 1;
+
+   log_error_time();
+   fprintf(stderr, "%s: Dispatched %d async I/O threads.\n", SERVER_NAME,
+	   async_io_threads);
+}
+
+/*
+ * Name: async_open_file
+ * Description: Hands the open() and fstat() of req->pathname to
+ * the async I/O threads. If this succeeds, the request is put in
+ * the ASYNC_OPEN status, and init_get() is called again when the
+ * results are in req->async_open.
+ *
+ * Returns: 1 if the request waits for the async threads, or 0 if
+ * the file has to be opened by the caller.
+ */
+int async_open_file(server_params * params, request * req)
+{
+   struct async_open *job;
+
+   if (params->async_fd[0] == -1)
+      return 0;
+
+   job = calloc(1, sizeof(struct async_open));
+   if (job == NULL)
+      return 0;
+
+   job->req = req;
+   job->params = params;
+   job->pathname = req->pathname;
+   job->docroot = req->docroot;
+   job->fd = job->index_fd = -1;
+
+   req->async_open = job;
+   req->status = ASYNC_OPEN;
+
+   pthread_mutex_lock(&async_lock);
+   *async_queue_tail = job;
+   async_queue_tail = &job->next;
+   pthread_cond_signal(&async_cond);
+   pthread_mutex_unlock(&async_lock);
+
+   return 1;
+}
+
+/*
+ * Name: async_io_run
+ * Description: Hands func(arg) to the async I/O threads, for work
+ * that no request waits for, such as the compression of a file.
+ *
+ * Returns: 1 if it was queued, or 0 if the caller has to do it.
+ */
+int async_io_run(void (*func) (void *), void *arg)
+{
+   struct async_open *job;
+
+   if (!async_io_started)
+      return 0;
+
+   job = calloc(1, sizeof(struct async_open));
+   if (job == NULL)
+      return 0;
+
+   job->func = func;
+   job->arg = arg;
+
+   pthread_mutex_lock(&async_lock);
+   *async_queue_tail = job;
+   async_queue_tail = &job->next;
+   pthread_cond_signal(&async_cond);
+   pthread_mutex_unlock(&async_lock);
+
+   return 1;
+}
+
+/*
+ * Name: async_io_complete
+ * Description: Called by the server thread when its eventfd is
+ * readable. The requests whose files were opened are moved to the
+ * ready queue.
+ */
+void async_io_complete(server_params * params)
+{
+   struct async_open *job, *next;
+   char buf[64];
+
+   while (read(params->async_fd[0], buf, sizeof(buf)) > 0);
+
+   pthread_mutex_lock(&async_lock);
+   job = params->async_done;
+   params->async_done = NULL;
+   pthread_mutex_unlock(&async_lock);
+
+   for (; job != NULL; job = next) {
+      next = job->next;
+      job->next = NULL;
+      job->done = 1;
+      if (job->parked) {
+	 job->parked = 0;
+	 ready_request(params, job->req);
+      }
+   }
+
+#ifdef ENABLE_SSL
+   ssl_handshake_complete(params);
+#endif
+}
+
+#else				/* ENABLE_SMP */
+
+void init_async_io(server_params * params, int n)
+{
+   if (async_io_threads > 0) {
+      log_error_time();
+      fputs("AsyncIOThreads requires a server built with threads. "
+	    "Ignoring it.\n", stderr);
+      async_io_threads = 0;
+   }
+}
+
+int async_open_file(server_params * params, request * req)
+{
+   return 0;
+}
+
+int async_io_run(void (*func) (void *), void *arg)
+{
+   return 0;
+}
+
+void async_io_complete(server_params * params)
+{
+}
+
+#endif				/* ENABLE_SMP */
+
+/*
+ * Name: process_async_open
+ * Description: Called for requests in the ASYNC_OPEN status. The
+ * request is blocked until the async thread is done, and then
+ * init_get() continues with the opened file.
+ *
+ * Return values: as init_get(), or -1 to block.
+ */
+int process_async_open(server_params * params, request * req)
+{
+   if (!req->async_open->done) {
+      /* async_io_complete() moves it to the ready queue */
+      req->async_open->parked = 1;
+      return -1;
+   }
+
+   req->status = WRITE;
+   return init_get(params, req);
+}
+
+void free_async_open(struct async_open *job)
+{
+   if (job->fd != -1)
+      close(job->fd);
+   if (job->index_fd != -1)
+      close(job->index_fd);
+   free(job);
+}
@@ -185,6 +185,9 @@ int main(int argc, char **argv)
 
    drop_privs();
 
+   /* the leases are taken as the user we run as */
+   check_virthost_leases();
+
    /* main loop */
    timestamp();
 
@@ -199,6 +202,11 @@ int main(int argc, char **argv)
     */
    params = smp_init(server_s);
 
+   /* fill the file cache with the files that were hot, before
+    * the last shutdown.
+    */
+   start_mmap_warmup();
+
    /* unblock signals for daddy
     */
    unblock_main_signals();
@@ -259,6 +267,7 @@ static server_params *smp_init(socket_type server_s[2])
       params[i].sigalrm_flag = 0;
       params[i].sigusr1_flag = 0;
       params[i].sigterm_flag = 0;
+      params[i].sigio_flag = 0;
 
       params[i].sockbufsize = SOCKETBUF_SIZE;
 
@@ -268,9 +277,20 @@ static server_params *smp_init(socket_type server_s[2])
       params[i].total_connections = 0;
       params[i].max_fd = 0;
 
-      params[i].handle_sigbus = 0;
+      params[i].async_fd[0] = params[i].async_fd[1] = -1;
+      params[i].async_done = NULL;
+#ifdef ENABLE_SSL
+      params[i].handshake_done = NULL;
+#endif
    }
 
+   /* before the server threads use them */
+   init_async_io(params, max_threads);
+#ifdef ENABLE_SSL
+   if (boa_ssl)
+      init_ssl_handshake_threads(params, max_threads);
+#endif
+
 #ifdef ENABLE_SMP
    params[0].tid = father_id;
 
@@ -36,7 +36,6 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>             /* OPEN_MAX */
-#include <setjmp.h>
 
 #include <netdb.h>
 #include <netinet/in.h>
@@ -45,6 +44,7 @@
 #include <sys/types.h>          /* socket, bind, accept */
 #include <sys/socket.h>         /* socket, bind, accept, setsockopt, */
 #include <sys/stat.h>           /* open */
+#include <sys/uio.h>            /* writev */
 
 #include "compat.h"             /* oh what fun is porting */
 #include "defines.h"
@@ -57,6 +57,11 @@
 # include <netinet/tcp.h>
 #endif
 
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+
+#include "pack.h"
 #include "globals.h"
 
 
@@ -69,13 +74,20 @@ void dump_alias( virthost*);
 /* virthost */
 void add_virthost(const char *host, const char *ip, const char* document_root, const char* user_dir);
 virthost *find_virthost(const char *host, int hostlen);
+void add_virthost_certificate(const char *host, const char *cert,
+                              const char *key);
 void dump_virthost(void);
+void release_previous_packs(void);
+void check_virthost_leases(void);
+void check_pack_leases(void);
 
 /* directory_index */
-char *find_and_open_directory_index(const char *directory, int dirlen, int* fd);
+char *find_and_open_directory_index(struct docroot *root,
+    const char *directory, int dirlen, int* fd);
 void dump_directory_index(void);
 void add_directory_index( const char* index);
 char* find_default_directory_index( void);
+char *get_directory_index(int n);
 
 /* config */
 void read_config_files(void);
@@ -87,9 +99,82 @@ void read_config_files(void);
 
 int init_get(server_params*, request * req);
 int process_get(server_params*, request * req);
+int process_zerocopy_wait(request * req);
 int get_dir(request * req, struct stat *statbuf);
+int next_byte_range(request * req);
 const char* hydra_method_str( int method);
 
+/* encoding */
+const char *encoding_name(int encoding);
+int parse_accept_encoding(const char *value);
+int open_precompressed(request * req, int data_fd, struct stat *statbuf);
+const char *encoding_suffix(int encoding);
+
+/* compress */
+void add_compress_type(const char *type);
+void dump_compress_types(void);
+int compressible_type(const char *type, int len);
+struct compressed_entry *find_compressed(request * req, int data_fd,
+					 struct stat *s);
+void release_compressed(struct compressed_entry *e);
+void init_pipe_filter(request * req, const char *headers,
+		      const char *headers_end, int status);
+void print_pipe_filter_headers(request * req);
+int filter_pipe_data(request * req);
+void free_pipe_filter(struct pipe_filter *f);
+
+/* response_cache */
+struct response_entry *find_cached_response(request * req, struct stat *s);
+void send_cached_response(request * req);
+void cache_response(request * req, struct stat *orig, int data_fd);
+void release_cached_response(struct response_entry *e);
+void flush_response_cache(void);
+
+/* mmap_window */
+struct mmap_window *find_mmap_window(int data_fd, off_t pos);
+void release_mmap_window(struct mmap_window *w);
+void check_window_leases(void);
+void flush_mmap_windows(void);
+
+/* pack */
+struct pack_file *open_pack(const char *pathname);
+struct pack_file *hold_pack(struct pack_file *p);
+void release_pack(struct pack_file *p);
+void own_pack_lease(struct pack_file *p);
+void check_pack_lease(struct pack_file *p, const char *pathname);
+const struct pack_record *find_pack_record(struct pack_file *p,
+					   const char *path);
+const struct pack_record *find_pack_index(struct pack_file *p,
+					  const char *dir);
+int choose_pack_variant(request * req, const struct pack_record *r);
+
+/* docroot */
+struct docroot *open_docroot(const char *pathname);
+struct docroot *hold_docroot(struct docroot *root);
+void release_docroot(struct docroot *root);
+int docroot_open(struct docroot *root, const char *pathname);
+
+/* negative_cache */
+int negative_lookup(request * req);
+void negative_insert(request * req);
+void log_not_found(request * req);
+void flush_negative_cache(void);
+
+/* dir_listing */
+char *render_dir_listing(request * req, int json, size_t * len);
+int send_dir_listing(request * req, struct stat *s);
+void release_dir_listing(struct listing_entry *e);
+void flush_dir_listings(void);
+
+/* async_io */
+void init_async_io(server_params * params, int n);
+int async_open_file(server_params * params, request * req);
+int async_io_run(void (*func) (void *), void *arg);
+int init_async_fd(server_params * params);
+void async_io_complete(server_params * params);
+int process_async_open(server_params * params, request * req);
+void free_async_open(struct async_open *job);
+
 /* hash */
 unsigned get_mime_hash_value(char *extension);
 char *get_mime_type(const char *filename);
@@ -139,11 +224,16 @@ void print_ka_phrase(request * req);
 void print_content_type(request * req);
 void print_content_length(request * req);
 void print_last_modified(request * req);
+void print_content_encoding(request * req);
+void print_volatile_headers(request * req);
+void print_server_headers(request * req);
 void print_http_headers(request * req);
+void print_file_ok_headers(request * req);
 
 void send_r_request_file_ok(request * req); /* 200 */
 void send_r_request_cgi_status(request * req, char* status, char* desc);
 void send_r_request_partial(request * req); /* 206 */
+void send_r_request_multipart(request * req); /* 206 multipart/byteranges */
 void send_r_moved_perm(request * req, char *url); /* 301 */
 void send_r_moved_temp(request * req, char *url, char *more_hdr); /* 302 */
 void send_r_not_modified(request * req); /* 304 */
@@ -179,6 +269,7 @@ void sighup_run(void);
 void sigchld_run(void);
 void sigalrm_run(void);
 void sigusr1_run(void);
+void sigio_run(void);
 void sigterm_stage1_run(void);
 void sigterm_stage2_run(void);
 
@@ -205,6 +296,7 @@ char * normalize_path(char *path);
 int set_block_fd(int fd);
 int set_nonblock_fd(int fd);
 int set_cloexec_fd(int fd);
+int reopen_fd(int fd);
 void strlower(char *s);
 int check_host(char *r);
 void create_url( char * buffer, int buffer_size, int secure,
@@ -224,11 +316,17 @@ char *escape_uri(char *uri);
 void timestamp(void);
 
 /* mmap_cache */
-struct mmap_entry *find_mmap( int data_fd, struct stat *s);
+struct mmap_entry *find_mmap( int data_fd, struct stat *s,
+			      const char *pathname);
 void release_mmap( struct mmap_entry *e);
 void initialize_mmap( void);
 void mmap_reinit( void);
 int cleanup_mmap_list(int all);
+void write_mmap_manifest(void);
+void check_mmap_leases(void);
+int lease_file(int data_fd, struct stat *s);
+void check_docroot_leases(const char *path);
+void start_mmap_warmup(void);
 
 /* sublog */
 int open_gen_fd(char *spec);
@@ -238,6 +336,8 @@ int process_cgi_header(request * req);
 int read_from_pipe(request * req);
 int write_from_pipe(request * req);
 int io_shuffle(request * req);
+void init_io_shuffle(request * req);
+void io_shuffle_hints(request * req);
 
 /* ip */
 int bind_server(int server_s, char *ip, int port);
@@ -394,7 +394,13 @@ int init_cgi(request * req)
    int child_pid;
    int pipes[2];
 
-   SQUASH_KA(req);
+   /* The end of the output of parsed CGIs is marked using the
+    * chunked encoding, or by closing the connection (see
+    * init_pipe_filter()). For the rest keep-alive cannot be used.
+    */
+   if (req->is_cgi != CGI && req->is_cgi != HIC_CGI &&
+       req->is_cgi != CGI_ACTION)
+      SQUASH_KA(req);
 
    if (req->is_cgi == NPH || req->is_cgi == CGI 
       || req->is_cgi == CGI_ACTION) 
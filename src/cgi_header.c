@@ -130,9 +130,18 @@ int process_cgi_header(request * req)
         req->status = DONE;
         return 1;
     } else {                    /* not location */
-        char *dest;
+        char *dest, *body;
         int howmuch;
 
+        /* body is past the empty line that ends the headers */
+        body = c + 1;
+        if (*body == '\r')
+            body++;
+        body++;
+
+        init_pipe_filter(req, buf, c + 1,
+                         strncasecmp(buf, "Status: ", 8) ? 200 : atoi(buf + 8));
+
         if (!strncasecmp(buf, "Status: ", 8)) {
            char str_status[4];
            char desc[32];
@@ -191,6 +200,39 @@ int process_cgi_header(request * req)
                 req->header_end = c + 1;
             req->cgi_status = CGI_DONE;
         }
+
+        if (req->pipe_filter) {
+            /* The body goes through the filter first, so that
+             * the headers can be completed in its place.
+             */
+            char *headers = req->header_line;
+
+            howmuch = c + 1 - headers;
+            if (howmuch < 0)
+                howmuch = 0;
+
+            req->header_line = body;
+            if (filter_pipe_data(req) == -1 ||
+                req->header_line != req->header_end ||
+                dest + howmuch > req->buffer + BUFFER_SIZE) {
+                log_error_time();
+                fprintf(stderr, "Could not filter the CGI output! %s %d\n",
+                        __FILE__, __LINE__);
+                req->buffer_start = req->buffer_end = 0;
+                send_r_error(req);
+                return 0;
+            }
+
+            memmove(dest, headers, howmuch);
+            req->buffer_end += howmuch;
+            print_pipe_filter_headers(req);
+            req_write(req, "\r\n");
+
+            req->header_line = req->header_end = req->buffer + req->buffer_end;
+            req_flush(req);
+            return 1;
+        }
+
         howmuch = req->header_end - req->header_line;
 
         if (dest + howmuch > req->buffer + BUFFER_SIZE) {
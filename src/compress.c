@@ -0,0 +1,771 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the on the fly compression of responses.
+ * Static files are compressed once, and kept in the compressed
+ * cache. The output of CGIs is compressed as it is sent, and it
+ * is sent using the chunked transfer encoding if the client
+ * talks HTTP/1.1.
+ */
+
+#include "boa.h"
+
+int compression = 0;
+int compression_level = 6;
+int compression_min_size = 256;
+int compression_cache_size = 4 * 1024 * 1024;
+
+/* The mime types to compress. If none are given in the
+ * configuration, the default_compress_types[] are used.
+ */
+static char *compress_types[MAX_COMPRESS_TYPES];
+static int compress_types_size = 0;
+
+static const char *default_compress_types[] = {
+   "text/*", "application/javascript", "application/x-javascript",
+   "application/json", "application/xml", "image/svg+xml", NULL
+};
+
+/* Room left in front of the data of a chunk for its size, and
+ * after it for the CRLF and the last (empty) chunk.
+ */
+#define CHUNK_HEADER_SPACE 10	/* "ffffffff\r\n" */
+#define CHUNK_TRAILER_SPACE 7	/* "\r\n" "0\r\n\r\n" */
+
+void add_compress_type(const char *type)
+{
+   if (compress_types_size >= MAX_COMPRESS_TYPES) {
+      log_error_time();
+      fprintf(stderr, "Too many CompressionType entries, ignoring \"%s\"\n",
+	      type);
+      return;
+   }
+
+   compress_types[compress_types_size] = strdup(type);
+   if (compress_types[compress_types_size] == NULL)
+      DIE("Unable to strdup in add_compress_type");
+   compress_types_size++;
+}
+
+void dump_compress_types(void)
+{
+   int i;
+
+   for (i = 0; i < compress_types_size; i++) {
+      free(compress_types[i]);
+      compress_types[i] = NULL;
+   }
+   compress_types_size = 0;
+}
+
+static int match_type(const char *pattern, const char *type, int len)
+{
+   int plen = strlen(pattern);
+
+   /* "text/any" patterns (ending in a star) match every type
+    * starting with "text/".
+    */
+   if (plen >= 2 && pattern[plen - 1] == '*' && pattern[plen - 2] == '/')
+      return (len >= plen - 1 && strncasecmp(pattern, type, plen - 1) == 0);
+
+   return (len == plen && strncasecmp(pattern, type, len) == 0);
+}
+
+/*
+ * Name: compressible_type
+ * Description: Checks whether responses of the given mime type
+ * should be compressed. Only the first len characters of type are
+ * used; parameters such as "; charset=" must not be included.
+ */
+int compressible_type(const char *type, int len)
+{
+   int i;
+
+   if (compress_types_size == 0) {
+      for (i = 0; default_compress_types[i] != NULL; i++)
+	 if (match_type(default_compress_types[i], type, len))
+	    return 1;
+      return 0;
+   }
+
+   for (i = 0; i < compress_types_size; i++)
+      if (match_type(compress_types[i], type, len))
+	 return 1;
+
+   return 0;
+}
+
+/* Returns the length of the mime type, without any parameters.
+ */
+static int type_length(const char *type)
+{
+   int len = 0;
+
+   while (type[len] != 0 && type[len] != ';' && type[len] != ' ' &&
+	  type[len] != '\t' && type[len] != '\r' && type[len] != '\n')
+      len++;
+
+   return len;
+}
+
+/* The encoding we use for the client. gzip is preferred since
+ * some browsers had trouble with "deflate".
+ */
+static int choose_encoding(int accepted)
+{
+#ifdef HAVE_LIBZ
+   if (accepted & ENCODING_GZIP)
+      return ENCODING_GZIP;
+   if (accepted & ENCODING_DEFLATE)
+      return ENCODING_DEFLATE;
+#endif
+   return ENCODING_IDENTITY;
+}
+
+#ifdef HAVE_LIBZ
+
+static int init_deflate(z_stream * zs, int encoding)
+{
+   int level = compression_level;
+
+   if (level < 1 || level > 9)
+      level = Z_DEFAULT_COMPRESSION;
+
+   memset(zs, 0, sizeof(*zs));
+
+   /* windowBits + 16 produces the gzip format, instead of
+    * the zlib one used by "deflate".
+    */
+   return deflateInit2(zs, level, Z_DEFLATED,
+		       encoding == ENCODING_GZIP ? 15 + 16 : 15,
+		       8, Z_DEFAULT_STRATEGY);
+}
+
+/****************** The compressed cache ***********************/
+
+static struct compressed_entry *compressed_cache[COMPRESS_CACHE_HASH_SIZE];
+static size_t compressed_cache_bytes = 0;
+
+#ifdef ENABLE_SMP
+static pthread_mutex_t compressed_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define COMPRESSED_HASH(dev,ino) \
+	((((unsigned long int)(ino)) ^ ((unsigned long int)(dev))) % COMPRESS_CACHE_HASH_SIZE)
+
+/* How much memory an entry uses, for the cache budget.
+ */
+#define COMPRESSED_COST(e) (sizeof(struct compressed_entry) + (e)->len)
+
+static void free_compressed(struct compressed_entry *e)
+{
+   free(e->data);
+   free(e);
+}
+
+/* Removes the unused entries, least recently used first, until
+ * bytes more fit in the cache.
+ * No locking here. The caller has to do the proper locking.
+ *
+ * Returns: 1 if there is enough room, 0 otherwise.
+ */
+static int make_room(size_t bytes)
+{
+   struct compressed_entry **p, **oldest, *e;
+   int i;
+
+   if (bytes > (size_t) compression_cache_size)
+      return 0;
+
+   while (compressed_cache_bytes + bytes > (size_t) compression_cache_size) {
+      oldest = NULL;
+      for (i = 0; i < COMPRESS_CACHE_HASH_SIZE; i++) {
+	 for (p = &compressed_cache[i]; *p != NULL; p = &(*p)->next) {
+	    if ((*p)->use_count == 0 &&
+		(oldest == NULL || (*p)->last_used < (*oldest)->last_used))
+	       oldest = p;
+	 }
+      }
+
+      if (oldest == NULL)
+	 return 0;		/* everything is in use */
+
+      e = *oldest;
+      *oldest = e->next;
+      compressed_cache_bytes -= COMPRESSED_COST(e);
+      free_compressed(e);
+   }
+
+   return 1;
+}
+
+/* Removes e from the cache. It is freed when unused.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void uncache_compressed(struct compressed_entry *e)
+{
+   struct compressed_entry **p;
+
+   p = &compressed_cache[COMPRESSED_HASH(e->dev, e->ino)];
+   while (*p != e)
+      p = &(*p)->next;
+   *p = e->next;
+   e->next = NULL;
+   e->cached = 0;
+   compressed_cache_bytes -= COMPRESSED_COST(e);
+}
+
+/* Looks up an entry, and removes the entries of older versions
+ * of the file, if they are not in use.
+ * No locking here. The caller has to do the proper locking.
+ */
+static struct compressed_entry *lookup_compressed(struct stat *s,
+						  int encoding)
+{
+   struct compressed_entry **p, *e;
+
+   p = &compressed_cache[COMPRESSED_HASH(s->st_dev, s->st_ino)];
+   while ((e = *p) != NULL) {
+      if (e->dev == s->st_dev && e->ino == s->st_ino) {
+	 if (e->mtime == s->st_mtime && e->size == s->st_size) {
+	    if (e->encoding == encoding)
+	       return e;
+	 } else if (e->use_count == 0) {
+	    /* the file has changed */
+	    *p = e->next;
+	    compressed_cache_bytes -= COMPRESSED_COST(e);
+	    free_compressed(e);
+	    continue;
+	 }
+      }
+      p = &e->next;
+   }
+
+   return NULL;
+}
+
+/* Compresses size bytes of the file. Files that change while
+ * they are being read, are not compressed.
+ *
+ * Returns: the malloc()ed compressed data or NULL on error.
+ */
+static char *compress_file(int fd, off_t size, int encoding, size_t * len)
+{
+   char buf[16 * 1024];
+   z_stream zs;
+   char *out;
+   uLong bound;
+   off_t pos = 0;
+   int ret, flush, n;
+
+   if (init_deflate(&zs, encoding) != Z_OK)
+      return NULL;
+
+   bound = deflateBound(&zs, size);
+   out = malloc(bound);
+   if (out == NULL) {
+      deflateEnd(&zs);
+      return NULL;
+   }
+
+   zs.next_out = (Bytef *) out;
+   zs.avail_out = bound;
+
+   do {
+      n = sizeof(buf);
+      if (size - pos < n)
+	 n = size - pos;
+
+      if (n > 0) {
+	 n = pread(fd, buf, n, pos);
+	 if (n <= 0) {
+	    if (n == -1 && errno == EINTR)
+	       continue;
+	    goto fail;		/* error, or the file was truncated */
+	 }
+      }
+      pos += n;
+
+      flush = (pos == size) ? Z_FINISH : Z_NO_FLUSH;
+
+      zs.next_in = (Bytef *) buf;
+      zs.avail_in = n;
+      ret = deflate(&zs, flush);
+      if (ret == Z_STREAM_ERROR || zs.avail_in != 0)
+	 goto fail;
+   } while (flush != Z_FINISH);
+
+   if (ret != Z_STREAM_END)
+      goto fail;
+
+   *len = zs.total_out;
+   deflateEnd(&zs);
+
+   /* give back what deflateBound() overestimated */
+   if (*len > 0) {
+      char *p = realloc(out, *len);
+      if (p != NULL)
+	 out = p;
+   }
+
+   return out;
+
+ fail:
+   deflateEnd(&zs);
+   free(out);
+   return NULL;
+}
+
+/* Puts the compressed data of e, that was being compressed, in
+ * the cache. failed is true if the compression failed, rather
+ * than the file not being worth compressing.
+ *
+ * Returns: e, or NULL if it is freed, or has no data.
+ */
+static struct compressed_entry *install_compressed(struct compressed_entry
+						   *e, char *data,
+						   size_t len, int failed)
+{
+   unsigned int i = COMPRESSED_HASH(e->dev, e->ino);
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&compressed_lock);
+#endif
+   uncache_compressed(e);	/* its cost changes */
+   e->data = data;
+   e->len = len;
+
+   /* after a failure, the next request tries again */
+   if (!failed && make_room(COMPRESSED_COST(e))) {
+      e->cached = 1;
+      e->next = compressed_cache[i];
+      compressed_cache[i] = e;
+      compressed_cache_bytes += COMPRESSED_COST(e);
+   }
+
+   if (e->data == NULL) {
+      e->use_count--;
+      if (!e->cached)
+	 free_compressed(e);
+      e = NULL;
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&compressed_lock);
+#endif
+
+   return e;
+}
+
+/* Compresses the file of e, and puts the result in the cache.
+ *
+ * Returns: as install_compressed().
+ */
+static struct compressed_entry *compress_entry(struct compressed_entry *e,
+					       int fd)
+{
+   char *data;
+   size_t len;
+   int failed;
+
+   data = compress_file(fd, e->size, e->encoding, &len);
+   failed = (data == NULL);
+   if (failed) {
+      log_error_time();
+      fputs("could not compress file\n", stderr);
+   } else if (len >= (size_t) e->size) {
+      /* Remember that it does not compress, so that we
+       * do not try again.
+       */
+      free(data);
+      data = NULL;
+      len = 0;
+   }
+
+   return install_compressed(e, data, len, failed);
+}
+
+/* A compression that is done by an async I/O thread. The entry
+ * is held by the job, and fd is its own.
+ */
+struct compress_job {
+   struct compressed_entry *e;
+   int fd;
+};
+
+static void compress_job_run(void *arg)
+{
+   struct compress_job *job = arg;
+
+   job->e = compress_entry(job->e, job->fd);
+   if (job->e != NULL)
+      release_compressed(job->e);
+   close(job->fd);
+   free(job);
+}
+
+/* Hands the compression of e to the async I/O threads.
+ *
+ * Returns: 1 if it was queued, or 0 if the caller has to do it.
+ */
+static int compress_async(struct compressed_entry *e, int data_fd)
+{
+   struct compress_job *job;
+
+   job = malloc(sizeof(struct compress_job));
+   if (job == NULL)
+      return 0;
+
+   /* the request closes data_fd, but compress_file() uses pread() */
+   job->e = e;
+   job->fd = dup(data_fd);
+   if (job->fd == -1 || set_cloexec_fd(job->fd) == -1 ||
+       !async_io_run(compress_job_run, job)) {
+      if (job->fd != -1)
+	 close(job->fd);
+      free(job);
+      return 0;
+   }
+
+   return 1;
+}
+
+/*
+ * Name: find_compressed
+ * Description: Returns the compressed version of the file
+ * opened as data_fd, if the client accepts one, and the file
+ * is worth compressing. The file is compressed if it is not
+ * in the compressed cache; meanwhile, the other requests for
+ * it get NULL. If there are async I/O threads, the file is
+ * compressed there, and this request gets NULL too.
+ * req->vary_encoding is set if the response depends on
+ * Accept-Encoding.
+ *
+ * Returns: the entry, which must be given back using
+ * release_compressed(), or NULL if the file is to be sent
+ * as is.
+ */
+struct compressed_entry *find_compressed(request * req, int data_fd,
+					 struct stat *s)
+{
+   struct compressed_entry *e;
+   char *mime_type;
+   unsigned int i;
+   int encoding;
+
+   if (!S_ISREG(s->st_mode) || s->st_size < compression_min_size ||
+       s->st_size > COMPRESS_MAX_FILE_SIZE ||
+       s->st_size > compression_cache_size)
+      return NULL;
+
+   mime_type = get_mime_type(req->request_uri);
+   if (mime_type == NULL ||
+       !compressible_type(mime_type, type_length(mime_type)))
+      return NULL;
+
+   req->vary_encoding = 1;
+
+   encoding = choose_encoding(req->accept_encoding);
+   if (encoding == ENCODING_IDENTITY)
+      return NULL;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&compressed_lock);
+#endif
+   e = lookup_compressed(s, encoding);
+   if (e != NULL) {
+      e->last_used = current_time;
+      if (e->data != NULL)
+	 e->use_count++;
+      else
+	 e = NULL;		/* not worth it, or not ready yet */
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&compressed_lock);
+#endif
+      return e;
+   }
+
+   /* An entry that is being compressed is in the cache, so
+    * that the other requests for the file send it as is,
+    * instead of compressing it too.
+    */
+   e = calloc(1, sizeof(struct compressed_entry));
+   if (e == NULL || !make_room(COMPRESSED_COST(e))) {
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&compressed_lock);
+#endif
+      free(e);
+      return NULL;
+   }
+
+   e->dev = s->st_dev;
+   e->ino = s->st_ino;
+   e->mtime = s->st_mtime;
+   e->size = s->st_size;
+   e->encoding = encoding;
+   e->use_count = 1;
+   e->last_used = current_time;
+   e->cached = 1;
+
+   i = COMPRESSED_HASH(e->dev, e->ino);
+   e->next = compressed_cache[i];
+   compressed_cache[i] = e;
+   compressed_cache_bytes += COMPRESSED_COST(e);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&compressed_lock);
+#endif
+
+   /* do not compress on the server thread, if it can be helped */
+   if (compress_async(e, data_fd))
+      return NULL;
+
+   /* do not hold the lock while compressing */
+   return compress_entry(e, data_fd);
+}
+
+void release_compressed(struct compressed_entry *e)
+{
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&compressed_lock);
+#endif
+   e->use_count--;
+   if (e->use_count == 0 && !e->cached)
+      free_compressed(e);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&compressed_lock);
+#endif
+}
+
+#endif				/* HAVE_LIBZ */
+
+/****************** The CGI output filter ***********************/
+
+/* Returns the value of the header name (ie. "Content-Type:") in
+ * the CGI headers [start, end), or NULL if it is not there.
+ */
+static const char *find_cgi_header(const char *start, const char *end,
+				   const char *name)
+{
+   const char *p = start;
+   int len = strlen(name);
+
+   while (p < end) {
+      if (end - p > len && strncasecmp(p, name, len) == 0) {
+	 p += len;
+	 while (*p == ' ' || *p == '\t')
+	    p++;
+	 return p;
+      }
+      while (p < end && *p != '\n')
+	 p++;
+      p++;
+   }
+
+   return NULL;
+}
+
+/*
+ * Name: init_pipe_filter
+ * Description: Decides whether the output of the CGI, whose headers
+ * are [headers, headers_end), is compressed and/or sent using the
+ * chunked encoding. Sets req->pipe_filter if so. Must be called
+ * before any headers are written, since keep-alive is turned off if
+ * the end of the response cannot be told otherwise.
+ */
+void init_pipe_filter(request * req, const char *headers,
+		      const char *headers_end, int status)
+{
+   struct pipe_filter *f;
+   const char *type;
+   int chunked, encoding = ENCODING_IDENTITY;
+
+   if (req->method == M_HEAD || req->http_version == HTTP_0_9)
+      return;
+
+   /* These have no body. Whatever the CGI writes after the headers
+    * is dropped, or it would be taken for the next response.
+    */
+   if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+      f = calloc(1, sizeof(struct pipe_filter));
+      if (f == NULL) {
+	 SQUASH_KA(req);
+	 return;
+      }
+      f->encoding = ENCODING_IDENTITY;
+      f->discard = 1;
+      f->out_start = f->out_end = f->out;
+      req->pipe_filter = f;
+      return;
+   }
+
+   /* The CGI knows the length, or does its own framing.
+    */
+   if (find_cgi_header(headers, headers_end, "Content-Length:") != NULL ||
+       find_cgi_header(headers, headers_end, "Transfer-Encoding:") != NULL)
+      return;
+
+   if (compression &&
+       find_cgi_header(headers, headers_end, "Content-Encoding:") == NULL &&
+       (type = find_cgi_header(headers, headers_end, "Content-Type:")) != NULL &&
+       compressible_type(type, type_length(type))) {
+      req->vary_encoding = 1;
+      encoding = choose_encoding(req->accept_encoding);
+   }
+
+   chunked = (req->http_version == HTTP_1_1);
+
+   if (!chunked) {
+      /* the end of the response is the end of the connection */
+      SQUASH_KA(req);
+      if (encoding == ENCODING_IDENTITY)
+	 return;
+   }
+
+   f = malloc(sizeof(struct pipe_filter));
+   if (f == NULL) {
+      SQUASH_KA(req);
+      return;
+   }
+
+#ifdef HAVE_LIBZ
+   if (encoding != ENCODING_IDENTITY &&
+       init_deflate(&f->zs, encoding) != Z_OK) {
+      log_error_doc(req);
+      fprintf(stderr, "deflateInit2 failed\n");
+      encoding = ENCODING_IDENTITY;
+      if (!chunked) {
+	 free(f);
+	 return;
+      }
+   }
+#endif
+
+   f->chunked = chunked;
+   f->encoding = encoding;
+   f->finished = 0;
+   f->discard = 0;
+   f->out_start = f->out_end = f->out;
+
+   req->encoding = encoding;
+   req->pipe_filter = f;
+}
+
+/* Writes the headers that describe the filtered output.
+ */
+void print_pipe_filter_headers(request * req)
+{
+   print_content_encoding(req);
+   if (req->pipe_filter != NULL && req->pipe_filter->chunked)
+      req_write(req, "Transfer-Encoding: chunked\r\n");
+}
+
+/*
+ * Name: filter_pipe_data
+ * Description: Filters the CGI output in [req->header_line,
+ * req->header_end) into req->pipe_filter->out. req->header_line
+ * is moved past the data consumed. When the CGI is done and all
+ * its output has been consumed, the end of the response is
+ * produced.
+ *
+ * Returns: the number of bytes produced, or -1 on error.
+ */
+int filter_pipe_data(request * req)
+{
+   struct pipe_filter *f = req->pipe_filter;
+   char *data = f->out + CHUNK_HEADER_SPACE;
+   int space = sizeof(f->out) - CHUNK_HEADER_SPACE - CHUNK_TRAILER_SPACE;
+   int in = req->header_end - req->header_line;
+   int len, finish;
+
+   if (!f->chunked) {
+      data = f->out;
+      space = sizeof(f->out);
+   }
+
+   f->out_start = f->out_end = data;
+   if (f->finished)
+      return 0;
+
+   finish = (req->cgi_status == CGI_DONE);
+
+   if (f->discard) {
+      req->header_line = req->header_end;
+      f->finished = finish;
+      return 0;
+   }
+
+#ifdef HAVE_LIBZ
+   if (f->encoding != ENCODING_IDENTITY) {
+      int ret;
+
+      f->zs.next_in = (Bytef *) req->header_line;
+      f->zs.avail_in = in;
+      f->zs.next_out = (Bytef *) data;
+      f->zs.avail_out = space;
+
+      ret = deflate(&f->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+      if (ret == Z_STREAM_ERROR) {
+	 log_error_doc(req);
+	 fprintf(stderr, "deflate failed\n");
+	 return -1;
+      }
+
+      req->header_line += in - f->zs.avail_in;
+      len = space - f->zs.avail_out;
+      finish = (ret == Z_STREAM_END);
+   } else
+#endif
+   {
+      len = (in < space) ? in : space;
+      memcpy(data, req->header_line, len);
+      req->header_line += len;
+      finish = finish && (len == in);
+   }
+
+   f->out_end = data + len;
+
+   if (f->chunked && len > 0) {
+      char size[CHUNK_HEADER_SPACE + 1];
+      int n;
+
+      n = sprintf(size, "%x\r\n", len);
+      f->out_start = data - n;
+      memcpy(f->out_start, size, n);
+      memcpy(f->out_end, "\r\n", 2);
+      f->out_end += 2;
+   }
+
+   if (finish) {
+      f->finished = 1;
+      if (f->chunked) {
+	 memcpy(f->out_end, "0\r\n\r\n", 5);
+	 f->out_end += 5;
+      }
+   }
+
+   return f->out_end - f->out_start;
+}
+
+void free_pipe_filter(struct pipe_filter *f)
+{
+#ifdef HAVE_LIBZ
+   if (f->encoding != ENCODING_IDENTITY)
+      deflateEnd(&f->zs);
+#endif
+   free(f);
+}
@@ -47,6 +47,12 @@ char * default_charset = NULL;
 
 int max_files_cache = 256;
 int max_file_size_cache = 100 * 1024;
+int file_leases = 1;
+char *cache_manifest;
+int cache_warmup_size = 32 * 1024 * 1024;
+int cache_warmup_populate = 0;
+int drop_behind_size = 0;
+int zerocopy_threshold = 0;
 
 int max_server_threads = 1;
 
@@ -58,12 +64,21 @@ int ssl_verify = 0;
 int boa_ssl = 0;
 int ssl_port = 443;
 int ssl_dh_bits = 1024; /* default value */
+char *ssl_dh_params_file = NULL;
+char *ssl_rsa_params_file = NULL;
 int ssl_session_timeout = 3600;
+int ssl_session_tickets = 1;
+char *ssl_ticket_key_file = NULL;
+char *ssl_session_cache_file = NULL;
+int ssl_handshake_threads = 0;
+int ssl_dynamic_record_threshold = 65536;
 int maintenance_interval = 432000; /* every 5 days */
 
 char *ssl_ciphers = NULL;
 char *ssl_mac = NULL;
 char *ssl_kx = NULL;
+char *ssl_curves = NULL;
+char *ssl_priority = NULL;
 char *ssl_comp = NULL;
 char *ssl_protocol = NULL;
 
@@ -99,10 +114,12 @@ static void c_set_longint(char *v1, char* v2, char* v3, char* v4, void *t);
 static void c_set_unity(char *v1, char* v2, char* v3, char* v4, void *t);
 static void c_add_type(char *v1, char* v2, char* v3, char* v4, void *t);
 static void c_add_vhost(char *v1, char* v2, char* v3, char*v4, void *t);
+static void c_add_vhost_cert(char *v1, char* v2, char* v3, char*v4, void *t);
 static void c_set_documentroot(char *v1, char* v2, char* v3, char*v4, void *t);
 static void c_add_alias(char *v1, char* v2, char* v3, char* v4, void *t);
 static void c_add_dirindex(char *v1, char* v2, char* v3, char* v4, void *t);
 static void c_add_cgi_action(char *v1, char* v2, char* v3, char* v4, void *t);
+static void c_add_compress_type(char *v1, char* v2, char* v3, char* v4, void *t);
 #ifdef ENABLE_ACCESS_LISTS
 static void c_add_access(char *v1, char *v2, char* v3, char* v4, void *t);
 #endif
@@ -125,6 +142,8 @@ struct ccommand clist[] = {
     {"SSLVerifyClient", S1A, c_set_int, &ssl_verify},
     {"SSLCiphers", S1A, c_set_string, &ssl_ciphers},
     {"SSLKeyExchangeAlgorithms", S1A, c_set_string, &ssl_kx},
+    {"SSLCurves", S1A, c_set_string, &ssl_curves},
+    {"SSLPriority", S1A, c_set_string, &ssl_priority},
     {"SSLMACAlgorithms", S1A, c_set_string, &ssl_mac},
     {"SSLProtocols", S1A, c_set_string, &ssl_protocol},
     {"SSLCompressionMethods", S1A, c_set_string, &ssl_comp},
@@ -135,7 +154,14 @@ struct ccommand clist[] = {
     {"SSL", S1A, c_set_int, &boa_ssl},
     {"SSLPort", S1A, c_set_int, &ssl_port},
     {"SSLDHBits", S1A, c_set_int, &ssl_dh_bits},
+    {"SSLDHParamsFile", S1A, c_set_string, &ssl_dh_params_file},
+    {"SSLRSAParamsFile", S1A, c_set_string, &ssl_rsa_params_file},
     {"SSLSessionTimeout", S1A, c_set_int, &ssl_session_timeout},
+    {"SSLSessionTickets", S1A, c_set_int, &ssl_session_tickets},
+    {"SSLSessionTicketKey", S1A, c_set_string, &ssl_ticket_key_file},
+    {"SSLSessionCacheFile", S1A, c_set_string, &ssl_session_cache_file},
+    {"SSLHandshakeThreads", S1A, c_set_int, &ssl_handshake_threads},
+    {"SSLDynamicRecordThreshold", S1A, c_set_int, &ssl_dynamic_record_threshold},
     {"MaintenanceInterval", S1A, c_set_int, &maintenance_interval},
     {"Threads", S1A, c_set_int, &max_server_threads},
     {"Port", S1A, c_set_int, &server_port},
@@ -155,6 +181,8 @@ struct ccommand clist[] = {
     {"DirectoryIndex", S1A, c_add_dirindex, NULL},
     {"DirectoryMaker", S1A, c_set_string, &dirmaker},
     {"DirectoryCache", S1A, c_set_string, &cachedir},
+    {"DirectoryListing", S0A, c_set_unity, &directory_listing},
+    {"DirectoryListingCacheSize", S1A, c_set_int, &directory_listing_cache_size},
     {"KeepAliveMax", S1A, c_set_int, &ka_max},
     {"KeepAliveTimeout", S1A, c_set_int, &ka_timeout},
     {"MimeTypes", S1A, c_set_string, &mime_types},
@@ -170,12 +198,32 @@ struct ccommand clist[] = {
     {"CGILog", S1A, c_set_string, &cgi_log_name},
 /* HOST - IP - DOCUMENT_ROOT - USER_DIR */
     {"VirtualHost", S4A, c_add_vhost, NULL},
+    {"SSLVirtualHostCertificate", S3A, c_add_vhost_cert, NULL},
     {"SinglePostLimit", S1A, c_set_int, &single_post_limit},
     {"CGIPath", S1A, c_set_string, &cgi_path},
     {"MaxSSLConnections", S1A, c_set_longint, &max_ssl_connections},
     {"MaxConnections", S1A, c_set_longint, &max_connections},
     {"MaxFilesCache", S1A, c_set_int, &max_files_cache},
     {"MaxFileSizeCache", S1A, c_set_int, &max_file_size_cache},
+    {"FileLeases", S1A, c_set_int, &file_leases},
+    {"CacheManifest", S1A, c_set_string, &cache_manifest},
+    {"CacheWarmupSize", S1A, c_set_int, &cache_warmup_size},
+    {"CacheWarmupPopulate", S0A, c_set_unity, &cache_warmup_populate},
+    {"DropBehindSize", S1A, c_set_int, &drop_behind_size},
+    {"WindowCacheSize", S1A, c_set_int, &window_cache_size},
+    {"NegativeCacheSize", S1A, c_set_int, &negative_cache_size},
+    {"NegativeCacheTTL", S1A, c_set_int, &negative_cache_ttl},
+    {"ZeroCopyThreshold", S1A, c_set_int, &zerocopy_threshold},
+    {"AsyncIOThreads", S1A, c_set_int, &async_io_threads},
+    {"AsyncIOPrefetch", S0A, c_set_unity, &async_io_prefetch},
+    {"PrecompressedFiles", S0A, c_set_unity, &precompressed_files},
+    {"Compression", S0A, c_set_unity, &compression},
+    {"CompressionLevel", S1A, c_set_int, &compression_level},
+    {"CompressionMinSize", S1A, c_set_int, &compression_min_size},
+    {"CompressionType", S1A, c_add_compress_type, NULL},
+    {"CompressionCacheSize", S1A, c_set_int, &compression_cache_size},
+    {"ResponseCacheSize", S1A, c_set_int, &response_cache_size},
+    {"ResponseCacheMaxFileSize", S1A, c_set_int, &response_cache_max_file_size},
 #ifdef ENABLE_ACCESS_LISTS
     {"Allow", S2A, c_add_access, (void*)ACCESS_ALLOW},
     {"Deny", S2A, c_add_access, (void*)ACCESS_DENY},
@@ -327,11 +375,21 @@ static void c_add_dirindex(char *v1, char* v2, char* v3, char* v4, void *t)
     add_directory_index(v1);
 }
 
+static void c_add_compress_type(char *v1, char* v2, char* v3, char* v4, void *t)
+{
+    add_compress_type(v1);
+}
+
 static void c_add_vhost(char *v1, char *v2, char* v3, char* v4, void *t)
 {
     add_virthost(v1, v2, v3, v4);
 }
 
+static void c_add_vhost_cert(char *v1, char *v2, char* v3, char* v4, void *t)
+{
+    add_virthost_certificate(v1, v2, v3);
+}
+
 
 static void c_add_alias(char *v1, char *v2, char* v3, char* v4, void *t)
 {
@@ -397,6 +455,14 @@ void read_config_files(void)
         tempdir = "/tmp";
     tempdir_len = strlen( tempdir);
 
+#ifndef HAVE_LIBZ
+    if (compression) {
+        fputs("Compression is not available in this build "
+              "(zlib was not found)\n", stderr);
+        compression = 0;
+    }
+#endif
+
     if (single_post_limit < 0) {
         fprintf(stderr, "Invalid value for single_post_limit: %d\n",
                 single_post_limit);
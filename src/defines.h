@@ -163,6 +163,8 @@
 #define DEAD                   11
 #define FINISH_HANDSHAKE       12
 #define SEND_ALERT             13
+#define ASYNC_OPEN             14
+#define ZEROCOPY_WAIT          15
 
 
 /************** CGI TYPE (req->is_cgi) ******************/
@@ -188,6 +190,16 @@
 /********* SSL stuff */
 #define MIN_MAINTENANCE_INTERVAL 1800 /* half an hour */
 
+/* Dynamic record sizing: the first bytes of a response (and those
+ * after an idle connection) are sent in records that fit in a
+ * single TCP segment, along with the record overhead, so that the
+ * client can decrypt each one as it arrives. Full size records
+ * follow, once the congestion window has grown.
+ */
+#define SSL_SMALL_RECORD_SIZE   1360
+#define SSL_MAX_RECORD_SIZE     16384
+#define SSL_RECORD_IDLE_TIME    1 /* seconds */
+
 /********* CGI STATUS CONSTANTS (req->cgi_status) *******/
 #define CGI_PARSE 1
 #define CGI_BUFFER 2
@@ -204,6 +216,54 @@
 /***************** Defines for break_comma_list() *************/
 #define MAX_COMMA_SEP_ELEMENTS 6
 
+/***************** Multiple ranges (multipart/byteranges) *****/
+#define MAX_BYTE_RANGES 16 /* if more ranges are requested, the whole
+                            * file is sent.
+                            */
+#define BYTE_RANGE_BOUNDARY_LENGTH 24
+
+/***************** Content-Encoding (req->encoding) ***********/
+#define ENCODING_IDENTITY 0
+#define ENCODING_GZIP 1
+#define ENCODING_DEFLATE 2
+#define ENCODING_BR 4
+
+#define VARIANT_CACHE_SIZE 512 /* files whose precompressed versions
+                                * are remembered.
+                                */
+#define PRECOMPRESSED_RECHECK_TIME 30 /* seconds */
+
+/***************** On the fly compression *********************/
+#define COMPRESS_CACHE_HASH_SIZE 256
+#define COMPRESS_MAX_FILE_SIZE (1024*1024) /* larger files are sent
+                                            * uncompressed.
+                                            */
+#define MAX_COMPRESS_TYPES 32
+#define PIPE_FILTER_BUFFER_SIZE (BUFFER_SIZE + 128)
+
+/***************** Directory listings *************************/
+#define LISTING_CACHE_HASH_SIZE 64
+#define LISTING_RECHECK_TIME 30 /* seconds */
+
+/***************** Large files (io_shuffle) ********************/
+#define IO_BUFFER_SIZE (64*1024) /* chunks read when not using sendfile() */
+#define READAHEAD_WINDOW (2*1024*1024)
+#define DROP_BEHIND_WINDOW (1024*1024) /* sent data kept in the page cache */
+#define MMAP_WINDOW_SIZE (2*1024*1024) /* must be a multiple of the page size */
+#define WINDOW_CACHE_HASH_SIZE 64
+
+/***************** Document roots *****************************/
+#define DOCROOT_DIR_HASH_SIZE 16
+#define DOCROOT_DIR_CACHE_SIZE 64 /* open directories per document root */
+#define DOCROOT_DIR_RECHECK_TIME 1 /* seconds */
+
+/***************** Missing files ******************************/
+#define NEGATIVE_CACHE_HASH_SIZE 1024
+#define NOT_FOUND_LOG_RATE 10 /* "document open" errors per second */
+
+/***************** Whole response cache ***********************/
+#define RESPONSE_CACHE_HASH_SIZE 256
+
 /***************** HTTP HEADER STUFF ***************************/
 
 #define TEXT_HTML "text/html; charset=ISO-8859-1"
@@ -228,11 +288,16 @@
 # define INT_MAX 2147483647L
 #endif
 
+#ifndef OFF_T_MAX
+# define OFF_T_MAX ((off_t) ~((off_t) 1 << (sizeof(off_t) * 8 - 1)))
+#endif
+
 #define HEX(x) (((x)>9)?(('a'-10)+(x)):('0'+(x)))
 
 #ifdef USE_POLL
 # define BOA_READ POLLIN|POLLPRI
 # define BOA_WRITE POLLOUT
+# define BOA_ERROR 0 /* POLLERR is always reported */
 # define BOA_FD_SET(req, thefd,where) { struct pollfd *my_pfd; \
 	   my_pfd = &params->pfds[params->pfd_len]; \
 	   req->pollfd_id = params->pfd_len++; \
@@ -244,6 +309,7 @@
 #else /* SELECT */
 # define BOA_READ &params->block_read_fdset
 # define BOA_WRITE &params->block_write_fdset
+# define BOA_ERROR &params->block_read_fdset /* a socket error makes it readable */
 # define BOA_FD_SET(req, fd, where) { FD_SET(fd, where); if (fd > params->max_fd) params->max_fd = fd; }
 # define BOA_FD_CLR(req, fd, where) { FD_CLR(fd, where); }
 # define BOA_FD_ZERO( fdset) FD_ZERO( fdset)
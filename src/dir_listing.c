@@ -0,0 +1,585 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the builtin directory listings. They are
+ * generated in the server (no DirectoryMaker CGI is spawned), and
+ * are kept in memory, keyed by the directory's device, inode and
+ * modification time. A JSON listing is sent instead of the HTML one
+ * if the query string contains "format=json".
+ */
+
+#include "boa.h"
+#include <dirent.h>
+
+int directory_listing = 0;
+int directory_listing_cache_size = 1024 * 1024;
+
+static struct listing_entry *listing_cache[LISTING_CACHE_HASH_SIZE];
+static size_t listing_cache_bytes = 0;
+
+#ifdef ENABLE_SMP
+static pthread_mutex_t listing_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define LISTING_HASH(dev,ino) \
+	((((unsigned long int)(ino)) ^ ((unsigned long int)(dev))) % LISTING_CACHE_HASH_SIZE)
+
+#define LISTING_COST(e) (sizeof(struct listing_entry) + (e)->len + \
+	strlen((e)->uri))
+
+/* A growing buffer, where the listing is rendered.
+ */
+struct listing_buf {
+   char *data;
+   size_t len;
+   size_t size;
+   int failed;			/* out of memory */
+};
+
+static void buf_append(struct listing_buf *b, const char *s, size_t len)
+{
+   char *p;
+   size_t size;
+
+   if (b->failed)
+      return;
+
+   if (b->len + len > b->size) {
+      size = b->size ? b->size * 2 : 4096;
+      while (size < b->len + len)
+	 size *= 2;
+      p = realloc(b->data, size);
+      if (p == NULL) {
+	 b->failed = 1;
+	 return;
+      }
+      b->data = p;
+      b->size = size;
+   }
+
+   memcpy(b->data + b->len, s, len);
+   b->len += len;
+}
+
+static void buf_puts(struct listing_buf *b, const char *s)
+{
+   buf_append(b, s, strlen(s));
+}
+
+static void buf_html(struct listing_buf *b, const char *s)
+{
+   for (; *s; s++) {
+      switch (*s) {
+      case '<':
+	 buf_puts(b, "&lt;");
+	 break;
+      case '>':
+	 buf_puts(b, "&gt;");
+	 break;
+      case '&':
+	 buf_puts(b, "&amp;");
+	 break;
+      case '"':
+	 buf_puts(b, "&quot;");
+	 break;
+      default:
+	 buf_append(b, s, 1);
+      }
+   }
+}
+
+/* Escapes a file name to be used in a relative URL. Unlike
+ * escape_string(), '?' and ':' are escaped too, since they would
+ * start a query string or look like a scheme.
+ */
+static void buf_href(struct listing_buf *b, const char *s)
+{
+   char hex[4];
+   unsigned char c;
+
+   for (; *s; s++) {
+      c = *s;
+      if (needs_escape(c) || c == '?' || c == ':') {
+	 sprintf(hex, "%%%02X", c);
+	 buf_append(b, hex, 3);
+      } else if (c == '&')
+	 buf_puts(b, "&amp;");
+      else
+	 buf_append(b, s, 1);
+   }
+}
+
+static void buf_json(struct listing_buf *b, const char *s)
+{
+   char hex[8];
+   unsigned char c;
+
+   buf_append(b, "\"", 1);
+   for (; *s; s++) {
+      c = *s;
+      if (c == '"' || c == '\\') {
+	 buf_append(b, "\\", 1);
+	 buf_append(b, s, 1);
+      } else if (c < 0x20) {
+	 sprintf(hex, "\\u%04x", c);
+	 buf_append(b, hex, 6);
+      } else
+	 buf_append(b, s, 1);
+   }
+   buf_append(b, "\"", 1);
+}
+
+struct listing_item {
+   struct dirent *d;		/* as returned by scandir() */
+   char *name;
+   int is_dir;
+   off_t size;
+   time_t mtime;
+};
+
+static int select_entry(const struct dirent *d)
+{
+   /* hidden files are not listed, as in boa_indexer */
+   return d->d_name[0] != '.';
+}
+
+/* Reads the directory req->pathname. The entries are sorted by name,
+ * with the directories first.
+ *
+ * Returns: the number of items, or -1 on error.
+ */
+static int read_listing(request * req, struct listing_item **items)
+{
+   struct dirent **names;
+   struct listing_item *v;
+   struct stat st;
+   char path[MAX_PATH_LENGTH + 1];
+   int n, i, j, dirlen;
+
+   n = scandir(req->pathname, &names, select_entry, alphasort);
+   if (n < 0)
+      return -1;
+
+   v = malloc(sizeof(struct listing_item) * (n + 1));
+   if (v == NULL) {
+      for (i = 0; i < n; i++)
+	 free(names[i]);
+      free(names);
+      return -1;
+   }
+
+   dirlen = strlen(req->pathname);
+   memcpy(path, req->pathname, dirlen);
+
+   for (i = j = 0; i < n; i++) {
+      if (dirlen + strlen(names[i]->d_name) > MAX_PATH_LENGTH ||
+	  (strcpy(path + dirlen, names[i]->d_name),
+	   stat(path, &st) == -1)) {
+	 free(names[i]);
+	 continue;
+      }
+      v[j].d = names[i];
+      v[j].name = names[i]->d_name;
+      v[j].is_dir = S_ISDIR(st.st_mode);
+      v[j].size = st.st_size;
+      v[j].mtime = st.st_mtime;
+      j++;
+   }
+   free(names);
+
+   *items = v;
+   return j;
+}
+
+static void free_listing(struct listing_item *items, int n)
+{
+   int i;
+
+   for (i = 0; i < n; i++)
+      free(items[i].d);
+   free(items);
+}
+
+static void render_html(struct listing_buf *b, request * req,
+			struct listing_item *items, int n)
+{
+   char line[128];
+   struct tm tm;
+   int i, pass;
+
+   buf_puts(b, "<html>\n<head>\n<title>Index of ");
+   buf_html(b, req->request_uri);
+   buf_puts(b, "</title>\n</head>\n\n<body>\n<h2>Index of ");
+   buf_html(b, req->request_uri);
+   buf_puts(b, "</h2>\n<table>\n");
+
+   if (strcmp(req->request_uri, "/") != 0)
+      buf_puts(b, "<tr><td colspan=3><a href=\"../\">Parent Directory</a>"
+	       "</td></tr>\n");
+
+   /* the directories first */
+   for (pass = 1; pass >= 0; pass--) {
+      for (i = 0; i < n; i++) {
+	 if (items[i].is_dir != pass)
+	    continue;
+
+	 buf_puts(b, "<tr><td><a href=\"");
+	 buf_href(b, items[i].name);
+	 buf_puts(b, pass ? "/\">" : "\">");
+	 buf_html(b, items[i].name);
+	 buf_puts(b, pass ? "/</a></td>" : "</a></td>");
+
+	 gmtime_r(&items[i].mtime, &tm);
+	 strftime(line, sizeof(line), "<td align=right>%d-%b-%Y %H:%M</td>",
+		  &tm);
+	 buf_puts(b, line);
+
+	 if (pass)
+	    buf_puts(b, "<td align=right>-</td></tr>\n");
+	 else {
+	    sprintf(line, "<td align=right>%llu</td></tr>\n",
+		    (unsigned long long) items[i].size);
+	    buf_puts(b, line);
+	 }
+      }
+   }
+
+   buf_puts(b, "</table>\n</body>\n</html>\n");
+}
+
+static void render_json(struct listing_buf *b, request * req,
+			struct listing_item *items, int n)
+{
+   char line[128];
+   int i, pass, first = 1;
+
+   buf_puts(b, "{\"path\":");
+   buf_json(b, req->request_uri);
+   buf_puts(b, ",\"entries\":[");
+
+   for (pass = 1; pass >= 0; pass--) {
+      for (i = 0; i < n; i++) {
+	 if (items[i].is_dir != pass)
+	    continue;
+
+	 buf_puts(b, first ? "\n{\"name\":" : ",\n{\"name\":");
+	 first = 0;
+	 buf_json(b, items[i].name);
+	 sprintf(line, ",\"type\":\"%s\",\"size\":%llu,\"mtime\":%lu}",
+		 pass ? "directory" : "file",
+		 (unsigned long long) items[i].size,
+		 (unsigned long) items[i].mtime);
+	 buf_puts(b, line);
+      }
+   }
+
+   buf_puts(b, "\n]}\n");
+}
+
+/*
+ * Name: render_dir_listing
+ * Description: Generates the listing of the directory req->pathname,
+ * titled req->request_uri.
+ *
+ * Returns: the malloced listing (its length in *len), or NULL on error.
+ */
+char *render_dir_listing(request * req, int json, size_t * len)
+{
+   struct listing_item *items;
+   struct listing_buf b;
+   int n;
+
+   n = read_listing(req, &items);
+   if (n == -1)
+      return NULL;
+
+   memset(&b, 0, sizeof(b));
+   if (json)
+      render_json(&b, req, items, n);
+   else
+      render_html(&b, req, items, n);
+
+   free_listing(items, n);
+
+   if (b.failed) {
+      free(b.data);
+      return NULL;
+   }
+
+   *len = b.len;
+   return b.data;
+}
+
+static void free_listing_entry(struct listing_entry *e)
+{
+   free(e->data);
+   free(e->uri);
+   free(e);
+}
+
+/* No locking here. The caller has to do the proper locking.
+ */
+static void remove_listing(struct listing_entry **p)
+{
+   struct listing_entry *e = *p;
+
+   *p = e->next;
+   listing_cache_bytes -= LISTING_COST(e);
+   e->cached = 0;
+   if (e->use_count == 0)
+      free_listing_entry(e);
+}
+
+/* Removes the unused entries, least recently used first, until
+ * bytes more fit in the cache.
+ * No locking here. The caller has to do the proper locking.
+ *
+ * Returns: 1 if there is enough room, 0 otherwise.
+ */
+static int make_room(size_t bytes)
+{
+   struct listing_entry **p, **oldest;
+   int i;
+
+   if (bytes > (size_t) directory_listing_cache_size)
+      return 0;
+
+   while (listing_cache_bytes + bytes >
+	  (size_t) directory_listing_cache_size) {
+      oldest = NULL;
+      for (i = 0; i < LISTING_CACHE_HASH_SIZE; i++) {
+	 for (p = &listing_cache[i]; *p != NULL; p = &(*p)->next) {
+	    if ((*p)->use_count == 0 &&
+		(oldest == NULL || (*p)->last_used < (*oldest)->last_used))
+	       oldest = p;
+	 }
+      }
+
+      if (oldest == NULL)
+	 return 0;		/* everything is in use */
+
+      remove_listing(oldest);
+   }
+
+   return 1;
+}
+
+/* Looks up the listing of the directory described by s, as seen
+ * through uri. Stale entries are removed, if not in use.
+ * No locking here. The caller has to do the proper locking.
+ */
+static struct listing_entry *lookup_listing(struct stat *s,
+					    const char *uri, int json)
+{
+   struct listing_entry **p, *e;
+
+   p = &listing_cache[LISTING_HASH(s->st_dev, s->st_ino)];
+   while ((e = *p) != NULL) {
+      if (e->dev == s->st_dev && e->ino == s->st_ino) {
+	 /* the sizes and dates of the files in the directory may
+	  * change, without changing the directory's mtime.
+	  */
+	 if (e->mtime != s->st_mtime ||
+	     current_time - e->created >= LISTING_RECHECK_TIME) {
+	    if (e->use_count == 0) {
+	       remove_listing(p);
+	       continue;
+	    }
+	 } else if (e->json == json && strcmp(e->uri, uri) == 0)
+	    return e;
+      }
+      p = &e->next;
+   }
+
+   return NULL;
+}
+
+static int wants_json(request * req)
+{
+   const char *p = req->query_string;
+
+   while (p != NULL) {
+      if (strncmp(p, "format=json", 11) == 0 &&
+	  (p[11] == 0 || p[11] == '&'))
+	 return 1;
+      p = strchr(p, '&');
+      if (p)
+	 p++;
+   }
+
+   return 0;
+}
+
+/* Returns the listing of the directory described by s, from the
+ * cache, or a new one (which is added to the cache if possible).
+ */
+static struct listing_entry *find_dir_listing(request * req,
+					      struct stat *s, int json)
+{
+   struct listing_entry *e, *old;
+   size_t len;
+   char *data;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&listing_lock);
+#endif
+   e = lookup_listing(s, req->request_uri, json);
+   if (e != NULL) {
+      e->use_count++;
+      e->last_used = current_time;
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&listing_lock);
+#endif
+
+   if (e != NULL)
+      return e;
+
+   /* do not hold the lock while reading the directory */
+   data = render_dir_listing(req, json, &len);
+   if (data == NULL)
+      return NULL;
+
+   e = calloc(1, sizeof(struct listing_entry));
+   if (e == NULL || (e->uri = strdup(req->request_uri)) == NULL) {
+      free(e);
+      free(data);
+      return NULL;
+   }
+
+   e->data = data;
+   e->len = len;
+   e->dev = s->st_dev;
+   e->ino = s->st_ino;
+   e->mtime = s->st_mtime;
+   e->json = json;
+   e->created = e->last_used = current_time;
+   e->use_count = 1;
+
+   /* A directory modified in this second may change again, without
+    * changing its mtime. Its listing is not kept.
+    */
+   if (s->st_mtime >= current_time)
+      return e;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&listing_lock);
+#endif
+   old = lookup_listing(s, req->request_uri, json);
+   if (old == NULL && make_room(LISTING_COST(e))) {
+      unsigned int i = LISTING_HASH(e->dev, e->ino);
+
+      e->cached = 1;
+      e->next = listing_cache[i];
+      listing_cache[i] = e;
+      listing_cache_bytes += LISTING_COST(e);
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&listing_lock);
+#endif
+
+   return e;
+}
+
+/*
+ * Name: send_dir_listing
+ * Description: Sends the listing of the directory req->pathname,
+ * described by s. The body is sent from memory by process_get().
+ *
+ * Return values: as get_dir()
+ */
+int send_dir_listing(request * req, struct stat *s)
+{
+   struct listing_entry *e;
+   int json;
+
+   json = wants_json(req);
+
+   e = find_dir_listing(req, s, json);
+   if (e == NULL) {
+      if (errno == EACCES)
+	 send_r_forbidden(req);
+      else {
+	 boa_perror(req, "directory listing");
+      }
+      return -1;
+   }
+
+   req->listing_entry_var = e;
+   req->data_mem = e->data;
+   req->filesize = e->len;
+   req->filepos = req->range_start = 0;
+   req->range_stop = e->len;
+   req->last_modified = s->st_mtime;
+
+   req->response_status = R_REQUEST_OK;
+   if (req->http_version != HTTP_0_9) {
+      req_write(req, HTTP_VERSION " 200 OK\r\n");
+      print_volatile_headers(req);
+      print_server_headers(req);
+      print_content_length(req);
+      print_last_modified(req);
+      if (json)
+	 req_write(req, "Content-Type: application/json\r\n\r\n");
+      else {
+	 req_write(req, "Content-Type: text/html");
+	 if (default_charset != NULL) {
+	    req_write(req, "; charset=");
+	    req_write(req, default_charset);
+	 }
+	 req_write(req, "\r\n\r\n");
+      }
+   }
+
+   if (req->method == M_HEAD)
+      return 0;
+
+   return 1;
+}
+
+void release_dir_listing(struct listing_entry *e)
+{
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&listing_lock);
+#endif
+   e->use_count--;
+   if (e->use_count == 0 && !e->cached)
+      free_listing_entry(e);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&listing_lock);
+#endif
+}
+
+/* Removes all the entries. Called when the configuration is
+ * read again.
+ */
+void flush_dir_listings(void)
+{
+   int i;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&listing_lock);
+#endif
+   for (i = 0; i < LISTING_CACHE_HASH_SIZE; i++)
+      while (listing_cache[i] != NULL)
+	 remove_listing(&listing_cache[i]);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&listing_lock);
+#endif
+}
@@ -0,0 +1,337 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the document root descriptors. The document root
+ * of each virtual host is opened once, and the requested files are
+ * opened relative to it (see docroot_open()), so that the kernel does
+ * not walk the whole absolute path for each request. The directories
+ * below the document root that requests are made for, are kept open
+ * too (up to DOCROOT_DIR_CACHE_SIZE of them), and are opened again
+ * after DOCROOT_DIR_RECHECK_TIME seconds, in case they were replaced.
+ *
+ * Where openat2() is available, paths are resolved with
+ * RESOLVE_BENEATH: neither "..", nor absolute symlinks, nor
+ * symlinks that lead out of the document root, are followed.
+ */
+
+#define _GNU_SOURCE		/* O_PATH */
+
+#include "boa.h"
+
+#if defined(HAVE_LINUX_OPENAT2_H) && defined(HAVE_SYS_SYSCALL_H)
+# include <linux/openat2.h>
+# include <sys/syscall.h>
+# ifdef SYS_openat2
+#  define USE_OPENAT2
+# endif
+#endif
+
+#ifdef ENABLE_SMP
+static pthread_mutex_t docroot_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#ifdef USE_OPENAT2
+static int no_openat2 = 0;	/* the kernel is older than 5.6 */
+#endif
+
+/* Opens path, relative to the directory dirfd, but not out of it.
+ */
+static int open_beneath(int dirfd, const char *path, int flags)
+{
+#ifdef USE_OPENAT2
+   struct open_how how;
+   int fd;
+
+   if (!no_openat2) {
+      memset(&how, 0, sizeof(how));
+      how.flags = flags;
+      how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+      fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+      if (fd != -1 || errno != ENOSYS)
+	 return fd;
+      no_openat2 = 1;
+   }
+#endif
+   return openat(dirfd, path, flags);
+}
+
+/*
+ * Name: open_docroot
+ * Description: Opens the document root directory pathname.
+ *
+ * Returns: the docroot, held once, or NULL if it could not be opened
+ * (the files are then opened by their absolute paths).
+ */
+struct docroot *open_docroot(const char *pathname)
+{
+   struct docroot *root;
+   int len;
+
+   root = calloc(1, sizeof(struct docroot));
+   if (root == NULL)
+      return NULL;
+
+   len = strlen(pathname);
+   while (len > 1 && pathname[len - 1] == '/')
+      len--;
+
+   root->path = malloc(len + 1);
+   if (root->path == NULL) {
+      free(root);
+      return NULL;
+   }
+   memcpy(root->path, pathname, len);
+   root->path[len] = 0;
+   root->len = len;
+
+   root->fd = open(root->path, O_RDONLY | O_DIRECTORY);
+   if (root->fd == -1 || set_cloexec_fd(root->fd) == -1) {
+      if (root->fd != -1)
+	 close(root->fd);
+      free(root->path);
+      free(root);
+      return NULL;
+   }
+
+   root->use_count = 1;
+   return root;
+}
+
+static void free_docroot_dir(struct docroot_dir *d)
+{
+   close(d->fd);
+   free(d->path);
+   free(d);
+}
+
+/* Unlinks *p from the cache of its docroot. It is closed now, or
+ * when the last open() that uses it is done.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void remove_docroot_dir(struct docroot *root, struct docroot_dir **p)
+{
+   struct docroot_dir *d = *p;
+
+   *p = d->next;
+   root->dirs_cached--;
+   d->cached = 0;
+   if (d->use_count == 0)
+      free_docroot_dir(d);
+}
+
+struct docroot *hold_docroot(struct docroot *root)
+{
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&docroot_lock);
+#endif
+   root->use_count++;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&docroot_lock);
+#endif
+   return root;
+}
+
+void release_docroot(struct docroot *root)
+{
+   int i, unused;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&docroot_lock);
+#endif
+   unused = (--root->use_count == 0);
+   if (unused) {
+      for (i = 0; i < DOCROOT_DIR_HASH_SIZE; i++)
+	 while (root->dirs[i] != NULL)
+	    remove_docroot_dir(root, &root->dirs[i]);
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&docroot_lock);
+#endif
+
+   if (unused) {
+      close(root->fd);
+      free(root->path);
+      free(root);
+   }
+}
+
+/* Removes the least recently used directory that is not in use.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void make_dir_room(struct docroot *root)
+{
+   struct docroot_dir **p, **oldest = NULL;
+   int i;
+
+   for (i = 0; i < DOCROOT_DIR_HASH_SIZE; i++) {
+      for (p = &root->dirs[i]; *p != NULL; p = &(*p)->next) {
+	 if ((*p)->use_count == 0 &&
+	     (oldest == NULL || (*p)->last_used < (*oldest)->last_used))
+	    oldest = p;
+      }
+   }
+
+   if (oldest != NULL)
+      remove_docroot_dir(root, oldest);
+}
+
+/* Returns the open directory path (of len bytes, relative to the
+ * document root), which must be given back with release_docroot_dir().
+ *
+ * Returns: the directory, or NULL if it could not be opened.
+ */
+static struct docroot_dir *hold_docroot_dir(struct docroot *root,
+					    const char *path, int len)
+{
+   struct docroot_dir **p, *d;
+   unsigned int hash = 5381;
+   int i, fd;
+
+   for (i = 0; i < len; i++)
+      hash = hash * 33 + (unsigned char) path[i];
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&docroot_lock);
+#endif
+   p = &root->dirs[hash % DOCROOT_DIR_HASH_SIZE];
+   while ((d = *p) != NULL) {
+      if (d->hash == hash && d->len == len &&
+	  memcmp(d->path, path, len) == 0) {
+	 if (current_time - d->opened < DOCROOT_DIR_RECHECK_TIME) {
+	    d->use_count++;
+	    d->last_used = current_time;
+#ifdef ENABLE_SMP
+	    pthread_mutex_unlock(&docroot_lock);
+#endif
+	    return d;
+	 }
+	 remove_docroot_dir(root, p);	/* it may have been replaced */
+	 continue;
+      }
+      p = &d->next;
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&docroot_lock);
+#endif
+
+   /* not holding the lock while opening */
+   d = calloc(1, sizeof(struct docroot_dir));
+   if (d == NULL)
+      return NULL;
+   d->path = malloc(len + 1);
+   if (d->path == NULL) {
+      free(d);
+      return NULL;
+   }
+   memcpy(d->path, path, len);
+   d->path[len] = 0;
+
+#ifdef O_PATH
+   fd = open_beneath(root->fd, d->path, O_PATH | O_DIRECTORY);
+#else
+   fd = open_beneath(root->fd, d->path, O_RDONLY | O_DIRECTORY);
+#endif
+   if (fd == -1 || set_cloexec_fd(fd) == -1) {
+      i = errno;		/* docroot_open() needs it */
+      if (fd != -1)
+	 close(fd);
+      free(d->path);
+      free(d);
+      errno = i;
+      return NULL;
+   }
+
+   d->fd = fd;
+   d->len = len;
+   d->hash = hash;
+   d->opened = d->last_used = current_time;
+   d->use_count = 1;
+   d->cached = 1;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&docroot_lock);
+#endif
+   if (root->dirs_cached >= DOCROOT_DIR_CACHE_SIZE)
+      make_dir_room(root);
+   i = hash % DOCROOT_DIR_HASH_SIZE;
+   d->next = root->dirs[i];
+   root->dirs[i] = d;
+   root->dirs_cached++;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&docroot_lock);
+#endif
+
+   return d;
+}
+
+static void release_docroot_dir(struct docroot_dir *d)
+{
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&docroot_lock);
+#endif
+   d->use_count--;
+   if (d->use_count == 0 && !d->cached)
+      free_docroot_dir(d);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&docroot_lock);
+#endif
+}
+
+/*
+ * Name: docroot_open
+ * Description: Opens pathname for reading, as open() does. If it is
+ * below the document root root (which may be NULL), it is opened
+ * relative to the root, or to its (cached) directory.
+ *
+ * A symlink that leads out of the document root fails with EACCES.
+ */
+int docroot_open(struct docroot *root, const char *pathname)
+{
+   struct docroot_dir *d;
+   const char *path, *slash;
+   int fd;
+
+   if (root == NULL || strncmp(pathname, root->path, root->len) != 0 ||
+       pathname[root->len] != '/')
+      return open(pathname, O_RDONLY);
+
+   path = pathname + root->len;
+   while (*path == '/')
+      path++;
+   if (*path == 0)
+      path = ".";
+
+   slash = strrchr(path, '/');
+   if (slash != NULL && slash[1] != 0) {
+      d = hold_docroot_dir(root, path, slash - path);
+      if (d != NULL) {
+	 fd = open_beneath(d->fd, slash + 1, O_RDONLY);
+	 release_docroot_dir(d);
+	 /* a symlink to a sibling directory is fine */
+	 if (fd != -1 || errno != EXDEV)
+	    return fd;
+      } else if (errno == ENOENT || errno == ENOTDIR)
+	 return -1;		/* no need to look again */
+   }
+
+   fd = open_beneath(root->fd, path, O_RDONLY);
+   if (fd == -1 && errno == EXDEV)
+      errno = EACCES;
+   return fd;
+}
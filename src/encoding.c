@@ -0,0 +1,323 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the Accept-Encoding negotiation, and the
+ * selection of precompressed files (ie. foo.js.br, foo.js.gz for
+ * foo.js).
+ */
+
+#include "boa.h"
+
+int precompressed_files = 0;
+
+/* The encodings we know of, in order of preference.
+ */
+static const struct {
+   int encoding;
+   const char *name;		/* as used in HTTP headers */
+   const char *suffix;		/* suffix of the precompressed file */
+} encodings[] = {
+   { ENCODING_BR, "br", ".br" },
+   { ENCODING_GZIP, "gzip", ".gz" },
+   { ENCODING_DEFLATE, "deflate", NULL },
+};
+
+#define ENCODINGS_SIZE (sizeof(encodings)/sizeof(encodings[0]))
+
+/* Which precompressed files exist for a given file. Checking this
+ * requires a stat() per encoding, thus the result is kept here,
+ * and is checked again only after PRECOMPRESSED_RECHECK_TIME seconds
+ * or if the file itself has changed.
+ */
+struct variant_entry {
+   dev_t dev;
+   ino_t ino;
+   time_t mtime;
+   off_t size;
+   time_t checked;		/* when the precompressed files were looked up */
+   int variants;		/* OR of ENCODING_* */
+};
+
+static struct variant_entry variant_cache[VARIANT_CACHE_SIZE];
+
+#ifdef ENABLE_SMP
+static pthread_mutex_t variant_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define VARIANT_CACHE_HASH(dev,ino) (((unsigned long int)(ino))%VARIANT_CACHE_SIZE)
+
+const char *encoding_name(int encoding)
+{
+   unsigned int i;
+
+   for (i = 0; i < ENCODINGS_SIZE; i++)
+      if (encodings[i].encoding == encoding)
+	 return encodings[i].name;
+
+   return NULL;
+}
+
+/* Returns the suffix of the precompressed files of the given
+ * encoding, or NULL.
+ */
+const char *encoding_suffix(int encoding)
+{
+   unsigned int i;
+
+   for (i = 0; i < ENCODINGS_SIZE; i++)
+      if (encodings[i].encoding == encoding)
+	 return encodings[i].suffix;
+
+   return NULL;
+}
+
+/*
+ * Name: parse_accept_encoding
+ * Description: Parses the value of an Accept-Encoding header, ie.
+ * "gzip, deflate;q=0.5, br;q=0". Encodings with a zero quality
+ * value are not included.
+ *
+ * Returns: an OR of the ENCODING_* values acceptable.
+ */
+int parse_accept_encoding(const char *value)
+{
+   int result = 0, wildcard = 0, rejected = 0, e;
+   const char *p, *token;
+   unsigned int i, len;
+
+   p = value;
+   while (*p) {
+      while (*p == ' ' || *p == '\t' || *p == ',')
+	 p++;
+      if (*p == 0)
+	 break;
+
+      token = p;
+      while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+	 p++;
+      len = p - token;
+
+      e = 0;
+      if (len == 1 && *token == '*')
+	 e = -1;
+      else if (len == 6 && strncasecmp(token, "x-gzip", 6) == 0)
+	 e = ENCODING_GZIP;
+      else {
+	 for (i = 0; i < ENCODINGS_SIZE; i++) {
+	    if (strlen(encodings[i].name) == len &&
+		strncasecmp(token, encodings[i].name, len) == 0) {
+	       e = encodings[i].encoding;
+	       break;
+	    }
+	 }
+      }
+
+      /* look for a q=0 parameter */
+      while (*p && *p != ',') {
+	 if (*p == ';') {
+	    p++;
+	    while (*p == ' ' || *p == '\t')
+	       p++;
+	    if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+	       p += 2;
+	       if (atof(p) <= 0) {
+		  if (e == -1)
+		     wildcard = -1;
+		  else
+		     rejected |= e;
+		  e = 0;
+	       }
+	    }
+	    continue;
+	 }
+	 p++;
+      }
+
+      if (e == -1)
+	 wildcard = 1;
+      else
+	 result |= e;
+   }
+
+   if (wildcard == 1)
+      result = ENCODING_BR | ENCODING_GZIP | ENCODING_DEFLATE;
+
+   return result & ~rejected;
+}
+
+/* Checks which precompressed versions of pathname exist. Only the
+ * ones that are at least as new as the original are used.
+ */
+static int lookup_variants(const char *pathname, struct stat *orig)
+{
+   char buf[MAX_PATH_LENGTH + 1];
+   struct stat st;
+   unsigned int i;
+   int len, variants = 0;
+
+   len = strlen(pathname);
+
+   for (i = 0; i < ENCODINGS_SIZE; i++) {
+      if (encodings[i].suffix == NULL)
+	 continue;
+      if (len + strlen(encodings[i].suffix) > MAX_PATH_LENGTH)
+	 continue;
+
+      memcpy(buf, pathname, len);
+      strcpy(buf + len, encodings[i].suffix);
+
+      if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) &&
+	  st.st_mtime >= orig->st_mtime)
+	 variants |= encodings[i].encoding;
+   }
+
+   return variants;
+}
+
+/* Returns the precompressed files available for the given file,
+ * using the cache if possible.
+ */
+static int find_variants(const char *pathname, struct stat *s)
+{
+   struct variant_entry *e;
+   int variants;
+
+   e = &variant_cache[VARIANT_CACHE_HASH(s->st_dev, s->st_ino)];
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&variant_lock);
+#endif
+   if (e->checked != 0 && e->dev == s->st_dev && e->ino == s->st_ino &&
+       e->mtime == s->st_mtime && e->size == s->st_size &&
+       current_time - e->checked < PRECOMPRESSED_RECHECK_TIME) {
+      variants = e->variants;
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&variant_lock);
+#endif
+      return variants;
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&variant_lock);
+#endif
+
+   /* do not hold the lock while stat()ing */
+   variants = lookup_variants(pathname, s);
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&variant_lock);
+#endif
+   e->dev = s->st_dev;
+   e->ino = s->st_ino;
+   e->mtime = s->st_mtime;
+   e->size = s->st_size;
+   e->variants = variants;
+   e->checked = current_time;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&variant_lock);
+#endif
+
+   return variants;
+}
+
+/* Forgets the cached information about a file. Used when a
+ * precompressed file that was expected to exist, could not be opened.
+ */
+static void forget_variants(struct stat *s)
+{
+   struct variant_entry *e;
+
+   e = &variant_cache[VARIANT_CACHE_HASH(s->st_dev, s->st_ino)];
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&variant_lock);
+#endif
+   if (e->dev == s->st_dev && e->ino == s->st_ino)
+      e->checked = 0;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&variant_lock);
+#endif
+}
+
+/*
+ * Name: open_precompressed
+ * Description: If a precompressed version of req->pathname exists,
+ * and it is acceptable by the client, it is opened instead. statbuf
+ * describes data_fd on input, and the returned fd on output.
+ * req->encoding and req->vary_encoding are set accordingly.
+ *
+ * Returns: the file descriptor to be sent (data_fd if no
+ * precompressed version is used).
+ */
+int open_precompressed(request * req, int data_fd, struct stat *statbuf)
+{
+   char buf[MAX_PATH_LENGTH + 1];
+   struct stat st;
+   int variants, fd, len;
+   unsigned int i;
+
+   if (!S_ISREG(statbuf->st_mode))
+      return data_fd;
+
+   len = strlen(req->pathname);
+   if (len == 0 || req->pathname[len - 1] == '/')
+      return data_fd;
+
+   variants = find_variants(req->pathname, statbuf);
+   if (variants == 0)
+      return data_fd;
+
+   /* The response depends on Accept-Encoding, even if the client
+    * gets the original file.
+    */
+   req->vary_encoding = 1;
+
+   variants &= req->accept_encoding;
+   if (variants == 0)
+      return data_fd;
+
+   for (i = 0; i < ENCODINGS_SIZE; i++) {
+      if (!(variants & encodings[i].encoding))
+	 continue;
+
+      if (len + strlen(encodings[i].suffix) > MAX_PATH_LENGTH)
+	 continue;
+      memcpy(buf, req->pathname, len);
+      strcpy(buf + len, encodings[i].suffix);
+
+      fd = docroot_open(req->docroot, buf);
+      if (fd == -1) {
+	 forget_variants(statbuf);
+	 continue;
+      }
+
+      if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+	 close(fd);
+	 forget_variants(statbuf);
+	 continue;
+      }
+
+      close(data_fd);
+      *statbuf = st;
+      req->encoding = encodings[i].encoding;
+
+      return fd;
+   }
+
+   return data_fd;
+}
@@ -31,6 +31,13 @@
 int get_cachedir_file(request * req, struct stat *statbuf);
 int index_directory(request * req, char *dest_filename);
 static int check_if_stuff(request * req);
+static int parse_byte_ranges(const char *value, off_t filesize,
+			     struct byte_range *ranges);
+static int init_multipart(request * req, struct byte_range *ranges,
+			  int n);
+static int init_byte_ranges(request * req);
+static void redirect_to_directory(server_params * params, request * req);
+static int init_pack_get(server_params * params, request * req);
 
 /*
  * Name: init_get
@@ -44,8 +51,7 @@ static int check_if_stuff(request * req);
 int init_get(server_params * params, request * req)
 {
    int data_fd, saved_errno;
-   struct stat statbuf;
-   volatile int bytes;
+   struct stat statbuf, orig_statbuf;
 
 #ifdef ENABLE_ACCESS_LISTS
    if (!access_allow(req->hostname, req->pathname)) {
@@ -54,48 +60,58 @@ int init_get(server_params * params, request * req)
    }
 #endif
 
-   data_fd = open(req->pathname, O_RDONLY);
-   saved_errno = errno;		/* might not get used */
+   if (req->from_pack)
+      return init_pack_get(params, req);
+
+   if (req->async_open != NULL) {
+      /* the file was opened by an async I/O thread */
+      data_fd = req->async_open->fd;
+      saved_errno = req->async_open->error;
+      statbuf = req->async_open->statbuf;
+      req->async_open->fd = -1;
+   } else if (negative_lookup(req)) {
+      send_r_not_found(req);
+      return 0;
+   } else if (async_open_file(params, req)) {
+      return 1;			/* process_async_open() calls us again */
+   } else {
+      data_fd = docroot_open(req->docroot, req->pathname);
+      saved_errno = errno;	/* might not get used */
+
+      if (data_fd != -1 && fstat(data_fd, &statbuf) == -1) {
+	 /* this is quite impossible, since the file
+	  * was opened before.
+	  */
+	 close(data_fd);
+	 send_r_not_found(req);
+	 return 0;
+      }
+   }
 
    if (data_fd == -1) {
+      if (saved_errno == ENOENT) {
+	 negative_insert(req);
+	 log_not_found(req);
+	 send_r_not_found(req);
+	 return 0;
+      }
+
       log_error_doc(req);
       errno = saved_errno;
       perror("document open");
 
-      if (saved_errno == ENOENT)
-	 send_r_not_found(req);
-      else if (saved_errno == EACCES)
+      if (saved_errno == EACCES)
 	 send_r_forbidden(req);
       else
 	 send_r_bad_request(req);
       return 0;
    }
 
-   if (fstat(data_fd, &statbuf) == -1) {
-      /* this is quite impossible, since the file
-       * was opened before.
-       */
-      close(data_fd);
-      send_r_not_found(req);
-      return 0;
-   }
-
    if (S_ISDIR(statbuf.st_mode)) {	/* directory */
       close(data_fd);		/* close dir */
 
       if (req->pathname[strlen(req->pathname) - 1] != '/') {
-	 char buffer[3 * MAX_PATH_LENGTH + 128];
-	 char * hostname;
-	 
-	 if (req->hostname==NULL || req->hostname[0] == 0)
-	 	hostname = req->local_ip_addr;
-	 else
-	 	hostname = req->hostname;
-
-	 create_url(buffer, sizeof(buffer), req->secure, hostname,
-		    params->server_s[req->secure].port, req->request_uri);
-
-	 send_r_moved_perm(req, buffer);
+	 redirect_to_directory(params, req);
 	 return 0;
       }
       data_fd = get_dir(req, &statbuf);	/* updates statbuf */
@@ -108,6 +124,28 @@ int init_get(server_params * params, request * req)
       /* else, data_fd contains the fd of the file... */
    }
 
+   req->response_entry_var = find_cached_response(req, &statbuf);
+   if (req->response_entry_var != NULL) {
+      close(data_fd);
+      send_cached_response(req);
+      return 1;
+   }
+   orig_statbuf = statbuf;	/* the response cache needs these */
+
+   if (precompressed_files)
+      data_fd = open_precompressed(req, data_fd, &statbuf);
+
+#ifdef HAVE_LIBZ
+   if (compression && req->encoding == ENCODING_IDENTITY) {
+      req->compressed_entry_var = find_compressed(req, data_fd, &statbuf);
+      if (req->compressed_entry_var != NULL) {
+	 /* the compressed data are sent from memory */
+	 req->encoding = req->compressed_entry_var->encoding;
+	 statbuf.st_size = req->compressed_entry_var->len;
+      }
+   }
+#endif
+
    req->filesize = statbuf.st_size;
    req->last_modified = statbuf.st_mtime;
 
@@ -120,18 +158,7 @@ int init_get(server_params * params, request * req)
       }
    /* Move on */
 
-   if (req->range_stop == 0)
-      req->range_stop = statbuf.st_size;
-
-   /* out of range! */
-   if (req->range_start > statbuf.st_size ||
-       req->range_stop > statbuf.st_size ||
-       req->range_stop <= req->range_start) {
-      /* here we catch illegal ranges. We also catch
-       * illegal ranges because of unsupported features
-       * where range_start == range_stop == -1.
-       */
-      send_r_range_unsatisfiable(req);
+   if (init_byte_ranges(req) == 0) {
       close(data_fd);
       return 0;
    }
@@ -144,119 +171,205 @@ int init_get(server_params * params, request * req)
 
    req->filepos = req->range_start;
 
-   if (req->range_stop > max_file_size_cache) {
+   /* NOTE: I (Jon Nelson) tried performing a read(2)
+    * into the output buffer provided the file data would
+    * fit, before mmapping, and if successful, writing that
+    * and stopping there -- all to avoid the cost
+    * of a mmap.  Oddly, it was *slower* in benchmarks.
+    */
+   if (req->compressed_entry_var != NULL) {
+      req->data_mem = req->compressed_entry_var->data;
+   } else if (req->range_stop <= max_file_size_cache && max_files_cache > 0) {
+      char pathname[MAX_PATH_LENGTH + 8];
+      const char *suffix = encoding_suffix(req->encoding);
+
+      /* the name of the file sent, for the cache manifest */
+      if (suffix != NULL) {
+	 snprintf(pathname, sizeof(pathname), "%s%s", req->pathname, suffix);
+	 req->mmap_entry_var = find_mmap(data_fd, &statbuf, pathname);
+      } else
+	 req->mmap_entry_var = find_mmap(data_fd, &statbuf, req->pathname);
+      /* Files that could not be leased (or mapped) are not safe
+       * to send from memory. io_shuffle() sends them.
+       */
+      if (req->mmap_entry_var != NULL) {
+	 req->data_mem = req->mmap_entry_var->mmap;
 
-      if (req->range_start == 0 && req->range_stop == statbuf.st_size)
-	 send_r_request_file_ok(req);	/* All's well */
-      else {
-	 /* if ranges were used, then lseek to the start given
-	  */
-	 if (lseek(data_fd, req->range_start, SEEK_SET) == (off_t) - 1) {
-	    close(data_fd);
-	    send_r_not_found(req);
-	    return 0;
-	 }
-	 send_r_request_partial(req);	/* All's well */
+	 /* the entry is held until the kernel is done with its pages */
+	 if (zerocopy_threshold > 0 &&
+	     req->range_stop - req->filepos >= zerocopy_threshold)
+	    req->zerocopy = socket_zerocopy(req);
       }
+   }
+
+   cache_response(req, &orig_statbuf, data_fd);
 
-      req_flush(req);		/* this should *always* complete due to
-				   the size of the I/O buffers */
+   if (req->ranges != NULL) {
+      send_r_request_multipart(req);
+      next_byte_range(req);	/* the first part header */
+   } else if (req->range_start == 0 && req->range_stop == statbuf.st_size)
+      send_r_request_file_ok(req);	/* All's well */
+   else
+      send_r_request_partial(req);	/* All's well */
+
+   if (req->data_mem == NULL) {
+      /* The headers are left in the buffer; io_shuffle() sends
+       * them together with the first part of the file.
+       */
       req->data_fd = data_fd;
-      
-      if (req->secure) {
-         req->status = PIPE_READ;
-         req->cgi_status = CGI_BUFFER;
-      } else {
-         /* This sends data directly to the socket, and cannot
-          * be used in TLS connections.
-          */
-         req->status = IOSHUFFLE;
-      }
+      req->status = IOSHUFFLE;
+      req->pipe_range_stop = req->range_stop;
+      init_io_shuffle(req);
 
       req->header_line = req->header_end = req->buffer;
-      req->pipe_range_stop = req->range_stop;
       return 1;
    }
 
-   if (req->range_stop == 0) {	/* done */
-      send_r_request_file_ok(req);	/* All's well *so far* */
-      close(data_fd);
-      return 1;
-   }
+   close(data_fd);		/* close data file */
 
-   /* NOTE: I (Jon Nelson) tried performing a read(2)
-    * into the output buffer provided the file data would
-    * fit, before mmapping, and if successful, writing that
-    * and stopping there -- all to avoid the cost
-    * of a mmap.  Oddly, it was *slower* in benchmarks.
+   /* The headers stay in req->buffer; process_get() sends them
+    * along with the mapped body using a single writev().
     */
-   if (max_files_cache > 0) {
-      req->mmap_entry_var = find_mmap(data_fd, &statbuf);
-      if (req->mmap_entry_var == NULL) {
-	 req->buffer_end = 0;
-	 if (errno == ENOENT)
-	    send_r_not_found(req);
-	 else if (errno == EACCES)
-	    send_r_forbidden(req);
-	 else
-	    send_r_bad_request(req);
-	 close(data_fd);
-	 return 0;
-      }
-      req->data_mem = req->mmap_entry_var->mmap;
-   } else {			/* File caching is disabled.
-				 */
-      req->data_mem =
-	  mmap(0, req->range_stop, PROT_READ, MAP_OPTIONS, data_fd, 0);
+   /* We lose statbuf here, so make sure response has been sent */
+   return 1;
+}
+
+/*
+ * Name: init_pack_get
+ * Description: Initializes a GET or HEAD request for a file of the
+ * pack that is the document root (see pack.c). The file is sent from
+ * the mapped pack, as the cached files are.
+ *
+ * Return values: as init_get().
+ */
+static int init_pack_get(server_params * params, request * req)
+{
+   const struct pack_record *r;
+   int variant, len;
+
+   if (req->pack->broken) {
+      /* it is being written (see check_pack_lease()) */
+      send_r_service_unavailable(req);
+      return 0;
    }
 
-   close(data_fd);		/* close data file */
+   r = find_pack_record(req->pack, req->request_uri);
+   if (r != NULL && (r->flags & PACK_DIRECTORY)) {
+      redirect_to_directory(params, req);
+      return 0;
+   }
+
+   len = strlen(req->request_uri);
+   if (r == NULL && req->request_uri[len - 1] == '/')
+      r = find_pack_index(req->pack, req->request_uri);
 
-   if (req->data_mem == MAP_FAILED) {
-      boa_perror(req, "mmap");
+   if (r == NULL) {
+      send_r_not_found(req);
       return 0;
    }
 
-   if (req->range_start == 0 && req->range_stop == statbuf.st_size)
-      send_r_request_file_ok(req);	/* All's well */
+   variant = choose_pack_variant(req, r);
+   if (r->mime != 0)
+      req->pack_mime = req->pack->map + r->mime;
+
+   req->filesize = r->len[variant];
+   req->last_modified = r->mtime;
+
+   if (req->if_types)
+      if (check_if_stuff(req) == 0)
+	 return 0;
+
+   if (init_byte_ranges(req) == 0)
+      return 0;
+
+   if (req->method == M_HEAD || req->filesize == 0) {
+      send_r_request_file_ok(req);
+      return 0;
+   }
+
+   req->filepos = req->range_start;
+   req->data_mem = req->pack->map + r->offset[variant];
+
+   if (zerocopy_threshold > 0 &&
+       req->range_stop - req->filepos >= zerocopy_threshold)
+      req->zerocopy = socket_zerocopy(req);
+
+   if (req->ranges != NULL) {
+      send_r_request_multipart(req);
+      next_byte_range(req);	/* the first part header */
+   } else if (req->range_start == 0 && req->range_stop == req->filesize)
+      send_r_request_file_ok(req);
    else
-      send_r_request_partial(req);	/* All's well */
+      send_r_request_partial(req);
 
-   bytes = BUFFER_SIZE - req->buffer_end;
+   return 1;
+}
 
-   /* bytes is now how much the buffer can hold
-    * after the headers
-    */
+/* Redirects a request for a directory, whose URI does not end in
+ * '/', to the same URI with the '/'.
+ */
+static void redirect_to_directory(server_params * params, request * req)
+{
+   char buffer[3 * MAX_PATH_LENGTH + 128];
+   char *hostname;
 
-   if (bytes > 0) {
-      if (bytes > req->range_stop - req->range_start)
-	 bytes = req->range_stop - req->range_start;
+   if (req->hostname == NULL || req->hostname[0] == 0)
+      hostname = req->local_ip_addr;
+   else
+      hostname = req->hostname;
+
+   create_url(buffer, sizeof(buffer), req->secure, hostname,
+	      params->server_s[req->secure].port, req->request_uri);
+
+   send_r_moved_perm(req, buffer);
+}
+
+/*
+ * Name: init_byte_ranges
+ * Description: Sets req->range_start and req->range_stop from the
+ * Range header, if any, of a request for req->filesize bytes.
+ * Multiple ranges are prepared with init_multipart().
+ *
+ * Return values:
+ *  1: continue sending the file
+ *  0: an error was sent
+ */
+static int init_byte_ranges(request * req)
+{
+   req->range_start = 0;
+   req->range_stop = req->filesize;
+
+   if (req->range_header && req->method == M_GET) {
+      struct byte_range ranges[MAX_BYTE_RANGES];
+      int n;
 
-      if (setjmp(params->env) == 0) {
-	 params->handle_sigbus = 1;
-	 memcpy(req->buffer + req->buffer_end,
-		&req->data_mem[req->filepos], bytes);
-	 params->handle_sigbus = 0;
-	 /* OK, SIGBUS **after** this point is very bad! */
+      n = parse_byte_ranges(req->range_header, req->filesize, ranges);
+      if (n == 0) {
+	 /* none of the ranges overlaps the file */
+	 send_r_range_unsatisfiable(req);
+	 return 0;
+      } else if (n == 1) {
+	 req->range_start = ranges[0].start;
+	 req->range_stop = ranges[0].stop;
+      } else if (n > 1) {
+	 if (init_multipart(req, ranges, n) == 0) {
+	    send_r_error(req);
+	    return 0;
+	 }
+	 /* the mmap or io_shuffle decision, is based on the
+	  * last byte sent.
+	  */
+	 req->range_start = ranges[0].start;
+	 req->range_stop = ranges[n - 1].stop;
       } else {
-	 char buf[30];
-	 /* sigbus! */
+	 /* Either a syntax error or too many ranges. RFC2616
+	  * allows us to ignore the header and send the whole file.
+	  */
 	 log_error_doc(req);
-	 reset_output_buffer(req);
-	 send_r_error(req);
-	 get_commonlog_time(buf);
-	 fprintf(stderr, "%sGot SIGBUS in memcpy!\n", buf);
-	 return 0;
-      }
-      req->buffer_end += bytes;
-      req->filepos += bytes;
-      if (req->range_stop == req->filepos) {
-	 req_flush(req);
-	 req->status = DONE;
+	 fprintf(stderr, "ignoring range: \"%s\"\n", req->range_header);
       }
    }
 
-   /* We lose statbuf here, so make sure response has been sent */
    return 1;
 }
 
@@ -373,7 +486,7 @@ static int check_if_stuff(request * req)
       /* File has been changed, but it is Ok, so send the whole 
        * file.
        */
-      req->range_start = req->range_stop = 0;
+      req->range_header = NULL;
       return 1;
    }
 
@@ -420,6 +533,312 @@ static int check_if_stuff(request * req)
    return 1;			/* do the request */
 }
 
+/* Parses a non negative decimal number. Returns the
+ * number of digits read, or -1 on overflow.
+ */
+static int parse_offset(const char *p, off_t * val)
+{
+   int digits = 0;
+   off_t v = 0;
+
+   while (*p >= '0' && *p <= '9') {
+      if (v > (OFF_T_MAX - 9) / 10)
+	 return -1;
+      v = v * 10 + (*p - '0');
+      p++;
+      digits++;
+   }
+
+   *val = v;
+   return digits;
+}
+
+static int compare_byte_ranges(const void *a, const void *b)
+{
+   const struct byte_range *r1 = a, *r2 = b;
+
+   if (r1->start < r2->start)
+      return -1;
+   if (r1->start > r2->start)
+      return 1;
+   return 0;
+}
+
+/*
+ * Name: parse_byte_ranges
+ * Description: Parses the value of a Range header, of the form
+ * "bytes=0-99,200-,-50". The ranges that can be satisfied are stored
+ * sorted in ranges[], with overlapping or adjacent ranges merged.
+ * stop is stored as the byte after the last one.
+ *
+ * Return values:
+ *  -1: syntax error, or too many ranges. The header should be ignored.
+ *   0: no range can be satisfied
+ *  >0: the number of ranges
+ */
+static int parse_byte_ranges(const char *value, off_t filesize,
+			     struct byte_range *ranges)
+{
+   int n = 0, i, j, len;
+   off_t start, stop;
+
+   while (*value == ' ')
+      value++;
+   if (strncasecmp(value, "bytes", 5) != 0)
+      return -1;
+   value += 5;
+   while (*value == ' ')
+      value++;
+   if (*value != '=')
+      return -1;
+   value++;
+
+   for (;;) {
+      while (*value == ' ' || *value == '\t')
+	 value++;
+
+      if (*value == ',') {	/* empty elements are allowed */
+	 value++;
+	 continue;
+      }
+      if (*value == 0)
+	 break;
+
+      if (*value == '-') {	/* suffix: "-500", the last 500 bytes */
+	 value++;
+	 if ((len = parse_offset(value, &start)) <= 0)
+	    return -1;
+	 value += len;
+
+	 if (start > filesize)
+	    start = filesize;
+	 stop = filesize;
+	 start = filesize - start;
+      } else {
+	 if ((len = parse_offset(value, &start)) <= 0)
+	    return -1;
+	 value += len;
+	 if (*value++ != '-')
+	    return -1;
+
+	 len = parse_offset(value, &stop);
+	 if (len < 0)
+	    return -1;
+	 if (len == 0)		/* "500-", up to the end */
+	    stop = filesize;
+	 else {
+	    value += len;
+	    if (stop < start)
+	       return -1;
+	    stop++;		/* the last byte is included */
+	    if (stop > filesize)
+	       stop = filesize;
+	 }
+      }
+
+      while (*value == ' ' || *value == '\t')
+	 value++;
+      if (*value != ',' && *value != 0)
+	 return -1;
+
+      if (start >= stop)	/* not satisfiable; skip it */
+	 continue;
+
+      if (n == MAX_BYTE_RANGES)
+	 return -1;
+      ranges[n].start = start;
+      ranges[n].stop = stop;
+      n++;
+   }
+
+   if (n <= 1)
+      return n;
+
+   qsort(ranges, n, sizeof(struct byte_range), compare_byte_ranges);
+
+   for (i = 0, j = 1; j < n; j++) {
+      if (ranges[j].start <= ranges[i].stop) {
+	 if (ranges[j].stop > ranges[i].stop)
+	    ranges[i].stop = ranges[j].stop;
+      } else
+	 ranges[++i] = ranges[j];
+   }
+
+   return i + 1;
+}
+
+/*
+ * Name: init_multipart
+ * Description: Prepares a multipart/byteranges response. All the part
+ * headers are generated here, so that sending them is only a copy.
+ * The closing boundary is stored as an extra part with no body.
+ *
+ * Return values:
+ *   0: out of memory
+ *   1: success
+ */
+static int init_multipart(request * req, struct byte_range *ranges, int n)
+{
+   char boundary[BYTE_RANGE_BOUNDARY_LENGTH + 1];
+   char content_type[MAX_HEADER_LENGTH];
+   char total[22], start[22], stop[22];
+   char *mime_type, *p;
+   int i, hdr_size;
+   unsigned long int seed;
+
+   /* The boundary only needs to be absent from the parts. Mix a
+    * few values that change from request to request.
+    */
+   seed = (unsigned long int) current_time ^
+       ((unsigned long int) req->last_modified << 7) ^
+       (unsigned long int) req->filesize ^ (unsigned long int) req;
+   memcpy(boundary, "HYDRA", 5);
+   for (i = 5; i < BYTE_RANGE_BOUNDARY_LENGTH; i++) {
+      seed = seed * 1103515245UL + 12345UL;
+      boundary[i] = HEX((seed >> 16) & 0xf);
+   }
+   boundary[i] = 0;
+
+   content_type[0] = 0;
+   if (req->pack_mime != NULL)
+      mime_type = req->pack_mime;
+   else
+      mime_type = get_mime_type(req->request_uri);
+   if (mime_type != NULL) {
+      if (default_charset != NULL && strncasecmp(mime_type, "text", 4) == 0)
+	 snprintf(content_type, sizeof(content_type),
+		  "Content-Type: %s; charset=%s\r\n", mime_type,
+		  default_charset);
+      else
+	 snprintf(content_type, sizeof(content_type),
+		  "Content-Type: %s\r\n", mime_type);
+   }
+
+   simple_itoa(req->filesize, total);
+
+   /* each part header is:
+    * "\r\n--" boundary "\r\n" content_type
+    * "Content-Range: bytes " start "-" stop "/" total "\r\n\r\n"
+    */
+   hdr_size = 2 + 2 + BYTE_RANGE_BOUNDARY_LENGTH + 2 + strlen(content_type)
+       + 21 + 21 + 1 + 21 + 1 + strlen(total) + 4;
+
+   req->ranges = malloc(sizeof(struct byte_range) * (n + 1) +
+			BYTE_RANGE_BOUNDARY_LENGTH + 1 + (n + 1) * hdr_size);
+   if (req->ranges == NULL) {
+      WARN("malloc for multipart ranges");
+      return 0;
+   }
+   req->range_count = n;
+   req->range_current = 0;
+   req->range_headers = (char *) &req->ranges[n + 1];
+
+   p = req->range_headers;
+   memcpy(p, boundary, BYTE_RANGE_BOUNDARY_LENGTH + 1);
+   p += BYTE_RANGE_BOUNDARY_LENGTH + 1;
+
+   for (i = 0; i < n; i++) {
+      req->ranges[i].start = ranges[i].start;
+      req->ranges[i].stop = ranges[i].stop;
+
+      simple_itoa(ranges[i].start, start);
+      simple_itoa(ranges[i].stop - 1, stop);
+
+      req->ranges[i].hdr_pos = p - req->range_headers;
+      /* the first boundary is at the start of the body */
+      req->ranges[i].hdr_len = sprintf(p, "%s--%s\r\n%s"
+				      "Content-Range: bytes %s-%s/%s\r\n\r\n",
+				      i == 0 ? "" : "\r\n", boundary,
+				      content_type, start, stop, total);
+      p += req->ranges[i].hdr_len;
+   }
+
+   /* the closing boundary */
+   req->ranges[n].start = req->ranges[n].stop = ranges[n - 1].stop;
+   req->ranges[n].hdr_pos = p - req->range_headers;
+   req->ranges[n].hdr_len = sprintf(p, "\r\n--%s--\r\n", boundary);
+
+   return 1;
+}
+
+/*
+ * Name: next_byte_range
+ * Description: Moves a multipart response to the next part. The
+ * part header is put in the buffer, to be sent in front of the part.
+ *
+ * Return values:
+ *   0: no more parts
+ *   1: the next part is ready to be sent
+ */
+int next_byte_range(request * req)
+{
+   struct byte_range *r;
+
+   if (req->range_current > req->range_count)
+      return 0;
+
+   r = &req->ranges[req->range_current++];
+
+   if (req->buffer_end + r->hdr_len > BUFFER_SIZE) {
+      /* this cannot happen; the buffer is empty or has only
+       * the response headers.
+       */
+      log_error_doc(req);
+      fprintf(stderr, "Ran out of Buffer space in multipart response!\n");
+      req->status = DEAD;
+      return 0;
+   }
+   memcpy(req->buffer + req->buffer_end, req->range_headers + r->hdr_pos,
+	  r->hdr_len);
+   req->buffer_end += r->hdr_len;
+
+   req->filepos = r->start;
+   req->range_stop = r->stop;
+   req->pipe_range_stop = r->stop;
+
+   return 1;
+}
+
+/* The lease on the mapped file is being broken; someone wants to
+ * write to it, or truncate it. The rest of the file is sent by
+ * io_shuffle(), from a descriptor of the same open file, which is
+ * safe even if the file gets truncated. The mapping is released, so
+ * that the writer may go on once all its users have left it.
+ */
+static int leave_mmap(request * req)
+{
+   /* The kernel may still read the pages of zero copy sends. The
+    * entry is held until they complete (see process_zerocopy_wait()).
+    */
+   if (req->zerocopy_done != req->zerocopy_sends) {
+      req->zerocopy = 0;
+      req->status = ZEROCOPY_WAIT;
+      return process_zerocopy_wait(req);
+   }
+
+   /* A dup() would share the open file, and keep the lease. */
+   req->data_fd = reopen_fd(req->mmap_entry_var->fd);
+   if (req->data_fd == -1)
+      req->data_fd = dup(req->mmap_entry_var->fd);
+   release_mmap(req->mmap_entry_var);
+   req->mmap_entry_var = NULL;
+   req->data_mem = NULL;
+
+   if (req->data_fd == -1) {
+      /* the headers were sent already */
+      log_error_doc(req);
+      perror("reopen");
+      req->status = DEAD;
+      return 0;
+   }
+
+   req->status = IOSHUFFLE;
+   req->pipe_range_stop = req->range_stop;
+   init_io_shuffle(req);
+
+   return 1;
+}
+
 /*
  * Name: process_get
  * Description: Writes a chunk of data to the socket.
@@ -433,62 +852,113 @@ static int check_if_stuff(request * req)
 int process_get(server_params * params, request * req)
 {
    int bytes_written;
-   volatile int bytes_to_write;
+   int bytes_to_write;
+   int header_bytes;
+   struct iovec iov[2];
+
+   if (req->mmap_entry_var != NULL && req->mmap_entry_var->lease_broken)
+      return leave_mmap(req);
 
    bytes_to_write = req->range_stop - req->filepos;
    if (bytes_to_write > system_bufsize)
       bytes_to_write = system_bufsize;
 
+   /* Headers that were left in the buffer by init_get()
+    * are sent in front of the body.
+    */
+   header_bytes = req->buffer_end - req->buffer_start;
+
+   /* keep the error queue empty, or the socket is never blocked */
+   if (req->zerocopy_done != req->zerocopy_sends)
+      socket_zerocopy_complete(req);
 
-   if (setjmp(params->env) == 0) {
-      params->handle_sigbus = 1;
+   iov[0].iov_base = req->buffer + req->buffer_start;
+   iov[0].iov_len = header_bytes;
+   iov[1].iov_base = req->data_mem + req->filepos;
+   iov[1].iov_len = bytes_to_write;
 
+   /* The headers are copied. The kernel may read the pages of a zero
+    * copy send after it returns, and the buffer is overwritten by the
+    * next part header.
+    */
+   if (req->zerocopy && header_bytes > 0)
+      bytes_written =
+	  socket_send(req, req->buffer + req->buffer_start, header_bytes);
+   else if (req->zerocopy)
+      bytes_written = socket_sendv_zerocopy(req, &iov[1], 1);
+   else if (header_bytes > 0)
+      bytes_written = socket_sendv(req, iov, 2);
+   else
       bytes_written =
 	  socket_send(req, req->data_mem + req->filepos, bytes_to_write);
 
-      params->handle_sigbus = 0;
-      /* OK, SIGBUS **after** this point is very bad! */
-   } else {
-      char buf[30];
-      /* sigbus! */
-      log_error_doc(req);
-      /* sending an error here is inappropriate
-       * if we are here, the file is mmapped, and thus,
-       * a content-length has been sent. If we send fewer bytes
-       * the client knows there has been a problem.
-       * We run the risk of accidentally sending the right number
-       * of bytes (or a few too many) and the client
-       * won't be the wiser.
-       */
-      req->status = DEAD;
-      get_commonlog_time(buf);
-      fprintf(stderr, "%sGot SIGBUS in write(2)!\n", buf);
-      return 0;
-   }
-
    if (bytes_written < 0) {
-      if (errno == EWOULDBLOCK || errno == EAGAIN)
+      if (bytes_written == BOA_E_AGAIN)
 	 return -1;
       /* request blocked at the pipe level, but keep going */
+      else if (bytes_written == BOA_E_INTR)
+	 return 1;
       else {
-	 if (errno != EPIPE) {
-	    log_error_doc(req);
-	    /* Can generate lots of log entries, */
-	    perror("write");
-	    /* OK to disable if your logs get too big */
-	 }
+	 /* the socket_send*() functions have logged the error */
+	 req->buffer_start = req->buffer_end = 0;
 	 req->status = DEAD;
 	 return 0;
       }
    }
+
+   if (header_bytes > 0) {
+      if (bytes_written < header_bytes) {
+	 req->buffer_start += bytes_written;
+	 return 1;
+      }
+      req->buffer_start = req->buffer_end = 0;
+      bytes_written -= header_bytes;
+      socket_flush(req->fd);
+   }
    req->filepos += bytes_written;
 
    if (req->filepos == req->range_stop) {	/* EOF */
+      if (req->ranges != NULL && next_byte_range(req))
+	 return 1;		/* the next part */
+      if (req->zerocopy_done != req->zerocopy_sends) {
+	 req->status = ZEROCOPY_WAIT;
+	 return 1;
+      }
       return 0;
    } else
       return 1;			/* more to do */
 }
 
+/*
+ * Name: process_zerocopy_wait
+ * Description: The body was sent with MSG_ZEROCOPY, but the kernel may
+ * still read the pages of the mapped file. The request, and the mmap
+ * entry it holds, are kept until the sends are reported complete on
+ * the error queue of the socket. A request that was parked by
+ * leave_mmap() goes on with the rest of the file.
+ *
+ * Return values:
+ *  -1: request blocked, move to blocked queue
+ *   0: done, or error, close it down
+ *   1: the rest of the file is sent by io_shuffle()
+ */
+int process_zerocopy_wait(request * req)
+{
+   switch (socket_zerocopy_complete(req)) {
+   case 1:
+      if (req->mmap_entry_var != NULL && req->filepos != req->range_stop)
+	 return leave_mmap(req);
+      return 0;
+   case 0:
+      return -1;
+   default:
+      log_error_doc(req);
+      perror("zerocopy completion");
+      req->status = DEAD;
+      return 0;
+   }
+}
+
 /*
  * Name: get_dir
  * Description: Called from process_get if the request is a directory.
@@ -505,10 +975,19 @@ int get_dir(request * req, struct stat *statbuf)
 {
 
    char *directory_index;
-   int data_fd;
-
-   directory_index =
-       find_and_open_directory_index(req->pathname, 0, &data_fd);
+   int data_fd, async_index = 0;
+
+   if (req->async_open != NULL && req->async_open->index_done) {
+      /* looked up by an async I/O thread */
+      async_index = 1;
+      directory_index = req->async_open->index;
+      data_fd = req->async_open->index_fd;
+      errno = req->async_open->index_error;
+      req->async_open->index_fd = -1;
+   } else
+      directory_index =
+	  find_and_open_directory_index(req->docroot, req->pathname, 0,
+					&data_fd);
 
    if (directory_index) {	/* look for index.html first?? */
       if (data_fd != -1) {	/* user's index file */
@@ -539,7 +1018,10 @@ int get_dir(request * req, struct stat *statbuf)
 
 	 /* Not a cgi */
 
-	 fstat(data_fd, statbuf);
+	 if (async_index)
+	    *statbuf = req->async_open->index_statbuf;
+	 else
+	    fstat(data_fd, statbuf);
 	 return data_fd;
       }
       if (errno == EACCES) {
@@ -553,7 +1035,9 @@ int get_dir(request * req, struct stat *statbuf)
    }
 
    /* only here if index.html, index.html.gz don't exist */
-   if (dirmaker != NULL) {	/* don't look for index.html... maybe automake? */
+   if (directory_listing) {
+      return send_dir_listing(req, statbuf);
+   } else if (dirmaker != NULL) {	/* don't look for index.html... maybe automake? */
       req->response_status = R_REQUEST_OK;
       SQUASH_KA(req);
 
@@ -622,82 +1106,51 @@ int get_cachedir_file(request * req, struct stat *statbuf)
 /*
  * Name: index_directory
  * Description: Called from get_cachedir_file if a directory html
- * has to be generated on the fly
+ * has to be generated on the fly. The listing is the one of
+ * DirectoryListing (see dir_listing.c), written to dest_filename.
  * returns -1 for problem, else 0
- * This version is the fastest, ugliest, and most accurate yet.
- * It solves the "stale size or type" problem by not ever giving
- * the size or type.  This also speeds it up since no per-file
- * stat() is required.
  */
 
 int index_directory(request * req, char *dest_filename)
 {
-   DIR *request_dir;
-   FILE *fdstream;
-   struct dirent *dirbuf;
-   int bytes = 0;
-   char *escname = NULL;
-
-   if (chdir(req->pathname) == -1) {
-      if (errno == EACCES || errno == EPERM) {
-	 send_r_forbidden(req);
-      } else {
-	 log_error_doc(req);
-	 perror("chdir");
-	 send_r_bad_request(req);
-      }
-      return -1;
-   }
+   char *data;
+   size_t len, pos;
+   int fd, n;
 
-   request_dir = opendir(".");
-   if (request_dir == NULL) {
-      int errno_save = errno;
-      send_r_error(req);
-      log_error_time();
-      fprintf(stderr, "directory \"%s\": ", req->pathname);
-      errno = errno_save;
-      perror("opendir");
+   data = render_dir_listing(req, 0, &len);
+   if (data == NULL) {
+      if (errno == EACCES || errno == EPERM)
+	 send_r_forbidden(req);
+      else
+	 boa_perror(req, "directory listing");
       return -1;
    }
 
-   fdstream = fopen(dest_filename, "w");
-   if (fdstream == NULL) {
-      boa_perror(req, "dircache fopen");
-      closedir(request_dir);
+   fd = open(dest_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd == -1) {
+      boa_perror(req, "dircache open");
+      free(data);
       return -1;
    }
 
-   bytes += fprintf(fdstream,
-		    "<HTML><HEAD>\n<TITLE>Index of %s</TITLE>\n</HEAD>\n\n",
-		    req->request_uri);
-   bytes +=
-       fprintf(fdstream, "<BODY>\n\n<H2>Index of %s</H2>\n\n<PRE>\n",
-	       req->request_uri);
-
-   while ((dirbuf = readdir(request_dir))) {
-      if (!strcmp(dirbuf->d_name, "."))
-	 continue;
-
-      if (!strcmp(dirbuf->d_name, "..")) {
-	 bytes += fprintf(fdstream,
-			  " [DIR] <A HREF=\"../\">Parent Directory</A>\n");
-	 continue;
-      }
-
-      if ((escname = escape_string(dirbuf->d_name, NULL)) != NULL) {
-	 bytes += fprintf(fdstream, " <A HREF=\"%s\">%s</A>\n",
-			  escname, dirbuf->d_name);
-	 free(escname);
-	 escname = NULL;
+   for (pos = 0; pos < len; pos += n) {
+      n = write(fd, data + pos, len - pos);
+      if (n == -1) {
+	 if (errno == EINTR) {
+	    n = 0;
+	    continue;
+	 }
+	 boa_perror(req, "dircache write");
+	 close(fd);
+	 unlink(dest_filename);
+	 free(data);
+	 return -1;
       }
    }
-   closedir(request_dir);
-   bytes += fprintf(fdstream, "</PRE>\n\n</BODY>\n</HTML>\n");
-
-   fclose(fdstream);
 
-   chdir(server_root);
+   close(fd);
+   free(data);
 
-   req->filesize = bytes;	/* for logging transfer size */
+   req->filesize = len;		/* for logging transfer size */
    return 0;			/* success */
 }
@@ -44,6 +44,131 @@ struct mmap_entry {
     size_t len;
     int available;
     int times_used;
+    char *pathname;             /* for the cache manifest, or NULL */
+    int fd;                     /* holds the read lease on the file */
+    int lease_broken;           /* the file is about to be written */
+};
+
+/* A file compressed on the fly. These are kept in the
+ * compressed cache (compress.c).
+ */
+struct compressed_entry {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;                 /* size of the original file */
+    int encoding;               /* ENCODING_GZIP or ENCODING_DEFLATE */
+    char *data;                 /* NULL if the file does not compress,
+                                 * or is being compressed */
+    size_t len;
+    int use_count;
+    int cached;                 /* if zero, it is freed when unused */
+    time_t last_used;
+    struct compressed_entry *next;
+};
+
+/* A complete 200 response for a small file, without the
+ * status line, and the Date and Connection headers.
+ * These are kept in the response cache (response_cache.c).
+ */
+struct response_entry {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;                 /* size of the original file */
+    int secure;                 /* the Server header differs */
+    const char *mime_type;      /* as returned by get_mime_type() */
+    int vary;                   /* the response depends on Accept-Encoding */
+    int accept_encoding;        /* of the client, if vary is set */
+    time_t expires;             /* 0 if it does not expire */
+    char *data;                 /* the headers followed by the body */
+    size_t header_len;
+    size_t len;
+    int use_count;
+    int cached;                 /* if zero, it is freed when unused */
+    time_t last_used;
+    struct response_entry *next;
+};
+
+/* A generated directory listing (see dir_listing.c).
+ */
+struct listing_entry {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;               /* of the directory */
+    char *uri;                  /* the listing is titled by it */
+    int json;
+    char *data;
+    size_t len;
+    int use_count;
+    int cached;                 /* if zero, it is freed when unused */
+    time_t created;
+    time_t last_used;
+    struct listing_entry *next;
+};
+
+/* A mapped part of a large file (see mmap_window.c).
+ */
+struct mmap_window {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;                 /* of the file */
+    off_t index;                /* offset / MMAP_WINDOW_SIZE */
+    off_t offset;
+    char *mmap;
+    size_t len;
+    int fd;                     /* holds the read lease on the file */
+    int lease_broken;
+    int use_count;
+    int cached;                 /* if zero, it is unmapped when unused */
+    time_t last_used;
+    struct mmap_window *next;
+};
+
+/* A directory above pathnames that did not exist (see
+ * negative_cache.c). One that exists is watched; one that does not
+ * refers to the nearest directory above it that does.
+ */
+struct negative_dir {
+    char *path;
+    int len;
+    unsigned int hash;
+    struct negative_dir *parent; /* held; NULL if this one exists */
+    int wd;                     /* its inotify watch, or -1 */
+    time_t mtime;               /* compared once a second, if not watched */
+    time_t checked;
+    unsigned int generation;    /* renewed whenever the directory changes */
+    int use_count;              /* entries and directories below it */
+    int cached;                 /* in the table of directories */
+    struct negative_dir *next;
+};
+
+/* A pathname that did not exist (see negative_cache.c).
+ */
+struct negative_entry {
+    char *path;
+    unsigned int hash;
+    struct negative_dir *dir;   /* its directory, held */
+    unsigned int generation;    /* of the nearest existing directory */
+    time_t expires;
+    struct negative_entry *next;
+};
+
+/* Chunked encoding and compression of CGI output, whose
+ * length is not known.
+ */
+struct pipe_filter {
+    int chunked;                /* Transfer-Encoding: chunked */
+    int encoding;               /* ENCODING_* of the output */
+    int finished;               /* the last chunk has been produced */
+    int discard;                /* the status allows no body */
+#ifdef HAVE_LIBZ
+    z_stream zs;
+#endif
+    char *out_start;            /* output not yet sent */
+    char *out_end;
+    char out[PIPE_FILTER_BUFFER_SIZE];
 };
 
 /* This structure is used for both HIC loaded modules
@@ -75,6 +200,43 @@ typedef struct {
     int pipe; /* non zero if it's a pipe */
 } tmp_fd;
 
+/* A pack file, mapped (see pack.c).
+ */
+struct pack_file {
+    char *map;
+    size_t len;
+    const struct pack_record *records; /* sorted by path */
+    unsigned int entries;
+    int use_count;              /* the virthost, and its requests */
+    int fd;                     /* holds the read lease, or -1 */
+    int broken;                 /* the pack is about to be written */
+};
+
+/* An open directory below a document root (see docroot.c).
+ */
+struct docroot_dir {
+    char *path;                 /* relative to the document root */
+    int len;
+    unsigned int hash;
+    int fd;
+    int use_count;
+    int cached;                 /* if zero, it is closed when unused */
+    time_t opened;
+    time_t last_used;
+    struct docroot_dir *next;
+};
+
+/* An open document root (see docroot.c).
+ */
+struct docroot {
+    char *path;                 /* without the trailing '/' */
+    int len;
+    int fd;
+    int use_count;              /* the virthost, and its requests */
+    struct docroot_dir *dirs[DOCROOT_DIR_HASH_SIZE];
+    int dirs_cached;
+};
+
 struct access_node
 {
   char *pattern;
@@ -90,6 +252,10 @@ typedef struct _virthost {
     int ip_len;                 /* strlen of IP */
     int host_len;               /* strlen of hostname */
     int document_root_len;      /* strlen of document root */
+    struct pack_file *pack;     /* if the document root is a pack */
+    struct docroot *docroot;    /* or its descriptor, if it could be opened */
+    char *ssl_cert;             /* SSLVirtualHostCertificate, or NULL */
+    char *ssl_key;
     alias *alias_hashtable[ALIAS_HASHTABLE_SIZE]; /* aliases in this virthost */
 
     int n_access;
@@ -97,6 +263,15 @@ typedef struct _virthost {
     struct _virthost *next;
 } virthost;
 
+/* A part of a multipart/byteranges response.
+ */
+struct byte_range {
+    off_t start;                /* first byte of the part */
+    off_t stop;                 /* one after the last byte */
+    int hdr_pos;                /* offset of the part header in range_headers */
+    int hdr_len;                /* length of the part header */
+};
+
 struct request {                /* pending requests */
     int fd;                     /* client's socket fd */
 #ifdef USE_POLL
@@ -104,12 +279,21 @@ struct request {                /* pending requests */
 #endif
 #ifdef ENABLE_SSL
     gnutls_session ssl_state;
+    struct ssl_handshake *handshake; /* done by a handshake thread */
+    int ssl_record_bytes;       /* sent in small records (dynamic sizing) */
+    time_t ssl_last_send;
+    char *ssl_bulk;             /* records of socket_send_bulk() */
+    int ssl_bulk_size;
+    int ssl_bulk_start;
+    int ssl_bulk_end;
+    int ssl_bulk_plain;         /* the data they hold */
     char * certificate_verified; /* a string that describes the output of the
                                   * certificate verification function. Needed
                                   * in CGIs.
                                   */
 #endif
     int secure; /* whether ssl or not */
+    int ktls_send;              /* the kernel makes the TLS records (kTLS) */
     int		alert_to_send; /* in SEND_ALERT state */
 
     int status;                 /* see #defines.h */
@@ -117,9 +301,14 @@ struct request {                /* pending requests */
     char *pathname;             /* pathname of requested file */
     off_t range_start;        /* send file from byte ... */
     off_t range_stop;         /* to byte */
-    off_t pipe_range_stop;    /* This is used only if the file is sent by the pipe_read() method.
-                                 * Indicates how many bytes to send from a file (actually a copy of range_stop,
-                                 * but it is modified. */
+    off_t pipe_range_stop;    /* The end of the range (or part) sent by io_shuffle() */
+    char *range_header;         /* value of the Range header. Parsed in init_get() */
+    struct byte_range *ranges;  /* the parts of a multipart response, followed
+                                 * by the closing boundary. NULL if only one range
+                                 * is sent. */
+    int range_count;            /* number of parts in ranges */
+    int range_current;          /* the next entry of ranges to be sent */
+    char *range_headers;        /* the boundary, and the preformatted part headers */
     int keepalive_given;	/* whether the keepalive was sent by the client */
     int keepalive;              /* keepalive status */
     int kacount;                /* keepalive count */
@@ -144,6 +333,11 @@ struct request {                /* pending requests */
     char *http_version_str;     /* HTTP/?.? of req */
     int response_status;        /* R_NOT_FOUND etc. */
 
+    int accept_encoding;        /* Accept-Encoding: an OR of ENCODING_* */
+    int encoding;               /* Content-Encoding of the file sent */
+    int vary_encoding;          /* non zero if the response depends on
+                                 * Accept-Encoding */
+
     char *if_modified_since;    /* If-Modified-Since */
     time_t last_modified;       /* Last-modified: */
 
@@ -189,6 +383,30 @@ struct request {                /* pending requests */
     char *content_length;       /* env variable */
 
     struct mmap_entry *mmap_entry_var;
+    struct compressed_entry *compressed_entry_var;
+    struct response_entry *response_entry_var;
+    struct listing_entry *listing_entry_var;
+    struct pipe_filter *pipe_filter;
+    struct pack_file *pack;     /* the pack of the virthost, if any */
+    struct docroot *docroot;    /* the document root of the virthost */
+    int from_pack;              /* the file is looked up in pack */
+    char *pack_mime;            /* the mime type recorded in the pack */
+
+    /* used by io_shuffle() */
+    off_t readahead_pos;        /* the file was read ahead up to here */
+    off_t dropbehind_pos;       /* pages before this were dropped */
+    char *io_buffer;            /* when not using sendfile() */
+    int io_buffer_start;
+    int io_buffer_end;
+    struct mmap_window *mmap_window_var; /* or a window of the file */
+    int no_mmap_window;         /* could not be mapped; use io_buffer */
+
+    struct async_open *async_open; /* used in the ASYNC_OPEN status */
+
+    /* MSG_ZEROCOPY sends (see socket.c) */
+    int zerocopy;
+    unsigned int zerocopy_sends; /* of the connection, not the request */
+    unsigned int zerocopy_done;
 
     struct request *next;       /* next */
     struct request *prev;       /* previous */
@@ -239,6 +457,7 @@ typedef struct {
 	int sigalrm_flag; /* 1 => signal has happened, needs attention */
 	int sigusr1_flag; /* 1 => signal has happened, needs attention */
 	int sigterm_flag; /* lame duck mode */
+	int sigio_flag; /* 1 => a file lease is being broken */
 	
 	int max_fd;
 	
@@ -247,11 +466,65 @@ typedef struct {
 	int total_connections;
 
 	/* for SIGBUS handling */
-	jmp_buf env;
-	int handle_sigbus;
+
+	/* written by the async I/O threads, when jobs are done */
+	int async_fd[2];
+	struct async_open *async_done;
+#ifdef ENABLE_SSL
+	struct ssl_handshake *handshake_done;
+#endif
 
 } server_params;
 
+/* The open() and fstat() of a file, done by an async I/O thread
+ * for a request in the ASYNC_OPEN status. A job of async_io_run()
+ * has a func instead of a req.
+ */
+struct async_open {
+    request *req;
+    void (*func) (void *arg);
+    void *arg;
+    server_params *params;
+    const char *pathname;
+    struct docroot *docroot;    /* held by the request */
+
+    int fd;                     /* -1 on error */
+    int error;                  /* errno of open() */
+    struct stat statbuf;
+
+    /* the directory index, if pathname is a directory */
+    int index_done;             /* true if it was looked up */
+    char *index;                /* as find_and_open_directory_index() */
+    int index_fd;
+    int index_error;
+    struct stat index_statbuf;
+
+    /* used by the server thread only */
+    int done;
+    int parked;                 /* in the blocked queue */
+
+    struct async_open *next;
+};
+
+#ifdef ENABLE_SSL
+/* A gnutls_handshake() call, done by a handshake thread for a request
+ * in the FINISH_HANDSHAKE status.
+ */
+struct ssl_handshake {
+    request *req;
+    server_params *params;
+
+    int result;                 /* of gnutls_handshake() */
+    struct timeval queued;
+
+    /* used by the server thread only */
+    int done;
+    int parked;                 /* in the blocked queue */
+
+    struct ssl_handshake *next;
+};
+#endif
+
 /* global server variables */
 
 extern int maintenance_interval;
@@ -264,8 +537,35 @@ extern int use_localtime;
 
 extern int max_files_cache;
 extern int max_file_size_cache;
+extern int file_leases;
+extern char *cache_manifest;
+extern int cache_warmup_size;
+extern int cache_warmup_populate;
+extern int drop_behind_size;
+extern int window_cache_size;
+extern int zerocopy_threshold;
+extern int negative_cache_size;
+extern int negative_cache_ttl;
+
+extern int directory_listing;
+extern int directory_listing_cache_size;
+
+extern int async_io_threads;
+extern int ssl_handshake_threads;
+extern int async_io_prefetch;
+
+extern int precompressed_files;
+extern int compression;
+extern int compression_level;
+extern int compression_min_size;
+extern int compression_cache_size;
+
+extern int response_cache_size;
+extern int response_cache_max_file_size;
 
 extern int boa_ssl;
+extern int ssl_session_tickets;
+extern int ssl_dynamic_record_threshold;
 
 extern int server_port;
 extern int ssl_port;
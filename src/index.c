@@ -92,7 +92,8 @@ void add_directory_index(const char *index_file)
  * a pointer to the index file or NULL if not found
  */
 
-char *find_and_open_directory_index(const char *directory, int directory_len, int* data_fd)
+char *find_and_open_directory_index(struct docroot *root,
+	const char *directory, int directory_len, int* data_fd)
 {
 char pathname_with_index[MAX_PATH_LENGTH + 1];
 int total_size, i;
@@ -116,7 +117,7 @@ int total_size, i;
       	
       pathname_with_index[total_size] = 0;
 
-      *data_fd = open(pathname_with_index, O_RDONLY);	
+      *data_fd = docroot_open(root, pathname_with_index);
 
       /* If we couldn't access the file, then return the
        * filename as usual, and a data_fd (-1), with the
@@ -148,6 +149,23 @@ char *find_default_directory_index()
    return directory_index_table[0]->file;
 }
 
+/*
+ * Name: get_directory_index
+ *
+ * Description: Returns the n-th directory index file, in the list
+ *
+ * Returns:
+ *
+ * a pointer to the index file or NULL if there are less than n+1
+ */
+
+char *get_directory_index(int n)
+{
+   if (n < 0 || n >= DIRECTORY_INDEX_TABLE_SIZE ||
+       directory_index_table[n] == NULL) return NULL;
+   return directory_index_table[n]->file;
+}
+
 
 /*
  * Empties the virthost hashtable, deallocating any allocated memory.
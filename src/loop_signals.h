@@ -45,6 +45,8 @@ inline static void handle_signals( server_params* params)
                sigalrm_run();
            if (params->sigusr1_flag)
                sigusr1_run();
+           if (params->sigio_flag)
+               sigio_run();
            if (params->sigterm_flag) {
                if (params->sigterm_flag == 1) {
                    sigterm_stage1_run();
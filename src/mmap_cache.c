@@ -21,7 +21,10 @@
 
 /* $Id: mmap_cache.c,v 1.14 2003/01/26 11:25:39 nmav Exp $*/
 
+#define _GNU_SOURCE		/* F_SETLEASE */
+
 #include "boa.h"
+#include <signal.h>
 
 #ifdef ENABLE_SMP
 pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -31,6 +34,123 @@ int mmap_list_entries_used = 0;
 int mmap_list_total_requests = 0;
 int mmap_list_hash_bounces = 0;
 
+/*
+ * Name: lease_file
+ * Description: Takes a read lease on the file, through a new
+ * descriptor that is kept by the cache entry (or window) that maps
+ * the file. While the lease is held, a process that opens the file
+ * for writing (or truncates it) is blocked until the lease is
+ * released, and we are told with a SIGIO (see check_mmap_leases()).
+ * Thus a mapped file is never truncated under a request that sends
+ * it, and no SIGBUS can happen.
+ *
+ * Returns: the descriptor, or -1 if the file cannot be leased (ie.
+ * it is open for writing, or it is not owned by the server's user).
+ */
+int lease_file(int data_fd, struct stat *s)
+{
+#ifdef F_SETLEASE
+   static int warned = 0;
+   struct stat statbuf;
+   int fd;
+
+   if (!file_leases)
+      return -1;
+
+   /* the lease must not be kept by the descriptors of the requests */
+   fd = reopen_fd(data_fd);
+   if (fd == -1)
+      fd = dup(data_fd);
+   if (fd == -1)
+      return -1;
+
+   if (fcntl(fd, F_SETLEASE, F_RDLCK) == -1) {
+      if (errno != EAGAIN && !warned) {
+	 warned = 1;
+	 log_error_time();
+	 perror("Files that cannot be leased are not kept in the file "
+		"cache. fcntl(F_SETLEASE)");
+      }
+      close(fd);
+      return -1;
+   }
+
+   /* the lease break is reported to the process, not to the
+    * thread that took it.
+    */
+   fcntl(fd, F_SETOWN, getpid());
+   set_cloexec_fd(fd);
+
+   /* the file may have changed before the lease was taken */
+   if (fstat(fd, &statbuf) == -1 || statbuf.st_size != s->st_size ||
+       statbuf.st_mtime != s->st_mtime) {
+      close(fd);
+      return -1;
+   }
+
+   return fd;
+#else
+   return -1;
+#endif
+}
+
+/*
+ * Name: check_docroot_leases
+ * Description: Warns if the files of the document root path cannot be
+ * leased (ie. they are owned by another user, or the file system does
+ * not support leases), since these are never kept in the file cache.
+ * The first regular file of the directory is tried. Called after the
+ * privileges are dropped.
+ */
+void check_docroot_leases(const char *path)
+{
+#ifdef F_SETLEASE
+   char fname[MAX_PATH_LENGTH + 1];
+   struct dirent *d;
+   struct stat statbuf;
+   int fd, err = 0;
+   DIR *dir;
+
+   if (!file_leases || max_files_cache == 0)
+      return;
+
+   dir = opendir(path);
+   if (dir == NULL)
+      return;
+
+   while ((d = readdir(dir)) != NULL) {
+      if (d->d_name[0] == '.')
+	 continue;
+      if (snprintf(fname, sizeof(fname), "%s/%s", path, d->d_name) >=
+	  sizeof(fname))
+	 continue;
+
+      /* not blocked by the lease of another process */
+      fd = open(fname, O_RDONLY | O_NONBLOCK);
+      if (fd == -1)
+	 continue;
+      if (fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) {
+	 close(fd);
+	 continue;
+      }
+
+      if (fcntl(fd, F_SETLEASE, F_RDLCK) == -1)
+	 err = errno;
+      close(fd);		/* releases the lease */
+      break;
+   }
+   closedir(dir);
+
+   /* EAGAIN: the file is open for writing right now */
+   if (err != 0 && err != EAGAIN) {
+      log_error_time();
+      fprintf(stderr, "The files of %s cannot be leased (%s), and are "
+	      "not kept in the file cache. Set FileLeases to 0, or run as "
+	      "the owner of the files.\n", path, strerror(err));
+   }
+#endif
+}
+
 #ifdef USE_MMAP_LIST
 
 static int previous_max_files_cache = 0;
@@ -39,49 +159,113 @@ static int previous_max_files_cache = 0;
 static struct mmap_entry* mmap_list;
 
 
-struct mmap_entry *find_mmap(int data_fd, struct stat *s)
+/* Looks for the entry of the file described by s, or for an
+ * empty slot for it. *found is set if the entry exists. If the
+ * list is full, the unused entries are cleaned up if cleanup is set.
+ * No locking here. The caller has to do the proper locking.
+ *
+ * Returns: the index, or -1 if no slot could be made available.
+ */
+static int probe_mmap_list(struct stat *s, int *found, int cleanup)
 {
-   char *m;
    int i, start;
 
+   *found = 0;
+   i = start = MMAP_LIST_HASH(s->st_dev, s->st_ino, s->st_size);
+
+   for (;mmap_list[i].available;) {
+      if (mmap_list[i].dev == s->st_dev && mmap_list[i].ino == s->st_ino
+	  && mmap_list[i].len == s->st_size && !mmap_list[i].lease_broken) {
+	 *found = 1;
+	 return i;
+      }
+      mmap_list_hash_bounces++;
+      i = MMAP_LIST_NEXT(i);
+
+      if (i == start)
+         return cleanup ? cleanup_mmap_list(0) : -1; /* an empty index, or -1 */
+   }
+
+   return i;
+}
+
+/* Fills the empty slot i. fd holds the lease on the file, and
+ * pathname is recorded for the cache manifest.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void fill_mmap_entry(int i, struct stat *s, char *m, int fd,
+			    const char *pathname, int use_count)
+{
+   mmap_list_entries_used++;
+   mmap_list[i].fd = fd;
+   mmap_list[i].lease_broken = 0;
+   mmap_list[i].dev = s->st_dev;
+   mmap_list[i].ino = s->st_ino;
+   mmap_list[i].len = s->st_size;
+   mmap_list[i].mmap = m;
+   mmap_list[i].use_count = use_count;
+   mmap_list[i].available = 1;
+   mmap_list[i].times_used = 1;
+   mmap_list[i].pathname = pathname ? strdup(pathname) : NULL;
+}
+
+/* Unmaps the entry i.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void remove_mmap_entry(int i)
+{
+   munmap(mmap_list[i].mmap, mmap_list[i].len);
+   close(mmap_list[i].fd);	/* releases the lease */
+   free(mmap_list[i].pathname);
+   mmap_list[i].pathname = NULL;
+   mmap_list[i].available = 0;
+   mmap_list_entries_used--;
+}
+
+/*
+ * Name: find_mmap
+ * Description: Returns the cache entry of the file described by s,
+ * mapping it if it is not in the cache.
+ *
+ * Returns: the entry, which must be given back using release_mmap(),
+ * or NULL if the file could not be leased or mapped.
+ */
+struct mmap_entry *find_mmap(int data_fd, struct stat *s,
+			     const char *pathname)
+{
+   char *m;
+   int i, found, fd;
+
    if ( max_files_cache == 0) return NULL;
 
 #ifdef ENABLE_SMP
    pthread_mutex_lock(&mmap_lock);
 #endif
    mmap_list_total_requests++;
-   i = start = MMAP_LIST_HASH(s->st_dev, s->st_ino, s->st_size);
+   i = probe_mmap_list(s, &found, 1);
 
-   for (;mmap_list[i].available;) {
-      if (mmap_list[i].dev == s->st_dev && mmap_list[i].ino == s->st_ino
-	  && mmap_list[i].len == s->st_size) {
-	 mmap_list[i].use_count++;
-	 mmap_list[i].times_used++;
+   if (found) {
+      mmap_list[i].use_count++;
+      mmap_list[i].times_used++;
 
 #ifdef DEBUG0
-	 fprintf(stderr,
-		 "Old mmap_list entry %d use_count now %d (hash was %d)\n",
-		 i, mmap_list[i].use_count, start);
+      fprintf(stderr,
+	      "Old mmap_list entry %d use_count now %d\n",
+	      i, mmap_list[i].use_count);
 #endif
 #ifdef ENABLE_SMP
-	 pthread_mutex_unlock(&mmap_lock);
+      pthread_mutex_unlock(&mmap_lock);
 #endif
-	 return &mmap_list[i];
-      }
-      mmap_list_hash_bounces++;
-      i = MMAP_LIST_NEXT(i);
+      return &mmap_list[i];
+   }
 
-      if (i == start) {
-         i = cleanup_mmap_list(0);
-         if (i != -1) break; /* if we found an empty index */
-         /* otherwise no space could be cleaned. So say bye!!
-          */
+   if (i == -1) {
+      /* no space could be cleaned. So say bye!!
+       */
 #ifdef ENABLE_SMP
-	 pthread_mutex_unlock(&mmap_lock);
+      pthread_mutex_unlock(&mmap_lock);
 #endif
-	 return NULL;
-      }
-
+      return NULL;
    }
 
    /* didn't find an entry that matches our dev/inode/size.
@@ -92,25 +276,30 @@ struct mmap_entry *find_mmap(int data_fd, struct stat *s)
       so it shouldn't be _too_ bad.
     */
 
-   m = mmap(0, s->st_size, PROT_READ, MAP_OPTIONS, data_fd, 0);
+   fd = lease_file(data_fd, s);
+   if (fd == -1) {
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&mmap_lock);
+#endif
+      return NULL;
+   }
+
+   m = mmap(0, s->st_size, PROT_READ, MAP_OPTIONS, fd, 0);
 
    if ( m == MAP_FAILED) {
       /* boa_perror(req,"mmap"); */
+      close(fd);
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&mmap_lock);
+#endif
       return NULL;
    }
 #ifdef DEBUG0
    fprintf(stderr,
-	   "New mmap_list entry %d (hash was %d) [ino: %u size: %u]\n", i,
-	   start, s->st_ino, s->st_size);
+	   "New mmap_list entry %d [ino: %u size: %u]\n", i,
+	   s->st_ino, s->st_size);
 #endif
-   mmap_list_entries_used++;
-   mmap_list[i].dev = s->st_dev;
-   mmap_list[i].ino = s->st_ino;
-   mmap_list[i].len = s->st_size;
-   mmap_list[i].mmap = m;
-   mmap_list[i].use_count = 1;
-   mmap_list[i].available = 1;
-   mmap_list[i].times_used = 1;
+   fill_mmap_entry(i, s, m, fd, pathname, 1);
 
 #ifdef ENABLE_SMP
    pthread_mutex_unlock(&mmap_lock);
@@ -159,9 +348,7 @@ int cleanup_mmap_list(int all)
 	  	mmap_list[i].ino, mmap_list[i].len) != i)) {
          
          ret = i;
-	 munmap(mmap_list[i].mmap, mmap_list[i].len);
-	 mmap_list[i].available = 0;
-	 mmap_list_entries_used--;
+	 remove_mmap_entry(i);
 #ifdef DEBUG
          count++;
 #endif
@@ -182,9 +369,7 @@ int cleanup_mmap_list(int all)
 	 if (mmap_list[i].available && mmap_list[i].use_count == 0) {
 
             ret = i;
-	    munmap(mmap_list[i].mmap, mmap_list[i].len);
-	    mmap_list[i].available = 0;
-	    mmap_list_entries_used--;
+	    remove_mmap_entry(i);
 #ifdef DEBUG
             count++;
 #endif
@@ -225,6 +410,9 @@ void release_mmap(struct mmap_entry *e)
 
    e->use_count--;
 
+   /* the writer waits for the last user */
+   if (e->use_count == 0 && e->lease_broken)
+      remove_mmap_entry(e - mmap_list);
 
  finish:
 #ifdef ENABLE_SMP
@@ -251,14 +439,58 @@ struct mmap_entry *find_named_mmap(char *fname)
       return NULL;
    }
 
-   e = find_mmap(data_fd, &statbuf);
+   e = find_mmap(data_fd, &statbuf, fname);
    close(data_fd);
    return e;
 }
 
+/*
+ * Name: check_mmap_leases
+ * Description: Called by the main thread after a SIGIO. Finds the
+ * entries whose lease is being broken; these are not given to new
+ * requests. The unused ones are removed at once, which lets the
+ * writer go on. The requests that use the others continue with
+ * io_shuffle() (see process_get()), and the last one removes the
+ * entry in release_mmap().
+ */
+void check_mmap_leases(void)
+{
+#ifdef F_GETLEASE
+   int i;
+
+   if (mmap_list == NULL)
+      return;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&mmap_lock);
+#endif
+   for (i = 0; i < max_files_cache; i++) {
+      if (!mmap_list[i].available || mmap_list[i].lease_broken)
+	 continue;
+
+      /* during a break, this is the type of lease we should
+       * downgrade to, ie. F_UNLCK.
+       */
+      if (fcntl(mmap_list[i].fd, F_GETLEASE) == F_RDLCK)
+	 continue;
+
+      mmap_list[i].lease_broken = 1;
+      if (mmap_list[i].use_count == 0)
+	 remove_mmap_entry(i);
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&mmap_lock);
+#endif
+#endif
+}
+
 void mmap_reinit()
 {
    
+#ifdef ENABLE_SMP
+   /* the warmup thread may be using the list */
+   pthread_mutex_lock(&mmap_lock);
+#endif
    if (max_files_cache > previous_max_files_cache) {
       mmap_list = realloc( mmap_list, sizeof(struct mmap_entry)*max_files_cache);
       if (mmap_list == NULL) {
@@ -281,6 +513,9 @@ void mmap_reinit()
       max_files_cache = previous_max_files_cache;
    }
    previous_max_files_cache = max_files_cache;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&mmap_lock);
+#endif
 
 }
 
@@ -298,4 +533,289 @@ void initialize_mmap()
    return;
 }
 
+/* The cache manifest records the files of the mmap cache, the most
+ * used first, so that the cache can be filled again after a restart
+ * (see warmup_mmap_cache()). Each line is:
+ *   <times used> <size> <pathname>
+ */
+struct manifest_item {
+   int times_used;
+   size_t len;
+   char *pathname;
+};
+
+static int compare_manifest_items(const void *a, const void *b)
+{
+   const struct manifest_item *x = a, *y = b;
+
+   return y->times_used - x->times_used;
+}
+
+/*
+ * Name: write_mmap_manifest
+ * Description: Writes the files of the mmap cache to CacheManifest.
+ * Called on shutdown, and before the cache is cleaned up every
+ * maintenance interval.
+ */
+void write_mmap_manifest(void)
+{
+   struct manifest_item *items;
+   char tmpname[MAX_PATH_LENGTH + 8];
+   FILE *fp;
+   int i, n = 0;
+
+   if (cache_manifest == NULL || mmap_list == NULL || max_files_cache == 0)
+      return;
+
+   items = malloc(sizeof(struct manifest_item) * max_files_cache);
+   if (items == NULL)
+      return;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&mmap_lock);
+#endif
+   for (i = 0; i < max_files_cache; i++) {
+      if (!mmap_list[i].available || mmap_list[i].pathname == NULL ||
+	  strchr(mmap_list[i].pathname, '\n') != NULL)
+	 continue;
+      items[n].pathname = strdup(mmap_list[i].pathname);
+      if (items[n].pathname == NULL)
+	 continue;
+      items[n].times_used = mmap_list[i].times_used;
+      items[n].len = mmap_list[i].len;
+      n++;
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&mmap_lock);
+#endif
+
+   qsort(items, n, sizeof(struct manifest_item), compare_manifest_items);
+
+   /* written to a temporary file first, so that a warmup never
+    * reads a partial manifest.
+    */
+   snprintf(tmpname, sizeof(tmpname), "%s.tmp", cache_manifest);
+   fp = fopen(tmpname, "w");
+   if (fp == NULL) {
+      log_error_time();
+      fprintf(stderr, "Could not write the cache manifest %s: ", tmpname);
+      perror("fopen");
+   } else {
+      for (i = 0; i < n; i++)
+	 fprintf(fp, "%d %lu %s\n", items[i].times_used,
+		 (unsigned long) items[i].len, items[i].pathname);
+      if (fclose(fp) == EOF || rename(tmpname, cache_manifest) == -1) {
+	 log_error_time();
+	 fprintf(stderr, "Could not write the cache manifest %s: ",
+		 cache_manifest);
+	 perror("write");
+	 unlink(tmpname);
+      }
+   }
+
+   for (i = 0; i < n; i++)
+      free(items[i].pathname);
+   free(items);
+}
+
+/* Adds the file to the mmap cache, unless it is already there.
+ * Only free slots are used; the entries of the running server are
+ * never evicted for the ones of the manifest. The mapping is done
+ * without holding the lock, since it reads the file if MAP_POPULATE
+ * is used.
+ *
+ * Returns: 1 if the file was added, 0 if not, or -1 if the
+ * cache is full.
+ */
+static int warmup_mmap_file(int data_fd, struct stat *s, const char *pathname)
+{
+   char *m;
+   int i, found, fd, flags = MAP_OPTIONS;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&mmap_lock);
+#endif
+   i = probe_mmap_list(s, &found, 0);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&mmap_lock);
+#endif
+   if (found)
+      return 0;
+   if (i == -1)
+      return -1;
+
+#ifdef MAP_POPULATE
+   if (cache_warmup_populate)
+      flags |= MAP_POPULATE;
+#endif
+
+   fd = lease_file(data_fd, s);
+   if (fd == -1)
+      return 0;
+
+   m = mmap(0, s->st_size, PROT_READ, flags, fd, 0);
+   if (m == MAP_FAILED) {
+      close(fd);
+      return 0;
+   }
+
+#ifdef MADV_WILLNEED
+   /* otherwise the pages are read in the background */
+   if (!cache_warmup_populate)
+      madvise(m, s->st_size, MADV_WILLNEED);
+#endif
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&mmap_lock);
+#endif
+   /* the list may have changed meanwhile */
+   i = probe_mmap_list(s, &found, 0);
+   if (found || i == -1) {
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&mmap_lock);
+#endif
+      munmap(m, s->st_size);
+      close(fd);
+      return found ? 0 : -1;
+   }
+   fill_mmap_entry(i, s, m, fd, pathname, 0);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&mmap_lock);
+#endif
+
+   return 1;
+}
+
+/*
+ * Name: warmup_mmap_cache
+ * Description: Maps the files listed in CacheManifest, the most used
+ * first, until CacheWarmupSize bytes are mapped or the cache is full.
+ */
+static void warmup_mmap_cache(void)
+{
+   char line[MAX_PATH_LENGTH + 64], *pathname, *p;
+   unsigned long budget, bytes = 0;
+   struct stat statbuf;
+   int fd, ret, files = 0;
+   FILE *fp;
+
+   fp = fopen(cache_manifest, "r");
+   if (fp == NULL) {
+      if (errno != ENOENT) {
+	 log_error_time();
+	 fprintf(stderr, "Could not read the cache manifest %s: ",
+		 cache_manifest);
+	 perror("fopen");
+      }
+      return;
+   }
+
+   budget = cache_warmup_size;
+
+   while (fgets(line, sizeof(line), fp) != NULL) {
+      if (mmap_list_entries_used >= max_files_cache)
+	 break;
+
+      p = strchr(line, '\n');
+      if (p == NULL)
+	 continue;		/* too long */
+      *p = 0;
+
+      /* skip the times used and the size */
+      pathname = strchr(line, ' ');
+      if (pathname != NULL)
+	 pathname = strchr(pathname + 1, ' ');
+      if (pathname == NULL)
+	 continue;
+      pathname++;
+
+      fd = open(pathname, O_RDONLY);
+      if (fd == -1)
+	 continue;
+
+      ret = 0;
+      if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) &&
+	  statbuf.st_size > 0 && statbuf.st_size <= max_file_size_cache &&
+	  bytes + statbuf.st_size <= budget) {
+	 ret = warmup_mmap_file(fd, &statbuf, pathname);
+	 if (ret == 1) {
+	    bytes += statbuf.st_size;
+	    files++;
+	 }
+      }
+      close(fd);
+
+      if (ret == -1 || bytes >= budget)
+	 break;
+   }
+
+   fclose(fp);
+
+   log_error_time();
+   fprintf(stderr, "Added %d files (%lu bytes) from %s to the file cache.\n",
+	   files, bytes, cache_manifest);
+}
+
+#ifdef ENABLE_SMP
+static int warmup_running = 0;
+
+static void *warmup_thread(void *arg)
+{
+   sigset_t sigset;
+
+   /* the signals are handled by the main thread */
+   sigfillset(&sigset);
+   pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+   warmup_mmap_cache();
+
+   pthread_mutex_lock(&mmap_lock);
+   warmup_running = 0;
+   pthread_mutex_unlock(&mmap_lock);
+
+   return NULL;
+}
+#endif
+
+/*
+ * Name: start_mmap_warmup
+ * Description: Fills the mmap cache from CacheManifest, in a
+ * background thread if possible. Called on startup, and when the
+ * configuration is read again.
+ */
+void start_mmap_warmup(void)
+{
+#ifdef ENABLE_SMP
+   pthread_attr_t attr;
+   pthread_t tid;
+   int ret;
+#endif
+
+   if (cache_manifest == NULL || cache_warmup_size <= 0 ||
+       max_files_cache == 0)
+      return;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&mmap_lock);
+   if (warmup_running) {
+      pthread_mutex_unlock(&mmap_lock);
+      return;
+   }
+   warmup_running = 1;
+   pthread_mutex_unlock(&mmap_lock);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   ret = pthread_create(&tid, &attr, &warmup_thread, NULL);
+   pthread_attr_destroy(&attr);
+
+   if (ret == 0)
+      return;
+
+   warmup_running = 0;
+#endif
+
+   warmup_mmap_cache();
+}
+
 #endif				/* USE_MMAP_LIST */
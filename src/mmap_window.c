@@ -0,0 +1,272 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the window cache. Files larger than
+ * MaxFileSizeCache are not mapped whole; when they cannot be sent with
+ * sendfile() (ie. in TLS connections), io_shuffle() used to read them
+ * into a buffer of each request. Instead, they are mapped in windows of
+ * MMAP_WINDOW_SIZE bytes, which are shared by all the requests (and
+ * ranges) that send the same part of the file. The least recently used
+ * windows are unmapped to stay within WindowCacheSize.
+ *
+ * As the file cache, each window holds a read lease on the file (see
+ * lease_file()), so that it is never truncated while it is mapped.
+ */
+
+#define _GNU_SOURCE		/* F_GETLEASE */
+
+#include "boa.h"
+
+int window_cache_size = 64 * 1024 * 1024;
+
+static struct mmap_window *window_cache[WINDOW_CACHE_HASH_SIZE];
+static size_t window_cache_bytes = 0;
+
+#ifdef ENABLE_SMP
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define WINDOW_HASH(dev,ino,index) \
+	((((unsigned long int)(ino)) ^ ((unsigned long int)(dev)) ^ \
+	  ((unsigned long int)(index) * 31)) % WINDOW_CACHE_HASH_SIZE)
+
+static void free_window(struct mmap_window *w)
+{
+   munmap(w->mmap, w->len);
+   close(w->fd);		/* releases the lease */
+   free(w);
+}
+
+/* Unlinks *p from the cache. It is unmapped now, or when the last
+ * request that uses it is done.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void remove_window(struct mmap_window **p)
+{
+   struct mmap_window *w = *p;
+
+   *p = w->next;
+   window_cache_bytes -= w->len;
+   w->cached = 0;
+   if (w->use_count == 0)
+      free_window(w);
+}
+
+/* Removes the unused windows, least recently used first, until
+ * bytes more fit in the cache.
+ * No locking here. The caller has to do the proper locking.
+ *
+ * Returns: 1 if there is enough room, 0 otherwise.
+ */
+static int make_room(size_t bytes)
+{
+   struct mmap_window **p, **oldest;
+   int i;
+
+   if (bytes > (size_t) window_cache_size)
+      return 0;
+
+   while (window_cache_bytes + bytes > (size_t) window_cache_size) {
+      oldest = NULL;
+      for (i = 0; i < WINDOW_CACHE_HASH_SIZE; i++) {
+	 for (p = &window_cache[i]; *p != NULL; p = &(*p)->next) {
+	    if ((*p)->use_count == 0 &&
+		(oldest == NULL || (*p)->last_used < (*oldest)->last_used))
+	       oldest = p;
+	 }
+      }
+
+      if (oldest == NULL)
+	 return 0;		/* everything is in use */
+
+      remove_window(oldest);
+   }
+
+   return 1;
+}
+
+/* Looks up the given window of the file described by s. Removes
+ * the windows of older versions of the file, if they are not in use.
+ * No locking here. The caller has to do the proper locking.
+ */
+static struct mmap_window *lookup_window(struct stat *s, off_t index)
+{
+   struct mmap_window **p, *w;
+
+   p = &window_cache[WINDOW_HASH(s->st_dev, s->st_ino, index)];
+   while ((w = *p) != NULL) {
+      if (w->dev == s->st_dev && w->ino == s->st_ino && w->index == index) {
+	 if (w->mtime != s->st_mtime || w->size != s->st_size) {
+	    if (w->use_count == 0) {
+	       remove_window(p);
+	       continue;
+	    }
+	 } else if (!w->lease_broken)
+	    return w;
+      }
+      p = &w->next;
+   }
+
+   return NULL;
+}
+
+/*
+ * Name: find_mmap_window
+ * Description: Returns the window of the file data_fd, that contains
+ * the byte at pos. The window is mapped if it is not in the cache.
+ *
+ * Returns: the window, which must be given back using
+ * release_mmap_window(), or NULL if the file could not be leased or
+ * mapped, or the cache is full of windows in use.
+ */
+struct mmap_window *find_mmap_window(int data_fd, off_t pos)
+{
+   struct mmap_window *w;
+   struct stat statbuf;
+   off_t index;
+   unsigned int i;
+
+   if (window_cache_size <= 0 || fstat(data_fd, &statbuf) == -1 ||
+       pos >= statbuf.st_size)
+      return NULL;
+
+   index = pos / MMAP_WINDOW_SIZE;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&window_lock);
+#endif
+   w = lookup_window(&statbuf, index);
+   if (w != NULL)
+      goto found;
+
+   w = calloc(1, sizeof(struct mmap_window));
+   if (w == NULL)
+      goto fail;
+
+   w->offset = index * MMAP_WINDOW_SIZE;
+   w->len = statbuf.st_size - w->offset;
+   if (w->len > MMAP_WINDOW_SIZE)
+      w->len = MMAP_WINDOW_SIZE;
+
+   if (!make_room(w->len)) {
+      free(w);
+      goto fail;
+   }
+
+   w->fd = lease_file(data_fd, &statbuf);
+   if (w->fd == -1) {
+      free(w);
+      goto fail;
+   }
+
+   w->mmap = mmap(0, w->len, PROT_READ, MAP_OPTIONS, w->fd, w->offset);
+   if (w->mmap == MAP_FAILED) {
+      close(w->fd);
+      free(w);
+      goto fail;
+   }
+
+   w->dev = statbuf.st_dev;
+   w->ino = statbuf.st_ino;
+   w->mtime = statbuf.st_mtime;
+   w->size = statbuf.st_size;
+   w->index = index;
+   w->cached = 1;
+
+   i = WINDOW_HASH(w->dev, w->ino, index);
+   w->next = window_cache[i];
+   window_cache[i] = w;
+   window_cache_bytes += w->len;
+
+ found:
+   w->use_count++;
+   w->last_used = current_time;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&window_lock);
+#endif
+   return w;
+
+ fail:
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&window_lock);
+#endif
+   return NULL;
+}
+
+void release_mmap_window(struct mmap_window *w)
+{
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&window_lock);
+#endif
+   w->use_count--;
+   if (w->use_count == 0 && !w->cached)
+      free_window(w);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&window_lock);
+#endif
+}
+
+/* Removes the windows whose lease is being broken, as
+ * check_mmap_leases() does for the file cache. The windows in use
+ * are unmapped when their last request leaves them (see
+ * io_shuffle_read()).
+ */
+void check_window_leases(void)
+{
+#ifdef F_GETLEASE
+   struct mmap_window **p, *w;
+   int i;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&window_lock);
+#endif
+   for (i = 0; i < WINDOW_CACHE_HASH_SIZE; i++) {
+      p = &window_cache[i];
+      while ((w = *p) != NULL) {
+	 if (fcntl(w->fd, F_GETLEASE) != F_RDLCK) {
+	    w->lease_broken = 1;
+	    remove_window(p);
+	    continue;
+	 }
+	 p = &w->next;
+      }
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&window_lock);
+#endif
+#endif
+}
+
+/* Removes all the windows. Called when the configuration is read
+ * again, since WindowCacheSize may have been decreased.
+ */
+void flush_mmap_windows(void)
+{
+   int i;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&window_lock);
+#endif
+   for (i = 0; i < WINDOW_CACHE_HASH_SIZE; i++)
+      while (window_cache[i] != NULL)
+	 remove_window(&window_cache[i]);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&window_lock);
+#endif
+}
@@ -0,0 +1,703 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the negative lookup cache. Scanners request
+ * thousands of files that do not exist; the (translated) pathnames
+ * that failed with ENOENT are remembered for NegativeCacheTTL seconds,
+ * so that the next requests for them get a 404 without an open().
+ *
+ * The directories of the missing files are kept in a table of their
+ * own, so that the files of a directory share one inotify watch (or
+ * modification time check, once a second, if it cannot be watched).
+ * An entry is dropped as soon as the nearest directory above it that
+ * exists changes. Directories that do not exist (ie. /wp-admin/) are
+ * kept too, so that the next files below them are cached without a
+ * stat() of each of their parents. A watch is removed with the last
+ * entry below it.
+ *
+ * The "document open" errors of the missing files are logged at most
+ * NOT_FOUND_LOG_RATE times a second.
+ */
+
+#include "boa.h"
+
+#if defined(HAVE_SYS_INOTIFY_H) && defined(ENABLE_SMP)
+# include <sys/inotify.h>
+# include <signal.h>
+# define USE_INOTIFY
+#endif
+
+int negative_cache_size = 4096;
+int negative_cache_ttl = 10;
+
+static struct negative_entry *negative_cache[NEGATIVE_CACHE_HASH_SIZE];
+static struct negative_entry **negative_ring = NULL;	/* oldest first */
+static int negative_ring_size = 0;
+static int negative_ring_pos = 0;
+
+static struct negative_dir *negative_dirs[NEGATIVE_CACHE_HASH_SIZE];
+static unsigned int negative_generation = 0;
+
+static time_t not_found_log_time = 0;
+static int not_found_logged = 0;
+static int not_found_suppressed = 0;
+
+#ifdef ENABLE_SMP
+static pthread_mutex_t negative_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#ifdef USE_INOTIFY
+static int inotify_fd = -1;
+#endif
+
+/* Unlinks d from the table of directories. It is freed with its
+ * last user.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void uncache_negative_dir(struct negative_dir *d)
+{
+   struct negative_dir **p;
+
+   if (!d->cached)
+      return;
+
+   for (p = &negative_dirs[d->hash % NEGATIVE_CACHE_HASH_SIZE];
+	*p != NULL; p = &(*p)->next) {
+      if (*p == d) {
+	 *p = d->next;
+	 break;
+      }
+   }
+   d->cached = 0;
+}
+
+/* Gives back a hold on d, and frees it with the last one.
+ * No locking here. The caller has to do the proper locking.
+ *
+ * Returns: the inotify watch to be removed (see remove_watch()),
+ * or -1.
+ */
+static int release_negative_dir(struct negative_dir *d)
+{
+   int wd;
+
+   if (--d->use_count > 0)
+      return -1;
+
+   uncache_negative_dir(d);
+   if (d->parent != NULL)
+      wd = release_negative_dir(d->parent);
+   else
+      wd = d->wd;
+   free(d->path);
+   free(d);
+
+   return wd;
+}
+
+/* No locking here. The caller has to do the proper locking.
+ *
+ * Returns: the inotify watch to be removed, or -1.
+ */
+static int free_negative_entry(struct negative_entry *e)
+{
+   struct negative_entry **p;
+   int wd;
+
+   for (p = &negative_cache[e->hash % NEGATIVE_CACHE_HASH_SIZE];
+	*p != NULL; p = &(*p)->next) {
+      if (*p == e) {
+	 *p = e->next;
+	 break;
+      }
+   }
+   wd = release_negative_dir(e->dir);
+   free(e->path);
+   free(e);
+
+   return wd;
+}
+
+/* Renews the generation of the directories watched by wd, or of all
+ * of them if wd is -1 (the inotify queue overflowed). The entries
+ * below them are no longer used. A directory that was removed (or
+ * moved) is dropped from the table.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void negative_dir_changed(int wd, int gone)
+{
+   struct negative_dir *d, *next;
+   int i;
+
+   for (i = 0; i < NEGATIVE_CACHE_HASH_SIZE; i++) {
+      for (d = negative_dirs[i]; d != NULL; d = next) {
+	 next = d->next;
+	 if (d->parent != NULL || (wd != -1 && d->wd != wd))
+	    continue;
+	 d->generation = ++negative_generation;
+	 if (gone)
+	    uncache_negative_dir(d);
+      }
+   }
+}
+
+#ifdef USE_INOTIFY
+
+static void *inotify_thread(void *arg)
+{
+   char buf[4096]
+       __attribute__ ((aligned(__alignof__(struct inotify_event))));
+   struct inotify_event *ev;
+   ssize_t len;
+   char *p;
+
+   while (1) {
+      len = read(inotify_fd, buf, sizeof(buf));
+      if (len <= 0) {
+	 if (len == -1 && errno == EINTR)
+	    continue;
+	 break;
+      }
+
+      pthread_mutex_lock(&negative_lock);
+      for (p = buf; p < buf + len;
+	   p += sizeof(struct inotify_event) + ev->len) {
+	 ev = (struct inotify_event *) p;
+	 negative_dir_changed(ev->wd, ev->mask & (IN_DELETE_SELF |
+						  IN_MOVE_SELF | IN_IGNORED));
+      }
+      pthread_mutex_unlock(&negative_lock);
+   }
+
+   log_error_time();
+   perror("inotify read");
+   return NULL;
+}
+
+/* Creates the inotify descriptor, and the thread that reads it,
+ * the first time a missing file is cached.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void init_inotify(void)
+{
+   static int tried = 0;
+   pthread_attr_t attr;
+   pthread_t tid;
+   sigset_t set, oldset;
+
+   if (tried)
+      return;
+   tried = 1;
+
+   inotify_fd = inotify_init();
+   if (inotify_fd == -1)
+      return;
+   set_cloexec_fd(inotify_fd);
+
+   /* the signals are handled by the server threads */
+   sigfillset(&set);
+   pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if (pthread_create(&tid, &attr, &inotify_thread, NULL) != 0) {
+      close(inotify_fd);
+      inotify_fd = -1;
+   }
+   pthread_attr_destroy(&attr);
+
+   pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+static int add_watch(const char *dir)
+{
+   if (inotify_fd == -1)
+      return -1;
+
+   return inotify_add_watch(inotify_fd, dir,
+			    IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF |
+			    IN_MOVE_SELF | IN_ONLYDIR);
+}
+
+static void remove_watch(int wd)
+{
+   if (wd != -1 && inotify_fd != -1)
+      inotify_rm_watch(inotify_fd, wd);
+}
+
+#else
+
+static void init_inotify(void)
+{
+}
+
+static int add_watch(const char *dir)
+{
+   return -1;
+}
+
+static void remove_watch(int wd)
+{
+}
+
+#endif				/* USE_INOTIFY */
+
+/* Looks up path in the cache.
+ * No locking here. The caller has to do the proper locking.
+ */
+static struct negative_entry *lookup_negative(const char *path,
+					      unsigned int hash)
+{
+   struct negative_entry *e;
+
+   for (e = negative_cache[hash % NEGATIVE_CACHE_HASH_SIZE]; e != NULL;
+	e = e->next) {
+      if (e->hash == hash && strcmp(e->path, path) == 0)
+	 return e;
+   }
+
+   return NULL;
+}
+
+/* Looks up the directory path, and holds it. A directory that did
+ * not exist is dropped if the one above it changed since, as it may
+ * exist now.
+ * No locking here. The caller has to do the proper locking.
+ */
+static struct negative_dir *find_negative_dir(const char *path,
+					      unsigned int hash)
+{
+   struct negative_dir *d;
+
+   for (d = negative_dirs[hash % NEGATIVE_CACHE_HASH_SIZE]; d != NULL;
+	d = d->next) {
+      if (d->hash != hash || strcmp(d->path, path) != 0)
+	 continue;
+
+      if (d->parent != NULL && (!d->parent->cached ||
+				d->generation != d->parent->generation)) {
+	 uncache_negative_dir(d);
+	 return NULL;
+      }
+      d->use_count++;
+      return d;
+   }
+
+   return NULL;
+}
+
+/* Returns the nearest directory above e that exists, after its
+ * modification time was checked (if it is not watched).
+ * No locking here. The caller has to do the proper locking.
+ */
+static struct negative_dir *negative_base_dir(struct negative_entry *e)
+{
+   struct negative_dir *d = e->dir->parent ? e->dir->parent : e->dir;
+   struct stat statbuf;
+
+   if (d->wd != -1 || d->checked == current_time || !d->cached)
+      return d;
+
+   if (stat(d->path, &statbuf) == -1) {
+      d->generation = ++negative_generation;
+      uncache_negative_dir(d);
+   } else if (statbuf.st_mtime != d->mtime) {
+      d->generation = ++negative_generation;
+      d->mtime = statbuf.st_mtime;
+   }
+   d->checked = current_time;
+
+   return d;
+}
+
+/* Returns 1 if the directory of e did not change since e was cached.
+ * No locking here. The caller has to do the proper locking.
+ */
+static int negative_entry_valid(struct negative_entry *e)
+{
+   struct negative_dir *d = negative_base_dir(e);
+
+   return d->cached && d->generation == e->generation;
+}
+
+/*
+ * Name: negative_lookup
+ * Description: Returns 1 if req->pathname recently did not exist,
+ * and its directory is unchanged since. The request should then
+ * get a 404, without trying to open the file.
+ */
+int negative_lookup(request * req)
+{
+   struct negative_entry *e;
+   unsigned int hash;
+   int ret = 0;
+
+   if (negative_cache_size <= 0)
+      return 0;
+
+   hash = get_hash_value(req->pathname);
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&negative_lock);
+#endif
+   e = lookup_negative(req->pathname, hash);
+   if (e != NULL) {
+      if (e->expires > current_time && negative_entry_valid(e))
+	 ret = 1;
+      else
+	 e->expires = 0;	/* the ring slot is reused eventually */
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&negative_lock);
+#endif
+
+   return ret;
+}
+
+static struct negative_dir *alloc_negative_dir(const char *path, int len)
+{
+   struct negative_dir *d;
+
+   d = calloc(1, sizeof(struct negative_dir));
+   if (d == NULL)
+      return NULL;
+   d->path = malloc(len + 1);
+   if (d->path == NULL) {
+      free(d);
+      return NULL;
+   }
+   memcpy(d->path, path, len);
+   d->path[len] = 0;
+   d->len = len;
+   d->hash = get_hash_value(d->path);
+   d->wd = -1;
+   d->use_count = 1;
+
+   return d;
+}
+
+/* Finds the nearest directory that exists above the missing file
+ * path, whose directory is path[0..len-1], and watches it. A missing
+ * directory of the file gets its own entry, that refers to it.
+ * Called without the lock; the directories are not in the table yet
+ * (see cache_negative_dir()).
+ *
+ * Returns: the directory of the file, held once, or NULL.
+ */
+static struct negative_dir *new_negative_dir(char *path, int len)
+{
+   struct negative_dir *d, *m;
+   struct stat statbuf;
+   char *slash = path + len;
+   int ret;
+
+   while (1) {
+      if (slash == path)
+	 return NULL;		/* files in / are not cached */
+      *slash = 0;
+      ret = stat(path, &statbuf);
+      *slash = '/';
+      if (ret == 0)
+	 break;
+      if (errno != ENOENT)
+	 return NULL;
+      slash--;
+      while (*slash != '/')
+	 slash--;
+   }
+
+   if (!S_ISDIR(statbuf.st_mode))
+      return NULL;
+
+   d = alloc_negative_dir(path, slash - path);
+   if (d == NULL)
+      return NULL;
+   d->mtime = statbuf.st_mtime;
+   d->checked = current_time;
+   d->wd = add_watch(d->path);
+
+   if (slash == path + len)
+      return d;
+
+   m = alloc_negative_dir(path, len);
+   if (m == NULL) {
+      remove_watch(release_negative_dir(d));
+      return NULL;
+   }
+   m->parent = d;
+
+   return m;
+}
+
+/* Adds d, made by new_negative_dir(), to the table of directories.
+ * If another thread added the same directory meanwhile, that one is
+ * used instead; it has the same watch.
+ * No locking here. The caller has to do the proper locking.
+ *
+ * Returns: the directory, held once.
+ */
+static struct negative_dir *cache_negative_dir(struct negative_dir *d)
+{
+   struct negative_dir *old;
+   int i;
+
+   if (d->parent != NULL)
+      d->parent = cache_negative_dir(d->parent);
+
+   old = find_negative_dir(d->path, d->hash);
+   if (old != NULL && old->parent != NULL && d->parent == NULL) {
+      /* it was created meanwhile */
+      uncache_negative_dir(old);
+      remove_watch(release_negative_dir(old));
+   } else if (old != NULL) {
+      if (d->parent == NULL) {
+	 /* the same directory has the same watch */
+	 if (old->wd == -1)
+	    old->wd = d->wd;
+	 d->wd = -1;
+      }
+      release_negative_dir(d);	/* its parent is held by old */
+      return old;
+   }
+
+   if (d->parent != NULL)
+      d->generation = d->parent->generation;
+   else
+      d->generation = ++negative_generation;
+
+   i = d->hash % NEGATIVE_CACHE_HASH_SIZE;
+   d->next = negative_dirs[i];
+   negative_dirs[i] = d;
+   d->cached = 1;
+
+   return d;
+}
+
+/*
+ * Name: negative_insert
+ * Description: Remembers that req->pathname does not exist. Called
+ * when its open() failed with ENOENT.
+ */
+void negative_insert(request * req)
+{
+   struct negative_entry *e, *old;
+   struct negative_dir *dir, *base;
+   unsigned int hash, generation;
+   char *slash;
+   int i, wd = -1, old_wd = -1;
+
+   if (negative_cache_size <= 0 || req->pathname[0] != '/')
+      return;
+
+   e = calloc(1, sizeof(struct negative_entry));
+   if (e == NULL)
+      return;
+   e->path = strdup(req->pathname);
+   if (e->path == NULL) {
+      free(e);
+      return;
+   }
+   hash = get_hash_value(e->path);
+   e->hash = hash;
+
+   slash = strrchr(e->path, '/');
+   if (slash == e->path)
+      goto fail;		/* files in / are not cached */
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&negative_lock);
+#endif
+   init_inotify();
+
+   old = lookup_negative(e->path, hash);
+   if (old != NULL && old->expires > current_time &&
+       negative_entry_valid(old)) {
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&negative_lock);
+#endif
+      goto fail;		/* cached by another request */
+   }
+
+   *slash = 0;
+   dir = find_negative_dir(e->path, get_hash_value(e->path));
+   *slash = '/';
+   if (dir != NULL) {
+      base = dir->parent ? dir->parent : dir;
+      generation = base->generation;
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&negative_lock);
+#endif
+
+   if (dir == NULL) {
+      /* a directory that was not seen yet */
+      dir = new_negative_dir(e->path, slash - e->path);
+      if (dir == NULL)
+	 goto fail;
+#ifdef ENABLE_SMP
+      pthread_mutex_lock(&negative_lock);
+#endif
+      dir = cache_negative_dir(dir);
+      base = dir->parent ? dir->parent : dir;
+      generation = base->generation;
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&negative_lock);
+#endif
+   }
+   e->dir = dir;
+
+   /* The file may have been created after its open() failed, and
+    * before the directory was watched (or the generation was read).
+    */
+   if (access(e->path, F_OK) == 0)
+      goto release;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&negative_lock);
+#endif
+   if (!base->cached || base->generation != generation) {
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&negative_lock);
+#endif
+      goto release;
+   }
+   e->generation = generation;
+   e->expires = current_time + negative_cache_ttl;
+
+   old = lookup_negative(e->path, hash);
+   if (old != NULL) {
+      /* it had expired; renew it */
+      wd = release_negative_dir(old->dir);
+      old->dir = e->dir;
+      old->generation = e->generation;
+      old->expires = e->expires;
+#ifdef ENABLE_SMP
+      pthread_mutex_unlock(&negative_lock);
+#endif
+      remove_watch(wd);
+      goto fail;
+   }
+
+   if (negative_ring_size != negative_cache_size) {
+      /* first use, or NegativeCacheSize was changed */
+      for (i = 0; i < negative_ring_size; i++)
+	 if (negative_ring[i] != NULL)
+	    remove_watch(free_negative_entry(negative_ring[i]));
+      free(negative_ring);
+      negative_ring_pos = 0;
+      negative_ring = calloc(negative_cache_size,
+			     sizeof(struct negative_entry *));
+      negative_ring_size = (negative_ring == NULL) ? 0 : negative_cache_size;
+      if (negative_ring == NULL) {
+#ifdef ENABLE_SMP
+	 pthread_mutex_unlock(&negative_lock);
+#endif
+	 goto release;
+      }
+   }
+
+   if (negative_ring[negative_ring_pos] != NULL)
+      old_wd = free_negative_entry(negative_ring[negative_ring_pos]);
+   negative_ring[negative_ring_pos] = e;
+   negative_ring_pos = (negative_ring_pos + 1) % negative_ring_size;
+
+   i = hash % NEGATIVE_CACHE_HASH_SIZE;
+   e->next = negative_cache[i];
+   negative_cache[i] = e;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&negative_lock);
+#endif
+   remove_watch(old_wd);
+   return;
+
+ release:
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&negative_lock);
+#endif
+   wd = release_negative_dir(e->dir);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&negative_lock);
+#endif
+   remove_watch(wd);
+ fail:				/* or done with e */
+   free(e->path);
+   free(e);
+}
+
+/*
+ * Name: log_not_found
+ * Description: Logs that req->pathname does not exist, unless
+ * NOT_FOUND_LOG_RATE of these were already logged this second.
+ * The number of the messages that were left out is logged instead.
+ */
+void log_not_found(request * req)
+{
+   int suppressed = 0, log_it = 0;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&negative_lock);
+#endif
+   if (not_found_log_time != current_time) {
+      suppressed = not_found_suppressed;
+      not_found_suppressed = 0;
+      not_found_logged = 0;
+      not_found_log_time = current_time;
+   }
+   if (not_found_logged < NOT_FOUND_LOG_RATE) {
+      not_found_logged++;
+      log_it = 1;
+   } else
+      not_found_suppressed++;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&negative_lock);
+#endif
+
+   if (suppressed > 0) {
+      log_error_time();
+      fprintf(stderr, "%d more missing documents were not logged\n",
+	      suppressed);
+   }
+
+   if (log_it) {
+      log_error_doc(req);
+      errno = ENOENT;
+      perror("document open");
+   }
+}
+
+/* Removes all the entries. Called when the configuration is read
+ * again, since the document roots may have changed.
+ */
+void flush_negative_cache(void)
+{
+   int i;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&negative_lock);
+#endif
+   for (i = 0; i < negative_ring_size; i++) {
+      if (negative_ring[i] != NULL) {
+	 remove_watch(free_negative_entry(negative_ring[i]));
+	 negative_ring[i] = NULL;
+      }
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&negative_lock);
+#endif
+}
@@ -0,0 +1,330 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the pack files. If the document root of a
+ * virtual host is a regular file, it is a pack written by boa_packer
+ * (see pack.h): the files of a site, and their index. The pack is
+ * mapped once, when the configuration is read, and the files are
+ * looked up in the index and sent from the mapping, without any
+ * system call per request.
+ *
+ * A new pack replaces the old one with rename() (boa_packer does
+ * that), thus the mapped file is never modified. After a SIGHUP the
+ * new pack is mapped; the old one is unmapped when the last request
+ * that uses it is done.
+ *
+ * A pack that is written in place would fault the requests that read
+ * it, thus a read lease is taken on the pack (see lease_file()). When
+ * the lease is broken, the pack is marked broken, and its documents
+ * are not served until the configuration is read again.
+ */
+
+#define _GNU_SOURCE		/* F_GETLEASE */
+
+#include "boa.h"
+
+#ifdef ENABLE_SMP
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The precompressed variants, in order of preference (as in
+ * encoding.c).
+ */
+static const struct {
+   int encoding;
+   int variant;
+} pack_encodings[] = {
+   { ENCODING_BR, PACK_BR },
+   { ENCODING_GZIP, PACK_GZIP },
+};
+
+#define PACK_ENCODINGS_SIZE (sizeof(pack_encodings)/sizeof(pack_encodings[0]))
+
+/* Returns 1 if a NUL terminated string starts at offset off. */
+static int valid_string(struct pack_file *p, uint64_t off)
+{
+   return off >= sizeof(struct pack_header) && off < p->len &&
+       memchr(p->map + off, 0, p->len - off) != NULL;
+}
+
+/* Checks the index of the pack, so that the requests may trust it.
+ *
+ * Returns: NULL if the pack is fine, or a description of the problem.
+ */
+static const char *check_pack(struct pack_file *p)
+{
+   const struct pack_header *h = (const struct pack_header *) p->map;
+   const struct pack_record *r;
+   unsigned int i, v;
+
+   if (p->len < sizeof(struct pack_header) ||
+       memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) != 0)
+      return "not a pack file";
+   if (h->byte_order != PACK_BYTE_ORDER)
+      return "packed on a host with another byte order";
+   if (h->size != p->len)
+      return "truncated";
+   if (h->entries > (p->len - sizeof(struct pack_header)) /
+       sizeof(struct pack_record))
+      return "too many records";
+
+   p->records = (const struct pack_record *) (h + 1);
+   p->entries = h->entries;
+
+   for (i = 0; i < p->entries; i++) {
+      r = &p->records[i];
+
+      if (!valid_string(p, r->path) || p->map[r->path] != '/')
+	 return "invalid path";
+      if (i > 0 &&
+	  strcmp(p->map + p->records[i - 1].path, p->map + r->path) >= 0)
+	 return "records not sorted";
+      if (r->mime != 0 && !valid_string(p, r->mime))
+	 return "invalid mime type";
+      if (r->flags & PACK_DIRECTORY)
+	 continue;
+
+      if (r->offset[PACK_IDENTITY] == 0)
+	 return "file without data";
+      for (v = 0; v < PACK_VARIANTS; v++) {
+	 if (r->offset[v] == 0)
+	    continue;
+	 if (r->len[v] > p->len || r->offset[v] > p->len - r->len[v])
+	    return "data out of the pack";
+      }
+   }
+
+   return NULL;
+}
+
+/*
+ * Name: open_pack
+ * Description: Maps the pack file pathname, and checks its index.
+ *
+ * Returns: the pack, held once, or NULL on error (which is logged).
+ */
+struct pack_file *open_pack(const char *pathname)
+{
+   struct pack_file *p;
+   struct stat statbuf;
+   const char *error;
+   int fd;
+
+   fd = open(pathname, O_RDONLY);
+   if (fd == -1) {
+      log_error_time();
+      perror(pathname);
+      return NULL;
+   }
+
+   if (fstat(fd, &statbuf) == -1 || statbuf.st_size == 0) {
+      close(fd);
+      log_error_time();
+      fprintf(stderr, "%s: empty pack file\n", pathname);
+      return NULL;
+   }
+
+   p = calloc(1, sizeof(struct pack_file));
+   if (p == NULL) {
+      close(fd);
+      return NULL;
+   }
+
+   p->len = statbuf.st_size;
+   p->map = mmap(0, p->len, PROT_READ, MAP_OPTIONS, fd, 0);
+   if (p->map == MAP_FAILED) {
+      close(fd);
+      log_error_time();
+      perror("mmap pack");
+      free(p);
+      return NULL;
+   }
+
+   /* without it, only rename() may replace the pack */
+   p->fd = lease_file(fd, &statbuf);
+   close(fd);
+
+   error = check_pack(p);
+   if (error != NULL) {
+      log_error_time();
+      fprintf(stderr, "%s: %s\n", pathname, error);
+      if (p->fd != -1)
+	 close(p->fd);
+      munmap(p->map, p->len);
+      free(p);
+      return NULL;
+   }
+
+   p->use_count = 1;
+   return p;
+}
+
+struct pack_file *hold_pack(struct pack_file *p)
+{
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&pack_lock);
+#endif
+   p->use_count++;
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&pack_lock);
+#endif
+   return p;
+}
+
+void release_pack(struct pack_file *p)
+{
+   int unused;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&pack_lock);
+#endif
+   unused = (--p->use_count == 0);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&pack_lock);
+#endif
+
+   if (unused) {
+      munmap(p->map, p->len);
+      if (p->fd != -1)
+	 close(p->fd);		/* releases the lease */
+      free(p);
+   }
+}
+
+/*
+ * Name: own_pack_lease
+ * Description: The packs of the configuration are opened before the
+ * server goes to the background, thus the breaks of their leases
+ * would be reported to the parent. Called after the fork.
+ */
+void own_pack_lease(struct pack_file *p)
+{
+   if (p->fd != -1)
+      fcntl(p->fd, F_SETOWN, getpid());
+}
+
+/*
+ * Name: check_pack_lease
+ * Description: Called by the main thread after a SIGIO (see
+ * check_pack_leases()). If the lease on the pack is being
+ * broken, the pack is marked broken, so that the new requests do
+ * not read it. The lease is held until the pack is released, or the
+ * kernel gives up waiting (see /proc/sys/fs/lease-break-time).
+ */
+void check_pack_lease(struct pack_file *p, const char *pathname)
+{
+#ifdef F_GETLEASE
+   if (p->fd == -1 || p->broken)
+      return;
+
+   /* during a break, this is the type of lease we should
+    * downgrade to, ie. F_UNLCK.
+    */
+   if (fcntl(p->fd, F_GETLEASE) == F_RDLCK)
+      return;
+
+   p->broken = 1;
+   log_error_time();
+   fprintf(stderr, "The pack file %s is being written; its documents are "
+	   "not served until the configuration is read again. Replace "
+	   "packs with rename().\n", pathname);
+#endif
+}
+
+/*
+ * Name: find_pack_record
+ * Description: Looks up path (ie. "/dir/file") in the index of p.
+ */
+const struct pack_record *find_pack_record(struct pack_file *p,
+					   const char *path)
+{
+   unsigned int low = 0, high = p->entries, i;
+   int cmp;
+
+   while (low < high) {
+      i = low + (high - low) / 2;
+      cmp = strcmp(path, p->map + p->records[i].path);
+      if (cmp == 0)
+	 return &p->records[i];
+      if (cmp < 0)
+	 high = i;
+      else
+	 low = i + 1;
+   }
+
+   return NULL;
+}
+
+/*
+ * Name: find_pack_index
+ * Description: Looks up the first directory index file (see
+ * index.c) that is packed in dir, which ends in '/'.
+ */
+const struct pack_record *find_pack_index(struct pack_file *p,
+					  const char *dir)
+{
+   char pathname[MAX_PATH_LENGTH + 1];
+   const struct pack_record *r;
+   const char *index;
+   int len, n;
+
+   len = strlen(dir);
+   for (n = 0; (index = get_directory_index(n)) != NULL; n++) {
+      if (len + strlen(index) > MAX_PATH_LENGTH)
+	 continue;
+      memcpy(pathname, dir, len);
+      strcpy(pathname + len, index);
+
+      r = find_pack_record(p, pathname);
+      if (r != NULL && !(r->flags & PACK_DIRECTORY))
+	 return r;
+   }
+
+   return NULL;
+}
+
+/*
+ * Name: choose_pack_variant
+ * Description: Chooses the precompressed variant of r that the
+ * client accepts, as open_precompressed() does. req->encoding and
+ * req->vary_encoding are set accordingly.
+ *
+ * Returns: the PACK_* variant.
+ */
+int choose_pack_variant(request * req, const struct pack_record *r)
+{
+   int variant = PACK_IDENTITY;
+   unsigned int i;
+
+   for (i = 0; i < PACK_ENCODINGS_SIZE; i++) {
+      if (r->offset[pack_encodings[i].variant] == 0)
+	 continue;
+
+      /* the response depends on Accept-Encoding */
+      req->vary_encoding = 1;
+
+      if (variant == PACK_IDENTITY &&
+	  (req->accept_encoding & pack_encodings[i].encoding)) {
+	 variant = pack_encodings[i].variant;
+	 req->encoding = pack_encodings[i].encoding;
+      }
+   }
+
+   return variant;
+}
@@ -0,0 +1,64 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* The format of the pack files, that are written by boa_packer and
+ * may be used as the document root of a virtual host (see pack.c).
+ *
+ * A pack starts with a pack_header, followed by an array of
+ * pack_records sorted by path (as strcmp() does). The paths, the
+ * mime types and the data of the files follow, anywhere after the
+ * records. All the offsets are from the beginning of the pack, and
+ * numbers are in the byte order of the host that wrote the pack.
+ */
+
+#ifndef _PACK_H
+#define _PACK_H
+
+#include <stdint.h>
+
+#define PACK_MAGIC "HYDRAPK1"
+#define PACK_BYTE_ORDER 0x01020304
+
+/* The variants of a file. */
+#define PACK_IDENTITY 0
+#define PACK_GZIP 1			/* foo.gz, if it was packed */
+#define PACK_BR 2			/* foo.br, if it was packed */
+#define PACK_VARIANTS 3
+
+/* pack_record flags */
+#define PACK_DIRECTORY 1		/* no data; redirected to path/ */
+
+struct pack_header {
+    char magic[8];			/* PACK_MAGIC */
+    uint32_t byte_order;		/* PACK_BYTE_ORDER */
+    uint32_t entries;			/* number of records */
+    uint64_t size;			/* of the whole pack */
+};
+
+struct pack_record {
+    uint64_t path;			/* "/dir/file", NUL terminated */
+    uint64_t mime;			/* mime type, NUL terminated, or 0 */
+    int64_t mtime;
+    uint32_t flags;
+    uint32_t unused;
+    uint64_t offset[PACK_VARIANTS];	/* 0 if there is no such variant */
+    uint64_t len[PACK_VARIANTS];
+};
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* boa_packer: packs a directory tree into a pack file (see pack.h),
+ * that may be used as the document root of a virtual host.
+ *
+ *   boa_packer [-m mime.types] directory pack
+ *
+ * Files whose name starts with '.' are left out. For foo, the files
+ * foo.gz and foo.br are also packed as its precompressed variants.
+ * With -m, the mime type of each file is looked up in the given
+ * mime.types file, and recorded in the pack.
+ *
+ * The pack is written to a temporary file, that is renamed to pack
+ * when complete. Send a SIGHUP to the server to use the new pack.
+ */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>		/* for PATH_MAX */
+#include <string.h>
+#include <strings.h>		/* strcasecmp */
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "compat.h"
+#include "pack.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 2048
+#endif
+
+struct pack_file_entry {
+   char *path;			/* as requested: "/dir/file" */
+   char *filename;		/* in the file system */
+   struct stat statbuf;
+   const char *mime;		/* the type, if any */
+   struct pack_record record;
+};
+
+struct mime_entry {
+   char *extension;
+   char *type;
+   uint64_t offset;		/* of the type in the pack */
+   int written;
+};
+
+static struct pack_file_entry *entries = NULL;
+static size_t n_entries = 0, entries_size = 0;
+
+static struct mime_entry *mimes = NULL;
+static size_t n_mimes = 0, mimes_size = 0;
+
+static char tmpname[PATH_MAX + 8];	/* removed at exit, if not empty */
+
+static void remove_tmpname(void)
+{
+   if (tmpname[0] != 0)
+      unlink(tmpname);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+   p = realloc(p, size);
+   if (p == NULL) {
+      fputs("boa_packer: out of memory\n", stderr);
+      exit(1);
+   }
+   return p;
+}
+
+static char *xstrdup(const char *s)
+{
+   return strcpy(xrealloc(NULL, strlen(s) + 1), s);
+}
+
+/* Reads a mime.types file: a type, followed by its extensions,
+ * per line.
+ */
+static void read_mime_types(const char *filename)
+{
+   char line[1024], *type, *ext;
+   FILE *fp;
+
+   fp = fopen(filename, "r");
+   if (fp == NULL) {
+      perror(filename);
+      exit(1);
+   }
+
+   while (fgets(line, sizeof(line), fp) != NULL) {
+      if (line[0] == '#')
+	 continue;
+      type = strtok(line, " \t\r\n");
+      if (type == NULL)
+	 continue;
+      while ((ext = strtok(NULL, " \t\r\n")) != NULL) {
+	 if (n_mimes == mimes_size) {
+	    mimes_size = mimes_size * 2 + 64;
+	    mimes = xrealloc(mimes, mimes_size * sizeof(struct mime_entry));
+	 }
+	 mimes[n_mimes].extension = xstrdup(ext);
+	 mimes[n_mimes].type = xstrdup(type);
+	 mimes[n_mimes].offset = 0;
+	 mimes[n_mimes].written = 0;
+	 n_mimes++;
+      }
+   }
+
+   fclose(fp);
+}
+
+static struct mime_entry *find_mime(const char *path)
+{
+   const char *ext;
+   size_t i;
+
+   ext = strrchr(path, '.');
+   if (ext == NULL || strchr(ext, '/') != NULL)
+      return NULL;
+   ext++;
+
+   for (i = 0; i < n_mimes; i++)
+      if (strcasecmp(mimes[i].extension, ext) == 0)
+	 return &mimes[i];
+
+   return NULL;
+}
+
+static void add_entry(const char *path, const char *filename,
+		      struct stat *statbuf)
+{
+   struct pack_file_entry *e;
+
+   if (n_entries == entries_size) {
+      entries_size = entries_size * 2 + 256;
+      entries = xrealloc(entries,
+			 entries_size * sizeof(struct pack_file_entry));
+   }
+
+   e = &entries[n_entries++];
+   memset(e, 0, sizeof(struct pack_file_entry));
+   e->path = xstrdup(path);
+   e->filename = xstrdup(filename);
+   e->statbuf = *statbuf;
+}
+
+/* Adds the files below the directory filename, requested as path. */
+static void walk_directory(const char *path, const char *filename)
+{
+   char sub_path[PATH_MAX + 1], sub_filename[PATH_MAX + 1];
+   struct stat statbuf;
+   struct dirent *d;
+   DIR *dir;
+
+   dir = opendir(filename);
+   if (dir == NULL) {
+      perror(filename);
+      exit(1);
+   }
+
+   while ((d = readdir(dir)) != NULL) {
+      if (d->d_name[0] == '.')
+	 continue;
+
+      if (snprintf(sub_path, sizeof(sub_path), "%s/%s", path,
+		   d->d_name) >= (int) sizeof(sub_path) ||
+	  snprintf(sub_filename, sizeof(sub_filename), "%s/%s", filename,
+		   d->d_name) >= (int) sizeof(sub_filename)) {
+	 fprintf(stderr, "%s/%s: name too long\n", filename, d->d_name);
+	 exit(1);
+      }
+
+      if (stat(sub_filename, &statbuf) == -1) {
+	 perror(sub_filename);
+	 exit(1);
+      }
+
+      if (S_ISDIR(statbuf.st_mode)) {
+	 add_entry(sub_path, sub_filename, &statbuf);
+	 walk_directory(sub_path, sub_filename);
+      } else if (S_ISREG(statbuf.st_mode))
+	 add_entry(sub_path, sub_filename, &statbuf);
+   }
+
+   closedir(dir);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+   return strcmp(((const struct pack_file_entry *) a)->path,
+		 ((const struct pack_file_entry *) b)->path);
+}
+
+static struct pack_file_entry *find_entry(const char *path)
+{
+   struct pack_file_entry key;
+
+   key.path = (char *) path;
+   return bsearch(&key, entries, n_entries, sizeof(struct pack_file_entry),
+		  compare_entries);
+}
+
+/* Sets the offsets of the records. The data of the files follow the
+ * strings, in the order of the records.
+ *
+ * Returns: the size of the pack.
+ */
+static uint64_t layout_pack(void)
+{
+   static const struct {
+      const char *suffix;
+      int variant;
+   } suffixes[] = {
+      { ".gz", PACK_GZIP },
+      { ".br", PACK_BR },
+   };
+   char path[PATH_MAX + 4];
+   struct pack_file_entry *e, *v;
+   struct mime_entry *m;
+   uint64_t pos;
+   size_t i, j;
+
+   pos = sizeof(struct pack_header) +
+       n_entries * sizeof(struct pack_record);
+
+   for (i = 0; i < n_entries; i++) {
+      entries[i].record.path = pos;
+      pos += strlen(entries[i].path) + 1;
+   }
+
+   for (i = 0; i < n_entries; i++) {
+      e = &entries[i];
+      if (S_ISDIR(e->statbuf.st_mode) || (m = find_mime(e->path)) == NULL)
+	 continue;
+      if (m->offset == 0) {
+	 m->offset = pos;
+	 pos += strlen(m->type) + 1;
+      }
+      e->mime = m->type;
+      e->record.mime = m->offset;
+   }
+
+   for (i = 0; i < n_entries; i++) {
+      e = &entries[i];
+      e->record.mtime = e->statbuf.st_mtime;
+      if (S_ISDIR(e->statbuf.st_mode)) {
+	 e->record.flags = PACK_DIRECTORY;
+	 continue;
+      }
+      e->record.offset[PACK_IDENTITY] = pos;
+      e->record.len[PACK_IDENTITY] = e->statbuf.st_size;
+      pos += e->statbuf.st_size;
+   }
+
+   /* the precompressed variants are packed as files too */
+   for (i = 0; i < n_entries; i++) {
+      e = &entries[i];
+      if (S_ISDIR(e->statbuf.st_mode))
+	 continue;
+      for (j = 0; j < sizeof(suffixes) / sizeof(suffixes[0]); j++) {
+	 snprintf(path, sizeof(path), "%s%s", e->path, suffixes[j].suffix);
+	 v = find_entry(path);
+	 if (v == NULL || S_ISDIR(v->statbuf.st_mode))
+	    continue;
+	 e->record.offset[suffixes[j].variant] =
+	     v->record.offset[PACK_IDENTITY];
+	 e->record.len[suffixes[j].variant] =
+	     v->record.len[PACK_IDENTITY];
+      }
+   }
+
+   return pos;
+}
+
+static void write_or_die(FILE * fp, const void *data, size_t len,
+			 const char *filename)
+{
+   if (len > 0 && fwrite(data, len, 1, fp) != 1) {
+      perror(filename);
+      exit(1);
+   }
+}
+
+static void copy_file(FILE * fp, struct pack_file_entry *e,
+		      const char *filename)
+{
+   char buf[64 * 1024];
+   off_t left = e->statbuf.st_size;
+   ssize_t n;
+   int fd;
+
+   fd = open(e->filename, O_RDONLY);
+   if (fd == -1) {
+      perror(e->filename);
+      exit(1);
+   }
+
+   while (left > 0) {
+      n = read(fd, buf, left < (off_t) sizeof(buf) ? left : sizeof(buf));
+      if (n == -1 && errno == EINTR)
+	 continue;
+      if (n <= 0) {
+	 fprintf(stderr, "%s: changed while it was packed\n", e->filename);
+	 exit(1);
+      }
+      write_or_die(fp, buf, n, filename);
+      left -= n;
+   }
+
+   close(fd);
+}
+
+static void write_pack(FILE * fp, uint64_t size, const char *filename)
+{
+   struct pack_header header;
+   size_t i;
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+   header.byte_order = PACK_BYTE_ORDER;
+   header.entries = n_entries;
+   header.size = size;
+   write_or_die(fp, &header, sizeof(header), filename);
+
+   for (i = 0; i < n_entries; i++)
+      write_or_die(fp, &entries[i].record, sizeof(struct pack_record),
+		   filename);
+
+   for (i = 0; i < n_entries; i++)
+      write_or_die(fp, entries[i].path, strlen(entries[i].path) + 1,
+		   filename);
+
+   /* in the order of layout_pack() */
+   for (i = 0; i < n_entries; i++) {
+      struct mime_entry *m;
+
+      if (entries[i].mime == NULL)
+	 continue;
+      m = find_mime(entries[i].path);
+      if (!m->written) {
+	 write_or_die(fp, m->type, strlen(m->type) + 1, filename);
+	 m->written = 1;
+      }
+   }
+
+   for (i = 0; i < n_entries; i++)
+      if (!S_ISDIR(entries[i].statbuf.st_mode))
+	 copy_file(fp, &entries[i], filename);
+}
+
+static void usage(void)
+{
+   fputs("usage: boa_packer [-m mime.types] directory pack\n", stderr);
+   exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+   const char *directory, *pack;
+   uint64_t size;
+   FILE *fp;
+   int c, fd;
+
+   while ((c = getopt(argc, argv, "m:")) != -1) {
+      switch (c) {
+      case 'm':
+	 read_mime_types(optarg);
+	 break;
+      default:
+	 usage();
+      }
+   }
+
+   if (argc - optind != 2)
+      usage();
+   directory = argv[optind];
+   pack = argv[optind + 1];
+
+   walk_directory("", directory);
+   qsort(entries, n_entries, sizeof(struct pack_file_entry),
+	 compare_entries);
+   size = layout_pack();
+
+   /* The pack replaces the old one with rename(), so that the
+    * server (which maps the old one) never sees a partial pack.
+    */
+   if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", pack) >=
+       (int) sizeof(tmpname)) {
+      fprintf(stderr, "%s: name too long\n", pack);
+      return 1;
+   }
+   fd = mkstemp(tmpname);
+   if (fd == -1) {
+      perror(tmpname);
+      return 1;
+   }
+   atexit(remove_tmpname);
+
+   if (fchmod(fd, 0644) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+      perror(tmpname);
+      return 1;
+   }
+
+   write_pack(fp, size, tmpname);
+
+   if (fflush(fp) != 0 || fsync(fd) == -1 || fclose(fp) != 0) {
+      perror(tmpname);
+      return 1;
+   }
+
+   if (rename(tmpname, pack) == -1) {
+      perror(pack);
+      return 1;
+   }
+   tmpname[0] = 0;
+
+   printf("%s: %lu files and directories, %llu bytes\n", pack,
+	  (unsigned long int) n_entries, (unsigned long long int) size);
+   return 0;
+}
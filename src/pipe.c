@@ -24,6 +24,7 @@
 
 #include "boa.h"
 #include "socket.h"
+#include <sys/ioctl.h>
 
 /*
  * Name: read_from_pipe
@@ -39,27 +40,7 @@ int read_from_pipe(request * req)
 {
     int bytes_read, bytes_to_read;
 
-    if (req->is_cgi) 
-       bytes_to_read = BUFFER_SIZE - (req->header_end - req->buffer);
-    else {
-         /* if not a cgi, then read up to range_stop value. The init_get() should have
-          * used lseek() for the range_start.
-          */
-       bytes_to_read = BUFFER_SIZE - (req->header_end - req->buffer);
-       
-       if (req->pipe_range_stop >= bytes_to_read)
-          req->pipe_range_stop -= bytes_to_read;
-       else {
-          bytes_to_read = req->pipe_range_stop;
-          
-          if (bytes_to_read == 0) { /* no need to move below */
-                  req->status = PIPE_WRITE;
-                  req->cgi_status = CGI_DONE;
-                  return 1;
-          }
-          req->pipe_range_stop = 0;
-       }
-    }
+    bytes_to_read = BUFFER_SIZE - (req->header_end - req->buffer);
 
     if (bytes_to_read == 0) {   /* buffer full */
         if (req->cgi_status == CGI_PARSE) { /* got+parsed header */
@@ -117,6 +98,56 @@ int read_from_pipe(request * req)
     return 1;
 }
 
+/*
+ * Name: write_filtered_pipe
+ * Description: Like write_from_pipe() but the data are passed
+ * through req->pipe_filter (chunked encoding and/or compression)
+ * before they are sent.
+ */
+static int write_filtered_pipe(request * req)
+{
+    struct pipe_filter *f = req->pipe_filter;
+    int bytes_written, bytes_to_write;
+
+    if (f->out_start == f->out_end) {
+        if (filter_pipe_data(req) == -1) {
+            req->status = DEAD;
+            return 0;
+        }
+
+        if (f->out_start == f->out_end) {
+            /* all the data read were consumed */
+            if (f->finished)
+                return 0;
+
+            req->status = PIPE_READ;
+            req->header_end = req->header_line = req->buffer;
+            return 1;
+        }
+    }
+
+    bytes_to_write = f->out_end - f->out_start;
+    bytes_written = socket_send(req, f->out_start, bytes_to_write);
+
+    if (bytes_written < 0) {
+        if (bytes_written == BOA_E_AGAIN)
+            return -1;
+        else if (bytes_written == BOA_E_INTR)
+            return 1;
+        else {
+            req->status = DEAD;
+            log_error_doc(req);
+            perror("pipe write");
+            return 0;
+        }
+    }
+
+    f->out_start += bytes_written;
+    req->filepos += bytes_written;
+
+    return 1;
+}
+
 /*
  * Name: write_from_pipe
  * Description: Writes data previously read from a pipe
@@ -129,8 +160,12 @@ int read_from_pipe(request * req)
 
 int write_from_pipe(request * req)
 {
-    int bytes_written, bytes_to_write = req->header_end - req->header_line;
+    int bytes_written, bytes_to_write;
+
+    if (req->pipe_filter)
+        return write_filtered_pipe(req);
 
+    bytes_to_write = req->header_end - req->header_line;
     if (bytes_to_write == 0) {
         if (req->cgi_status == CGI_DONE)
             return 0;
@@ -168,15 +203,158 @@ int write_from_pipe(request * req)
     return 1;
 }
 
+/*
+ * Name: init_io_shuffle
+ * Description: Prepares the sending of a large file (data_fd) by
+ * io_shuffle(). The kernel is told that the file is read
+ * sequentially, and the first window is read ahead.
+ */
+void init_io_shuffle(request * req)
+{
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(req->data_fd, req->filepos,
+                  req->pipe_range_stop - req->filepos,
+                  POSIX_FADV_SEQUENTIAL);
+#endif
+    req->readahead_pos = req->dropbehind_pos = req->filepos;
+    req->io_buffer_start = req->io_buffer_end = 0;
+    io_shuffle_hints(req);
+}
+
+/*
+ * Name: io_shuffle_hints
+ * Description: Called as req->filepos advances. Reads ahead the
+ * next window of the file, when half of the previous one has
+ * been sent. For files larger than drop_behind_size, the pages
+ * that were sent are dropped from the page cache, so that one-shot
+ * downloads do not push out the small files that are hot.
+ */
+void io_shuffle_hints(request * req)
+{
+    off_t end;
+
+    if (req->readahead_pos < req->filepos)
+        req->readahead_pos = req->filepos; /* ie. the next range */
+
+    if (req->readahead_pos < req->pipe_range_stop &&
+        req->readahead_pos - req->filepos < READAHEAD_WINDOW / 2) {
+        end = req->readahead_pos + READAHEAD_WINDOW;
+        if (end > req->pipe_range_stop)
+            end = req->pipe_range_stop;
+#ifdef HAVE_POSIX_FADVISE
+        posix_fadvise(req->data_fd, req->readahead_pos,
+                      end - req->readahead_pos, POSIX_FADV_WILLNEED);
+#elif defined(HAVE_READAHEAD)
+        readahead(req->data_fd, req->readahead_pos,
+                  end - req->readahead_pos);
+#endif
+        req->readahead_pos = end;
+    }
+
+#ifdef HAVE_POSIX_FADVISE
+    /* The last window is kept, since its pages may still be
+     * queued in the socket.
+     */
+    if (drop_behind_size > 0 && req->filesize >= drop_behind_size &&
+        req->filepos - req->dropbehind_pos >= 2 * DROP_BEHIND_WINDOW) {
+        end = req->filepos - DROP_BEHIND_WINDOW;
+        posix_fadvise(req->data_fd, req->dropbehind_pos,
+                      end - req->dropbehind_pos, POSIX_FADV_DONTNEED);
+        req->dropbehind_pos = end;
+    }
+#endif
+}
+
 #ifdef HAVE_SENDFILE
-int io_shuffle(request *req)
+
+#ifndef MSG_MORE
+# define MSG_MORE 0
+#endif
+
+/* How much can be given to sendfile() without blocking. This is
+ * the free space in the socket's send buffer, which grows beyond
+ * the default size (system_bufsize) if the kernel tunes it.
+ */
+static int send_space(request * req)
+{
+#ifdef TIOCOUTQ
+    int sndbuf, queued;
+    socklen_t len = sizeof(sndbuf);
+
+    if (getsockopt(req->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == 0 &&
+        ioctl(req->fd, TIOCOUTQ, &queued) == 0) {
+        if (sndbuf - queued < BUFFER_SIZE)
+            return BUFFER_SIZE;
+        return sndbuf - queued;
+    }
+#endif
+    return system_bufsize;
+}
+
+/* Sends the response headers, that init_get() left in the
+ * buffer, with MSG_MORE so that they share the packets with
+ * the first segment of the file sent by sendfile().
+ *
+ * Return values:
+ *  -1: request blocked
+ *   0: error, the request must be closed
+ *   1: headers were sent (or some of them)
+ */
+static int send_buffered_headers(request *req)
+{
+    int bytes_written, bytes_to_write;
+
+    bytes_to_write = req->buffer_end - req->buffer_start;
+
+retrysend:
+    /* the closing boundary of a multipart response has nothing
+     * after it.
+     */
+    bytes_written = send(req->fd, req->buffer + req->buffer_start,
+                         bytes_to_write,
+                         req->filepos < req->pipe_range_stop ? MSG_MORE : 0);
+
+    if (bytes_written == -1) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN)
+            return -1;
+        else if (errno == EINTR)
+            goto retrysend;
+        else {
+            req->status = DEAD;
+            req->buffer_start = req->buffer_end = 0;
+            if (errno != EPIPE) {
+                log_error_doc(req);
+                perror("header write");
+            }
+            return 0;
+        }
+    }
+
+    req->buffer_start += bytes_written;
+    if (req->buffer_start == req->buffer_end)
+        req->buffer_start = req->buffer_end = 0;
+
+    return 1;
+}
+
+static int io_shuffle_sendfile(request * req)
 {
     int foo;
     off_t filepos;
+    int headers_sent = 0;
 
-    foo = req->pipe_range_stop - req->filepos;
-    if (foo > system_bufsize)
-        foo = system_bufsize;
+    if (req->buffer_end) {
+        foo = send_buffered_headers(req);
+        if (foo != 1)
+            return foo;
+        if (req->buffer_end) /* short write */
+            return 1;
+        headers_sent = 1;
+    }
+
+    foo = send_space(req);
+    if (foo > req->pipe_range_stop - req->filepos)
+        foo = req->pipe_range_stop - req->filepos;
 
 retrysendfile:
     filepos = req->filepos;
@@ -187,9 +365,21 @@ retrysendfile:
 #endif
     req->filepos = filepos;
 
-    if (foo >= 0) {
-        if (req->filepos >= req->pipe_range_stop)
+    if (headers_sent)
+        socket_flush(req->fd);
+
+    if (foo == 0 && req->filepos < req->pipe_range_stop) {
+        req->status = DEAD;
+        log_error_doc(req);
+        fputs("file was truncated while it was sent\n", stderr);
+        return 0;
+    } else if (foo >= 0) {
+        io_shuffle_hints(req);
+        if (req->filepos >= req->pipe_range_stop) {
+            if (req->ranges != NULL && next_byte_range(req))
+                return 1;       /* the next part */
             return 0;
+        }
         return 1;
     } else {
         if (errno == EWOULDBLOCK || errno == EAGAIN)
@@ -205,85 +395,187 @@ retrysendfile:
         }
     }
 }
-#else
+#endif                          /* HAVE_SENDFILE */
 
-/* always try to read unless data_fs is 0 (and there is space)
- * then try to write
+/* Makes req->mmap_window_var the window that contains req->filepos,
+ * if the window cache can be used.
+ *
+ * Returns: 1 if the data are sent from the window, 0 if they have
+ * to be read into req->io_buffer.
+ */
+static int io_shuffle_window(request * req)
+{
+    struct mmap_window *w = req->mmap_window_var;
+
+    if (w != NULL) {
+        if (!w->lease_broken && req->filepos >= w->offset &&
+            req->filepos < w->offset + w->len)
+            return 1;
+        /* the file is about to be written, or we are past it */
+        if (w->lease_broken)
+            req->no_mmap_window = 1;
+        release_mmap_window(w);
+        req->mmap_window_var = NULL;
+    }
+
+    if (req->no_mmap_window || window_cache_size <= 0)
+        return 0;
+
+    req->mmap_window_var = find_mmap_window(req->data_fd, req->filepos);
+    if (req->mmap_window_var == NULL) {
+        req->no_mmap_window = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Name: io_shuffle_read
+ * Description: Sends a large file from the window cache, or by
+ * reading it in IO_BUFFER_SIZE chunks. Used when sendfile() is not
+ * available, or cannot be used (ie. in TLS connections without kTLS).
+ * The headers left in the buffer by init_get() are sent first.
  *
  * Return values:
  *  -1: request blocked, move to blocked queue
  *   0: EOF or error, close it down
- *   1: successful read, recycle in ready queue
+ *   1: successful write, recycle in ready queue
  */
-
-int io_shuffle(request * req)
+static int io_shuffle_read(request * req)
 {
-    int bytes_to_read;
-    int bytes_written, bytes_to_write;
+    int bytes_read, bytes_written, bytes_to_write;
+    off_t bytes_to_read;
+    char *data;
+    int from_window = 0;
+
+    if (req->buffer_end) {
+        data = req->buffer + req->buffer_start;
+        bytes_to_write = req->buffer_end - req->buffer_start;
+    } else if (req->io_buffer_start == req->io_buffer_end &&
+               req->filepos >= req->pipe_range_stop) {
+        if (req->ranges != NULL && next_byte_range(req))
+            return 1;           /* the next part */
+        return 0;
+    } else if (req->io_buffer_start == req->io_buffer_end &&
+               io_shuffle_window(req)) {
+        struct mmap_window *w = req->mmap_window_var;
+
+        data = w->mmap + (req->filepos - w->offset);
+        bytes_to_read = w->offset + w->len;
+        if (bytes_to_read > req->pipe_range_stop)
+            bytes_to_read = req->pipe_range_stop;
+        bytes_to_read -= req->filepos;
+        if (bytes_to_read > IO_BUFFER_SIZE)
+            bytes_to_read = IO_BUFFER_SIZE;
+        bytes_to_write = bytes_to_read;
+        from_window = 1;
+    } else {
+        if (req->io_buffer == NULL) {
+            req->io_buffer = malloc(IO_BUFFER_SIZE);
+            if (req->io_buffer == NULL) {
+                req->status = DEAD;
+                log_error_doc(req);
+                fputs("could not allocate the I/O buffer\n", stderr);
+                return 0;
+            }
+        }
 
-    bytes_to_read = BUFFER_SIZE - req->buffer_end;
-
-    if (bytes_to_read > 0 && req->data_fd) {
-        int bytes_read;
-    restartread:
-        bytes_read = read(req->data_fd, req->buffer + req->buffer_end, bytes_to_read);
-
-        if (bytes_read == -1) {
-            if (errno == EINTR)
-                goto restartread;
-            else if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                /* not a fatal error, don't worry about it */
-                /* buffer is empty, we're blocking on read! */
-                if (req->buffer_end - req->buffer_start == 0)
-                    return -1;
-            } else {
+        if (req->io_buffer_start == req->io_buffer_end) {
+            bytes_to_read = req->pipe_range_stop - req->filepos;
+            if (bytes_to_read > IO_BUFFER_SIZE)
+                bytes_to_read = IO_BUFFER_SIZE;
+
+            bytes_read = pread(req->data_fd, req->io_buffer, bytes_to_read,
+                               req->filepos);
+            if (bytes_read == -1 && errno == EINTR)
+                return 1;
+            if (bytes_read <= 0) {
                 req->status = DEAD;
                 log_error_doc(req);
-                perror("ioshuffle read");
+                if (bytes_read == 0)
+                    fputs("file was truncated while it was sent\n", stderr);
+                else
+                    perror("ioshuffle read");
                 return 0;
             }
-        } else if (bytes_read == 0) { /* eof, write rest of buffer */
-            close(req->data_fd);
-            req->data_fd = -1;
-        } else {
-            req->buffer_end += bytes_read;
+
+            req->io_buffer_start = 0;
+            req->io_buffer_end = bytes_read;
         }
-    }
 
-    bytes_to_write = req->buffer_end - req->buffer_start;
-    if (bytes_to_write == 0) {
-        if (req->data_fd == 0)
-            return 0; /* done */
-        req->buffer_end = req->buffer_start = 0;
-        return 1;
+        data = req->io_buffer + req->io_buffer_start;
+        bytes_to_write = req->io_buffer_end - req->io_buffer_start;
     }
 
-restartwrite:
-    bytes_written = write(req->fd, req->buffer + req->buffer_start, bytes_to_write);
+    if (req->buffer_end)
+        bytes_written = socket_send(req, data, bytes_to_write);
+    else
+        bytes_written = socket_send_bulk(req, data, bytes_to_write);
 
-    if (bytes_written == -1) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN)
+    if (bytes_written < 0) {
+        if (bytes_written == BOA_E_AGAIN)
             return -1;          /* request blocked at the pipe level, but keep going */
-        else if (errno == EINTR)
-            goto restartwrite;
+        else if (bytes_written == BOA_E_INTR)
+            return 1;
         else {
             req->status = DEAD;
-            send_r_error(req);  /* maybe superfluous */
-            log_error_doc(req);
-            perror("ioshuffle write");
+            req->buffer_start = req->buffer_end = 0;
+            if (bytes_written != BOA_E_PIPE) {
+                log_error_doc(req);
+                perror("ioshuffle write");
+            }
             return 0;
         }
-    } else if (bytes_written == 0) {
     }
 
-    req->buffer_start += bytes_written;
+    if (req->buffer_end) {
+        req->buffer_start += bytes_written;
+        if (req->buffer_start == req->buffer_end)
+            req->buffer_start = req->buffer_end = 0;
+        return 1;
+    }
+
+    if (!from_window) {
+        req->io_buffer_start += bytes_written;
+        /* the records of a blocked bulk send may have been made
+         * from the window, and hold more than was read since.
+         */
+        if (req->io_buffer_start > req->io_buffer_end)
+            req->io_buffer_start = req->io_buffer_end;
+    }
     req->filepos += bytes_written;
+    io_shuffle_hints(req);
 
-    if (bytes_to_write == bytes_written) {
-        req->buffer_end = req->buffer_start = 0;
+    if (req->io_buffer_start == req->io_buffer_end &&
+        req->filepos >= req->pipe_range_stop) {
+        if (req->ranges != NULL && next_byte_range(req))
+            return 1;           /* the next part */
+        return 0;
     }
 
-     return 1;
+    return 1;
 }
 
+/*
+ * Name: io_shuffle
+ * Description: Sends a file that is too large for the mmap cache,
+ * from req->filepos to req->pipe_range_stop.
+ *
+ * Return values:
+ *  -1: request blocked, move to blocked queue
+ *   0: EOF or error, close it down
+ *   1: successful write, recycle in ready queue
+ */
+int io_shuffle(request * req)
+{
+#ifdef HAVE_SENDFILE
+    /* sendfile() writes directly to the socket, thus it cannot
+     * be used in TLS connections, unless the kernel makes the
+     * TLS records (see ssl.c).
+     */
+    if (!req->secure || req->ktls_send)
+        return io_shuffle_sendfile(req);
 #endif
+    return io_shuffle_read(req);
+}
@@ -39,6 +39,7 @@ void* select_loop(void* _params)
     short which = 0, other = 1, temp;
     int server_pfd = -1;
     int ssl_server_pfd = -1;
+    int async_pfd;
 
     params->pfds = pfd1[which];
     params->pfd_len = 0;
@@ -61,6 +62,13 @@ void* select_loop(void* _params)
             }
         }
 
+        async_pfd = -1;
+        if (params->async_fd[0] != -1) {
+            async_pfd = params->pfd_len++;
+            params->pfds[async_pfd].fd = params->async_fd[0];
+            params->pfds[async_pfd].events = POLLIN;
+        }
+
         /* If there are any requests ready, the timeout is 0.
          * If not, and there are any requests blocking, the
          *  timeout is ka_timeout ? ka_timeout * 1000, otherwise
@@ -82,6 +90,10 @@ void* select_loop(void* _params)
           	params->server_s[1].pending_requests = 1;
         }
 
+        /* wake up the requests whose files were opened */
+        if (async_pfd != -1 && params->pfds[async_pfd].revents & POLLIN)
+            async_io_complete(params);
+
         /* go through blocked and unblock them if possible */
         /* also resets params->pfd_len and pfd to known blocked */
         if (params->request_block) {
@@ -129,6 +141,14 @@ void update_blocked(server_params* params, struct pollfd pfd1[])
         time_since = current_time - current->time_last;
         next = current->next;
 
+        /* waiting for an async I/O thread, not for an fd */
+        if (current->status == ASYNC_OPEN)
+            continue;
+#ifdef ENABLE_SSL
+        if (current->handshake != NULL)
+            continue;           /* or for a handshake thread */
+#endif
+
         // FIXME::  the first below has the chance of leaking memory!
         //  (setting status to DEAD not DONE....)
         /* hmm, what if we are in "the middle" of a request and not
@@ -40,12 +40,6 @@ void block_request(server_params* params, request * req)
     } else {
         switch (req->status) {
         case IOSHUFFLE:
-#ifndef HAVE_SENDFILE
-            if (req->buffer_end - req->buffer_start == 0) {
-                BOA_FD_SET(req, req->data_fd, BOA_READ);
-                break;
-            }
-#endif
         case WRITE:
         case PIPE_WRITE:
         case DONE:
@@ -54,6 +48,18 @@ void block_request(server_params* params, request * req)
         case PIPE_READ:
             BOA_FD_SET( req, req->data_fd, BOA_READ);
             break;
+        case ASYNC_OPEN:
+            break;              /* woken up by async_io_complete() */
+#ifdef ENABLE_SSL
+        case FINISH_HANDSHAKE:
+            if (req->handshake == NULL) {
+                BOA_FD_SET( req, req->fd, BOA_READ);
+            }
+            break;              /* or woken up by ssl_handshake_complete() */
+#endif
+        case ZEROCOPY_WAIT:
+            BOA_FD_SET( req, req->fd, BOA_ERROR);
+            break;
         case BODY_WRITE:
             BOA_FD_SET( req, req->post_data_fd.fds[1], BOA_WRITE);
             break;
@@ -80,12 +86,6 @@ void ready_request(server_params* params, request * req)
     } else {
         switch (req->status) {
         case IOSHUFFLE:
-#ifndef HAVE_SENDFILE
-            if (req->buffer_end - req->buffer_start == 0) {
-                BOA_FD_CLR(req, req->data_fd, BOA_READ);
-                break;
-            }
-#endif
         case WRITE:
         case PIPE_WRITE:
         case DONE:
@@ -94,6 +94,18 @@ void ready_request(server_params* params, request * req)
         case PIPE_READ:
             BOA_FD_CLR(req, req->data_fd, BOA_READ);
             break;
+        case ASYNC_OPEN:
+            break;
+#ifdef ENABLE_SSL
+        case FINISH_HANDSHAKE:
+            if (req->handshake == NULL) {
+                BOA_FD_CLR(req, req->fd, BOA_READ);
+            }
+            break;
+#endif
+        case ZEROCOPY_WAIT:
+            BOA_FD_CLR(req, req->fd, BOA_ERROR);
+            break;
         case BODY_WRITE:
             BOA_FD_CLR(req, req->post_data_fd.fds[1], BOA_WRITE);
             break;
@@ -314,14 +314,34 @@ static void free_request(server_params * params, request ** list_head_addr,
    /* put request on the free list */
    dequeue(list_head_addr, req);	/* dequeue from ready or block list */
 
+   /* the cached headers are not part of the body */
+   if (req->response_entry_var) {
+      req->filepos -= req->response_entry_var->header_len;
+      if (req->filepos < 0)
+	 req->filepos = 0;
+   }
+
    if (req->logline)		/* access log */
       log_access(req);
 
    if (req->mmap_entry_var)
       release_mmap(req->mmap_entry_var);
-/* FIXME: Why is it needed? */
-   else if (req->data_mem)
-      munmap(req->data_mem, req->filesize);
+#ifdef HAVE_LIBZ
+   else if (req->compressed_entry_var)
+      release_compressed(req->compressed_entry_var);
+#endif
+   else if (req->response_entry_var)
+      release_cached_response(req->response_entry_var);
+   else if (req->listing_entry_var)
+      release_dir_listing(req->listing_entry_var);
+
+   if (req->mmap_window_var)
+      release_mmap_window(req->mmap_window_var);
+
+   if (req->pack)
+      release_pack(req->pack);
+   if (req->docroot)
+      release_docroot(req->docroot);
 
    if (req->data_fd != -1)
       close(req->data_fd);
@@ -341,6 +361,15 @@ static void free_request(server_params * params, request ** list_head_addr,
       }
    }
 
+   free(req->ranges);
+   if (req->pipe_filter)
+      free_pipe_filter(req->pipe_filter);
+   free(req->io_buffer);
+#ifdef ENABLE_SSL
+   free(req->ssl_bulk);
+#endif
+   if (req->async_open)
+      free_async_open(req->async_open);
    free(req->pathname);
    free(req->query_string);
    free(req->path_info);
@@ -366,6 +395,7 @@ static void free_request(server_params * params, request ** list_head_addr,
       if (req->secure != 0) {
 	 conn->secure = 1;
 	 conn->ssl_state = req->ssl_state;
+	 conn->ktls_send = req->ktls_send;
 
 	 conn->status = READ_HEADER;
       } else {
@@ -380,6 +410,10 @@ static void free_request(server_params * params, request ** list_head_addr,
       conn->header_line = conn->client_stream;
       conn->kacount = req->kacount - 1;
 
+      /* numbered per socket */
+      conn->zerocopy_sends = req->zerocopy_sends;
+      conn->zerocopy_done = req->zerocopy_done;
+
       /* close enough and we avoid a call to time(NULL) */
       conn->time_last = req->time_last;
 
@@ -451,6 +485,7 @@ static void free_request(server_params * params, request ** list_head_addr,
 #ifdef ENABLE_SSL
    if (req->secure) {
       gnutls_bye(req->ssl_state, GNUTLS_SHUT_WR);
+      ssl_session_done(req->ssl_state);
       gnutls_deinit(req->ssl_state);
    }
 #endif
@@ -490,7 +525,9 @@ void process_requests(server_params * params, socket_type * server_s)
 
    while (current) {
       if (current->buffer_end &&	/* there is data in the buffer */
-	  current->status != DEAD && current->status != DONE) {
+	  current->status != DEAD && current->status != DONE &&
+	  /* these send the buffered headers along with the body */
+	  current->status != WRITE && current->status != IOSHUFFLE) {
 	 retval = req_flush(current);
 	 /*
 	  * retval can be -2=error, -1=blocked, or bytes left
@@ -510,7 +547,7 @@ void process_requests(server_params * params, socket_type * server_s)
 	 switch (current->status) {
 #ifdef ENABLE_SSL
 	 case FINISH_HANDSHAKE:
-	    retval = finish_handshake(current);
+	    retval = finish_handshake(params, current);
 	    break;
 	 case SEND_ALERT:
 	    retval = send_alert(current);
@@ -540,6 +577,12 @@ void process_requests(server_params * params, socket_type * server_s)
 	 case IOSHUFFLE:
 	    retval = io_shuffle(current);
 	    break;
+	 case ASYNC_OPEN:
+	    retval = process_async_open(params, current);
+	    break;
+	 case ZEROCOPY_WAIT:
+	    retval = process_zerocopy_wait(current);
+	    break;
 	 case DONE:
 	    /* a non-status that will terminate the request */
 	    retval = req_flush(current);
@@ -811,96 +854,6 @@ int process_header_end(server_params * params, request * req)
    return init_get(params, req);	/* get and head */
 }
 
-/* Parses HTTP/1.1 range values.
- */
-static int parse_range(const char *value, off_t * val1,
-		       off_t * val2)
-{
-   int len;
-   char *p;
-
-   *val1 = *val2 = 0;
-
-   len = strlen(value);
-   if (len < 7)
-      return -1;
-
-   /* we do not accept ranges of the form "bytes=10-20,21-30"
-    */
-   if (strchr(value, ',') != NULL)
-      return -1;
-
-   if (memcmp("bytes=", value, 6) != 0) {
-      return -1;
-   } else
-      value += 6;
-
-   while (*value == ' ')
-      value++;
-   if ((p = strchr(value, '-')) == NULL)
-      return -1;
-
-   if (value[0] == '-') {	/* Handle case "bytes=-1024" */
-      *val1 = 0;
-      *val2 = boa_atoll(&value[1]);
-      return 0;
-   } else {
-      char buf[43];
-      int len;
-
-      /* two values of the form "xxx-yyy" */
-
-      if ((len = strlen(value)) >= sizeof(buf))
-	 return -1;
-
-      memcpy(buf, value, len);
-      buf[len] = 0;
-
-      p = strchr(buf, '-');
-      if (p == NULL)
-	 return -1;
-      *p = 0;
-      p++;
-
-      while (*p == ' ')
-	 p++;
-
-      *val1 = boa_atoll(buf);
-
-      if (*p == '\0')		/* form: "xxx-" */
-	 *val2 = 0;
-      else
-	 *val2 = boa_atoll(p);
-
-      if (*val1 == -1)
-	 return -1;
-
-      return 0;
-   }
-
-   return -1;
-}
-
-inline static void init_range_stuff(request * req, char *value)
-{
-   off_t p1, p2;
-   if (parse_range(value, &p1, &p2) == 0) {
-      req->range_start = p1;
-      req->range_stop = p2;
-   } else {
-      req->range_start = -1;
-      req->range_stop = -1;
-      log_error_doc(req);
-      fprintf(stderr, "bogus range: \"%s\"\n", value);
-
-      /* here we just ignore a bogus range,
-       * but we have put illegal values in
-       * range start and range stop, to
-       * be detected in init_get().
-       */
-   }
-}
-
 inline static void init_vhost_stuff(request * req, char *value)
 {
    virthost *vhost;
@@ -921,6 +874,12 @@ inline static void init_vhost_stuff(request * req, char *value)
       req->hostname = value;
       memcpy(req->document_root, vhost->document_root,
 	     vhost->document_root_len + 1);
+      if (req->pack)
+	 release_pack(req->pack);
+      req->pack = vhost->pack ? hold_pack(vhost->pack) : NULL;
+      if (req->docroot)
+	 release_docroot(req->docroot);
+      req->docroot = vhost->docroot ? hold_docroot(vhost->docroot) : NULL;
       if (vhost->user_dir)
 	 memcpy(req->user_dir, vhost->user_dir, vhost->user_dir_len + 1);
 
@@ -960,8 +919,11 @@ int process_option_line(request * req)
    case 'A':
       if (!memcmp(line, "ACCEPT", 7))
 	 add_accept_header(req, value);
-      else
+      else {
+	 if (!memcmp(line, "ACCEPT_ENCODING", 16))
+	    req->accept_encoding = parse_accept_encoding(value);
 	 goto just_add_header;
+      }
       break;
 
    case 'C':
@@ -1025,7 +987,10 @@ int process_option_line(request * req)
 	 if (!add_cgi_env(req, "REFERER", value, 1))
 	    return 0;
       } else if (!memcmp(line, "RANGE", 5)) {
-	 init_range_stuff(req, value);
+	 /* the ranges are parsed in init_get(), where
+	  * the size of the file is known.
+	  */
+	 req->range_header = value;
       } else goto just_add_header;
       break;
       
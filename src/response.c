@@ -26,7 +26,8 @@
 
 void print_content_type(request * req)
 {
-char * mime_type = get_mime_type(req->request_uri);
+char * mime_type = req->pack_mime ? req->pack_mime :
+    get_mime_type(req->request_uri);
 
     if (mime_type != NULL) {
        req_write(req, "Content-Type: ");
@@ -61,7 +62,7 @@ char buf[22*3 + 5];
 
     req_write(req, "Content-Range: bytes ");
 
-    simple_itoa( req->range_stop, stop);
+    simple_itoa( req->range_stop - 1, stop); /* range_stop is exclusive */
     simple_itoa( req->range_start, start);
     simple_itoa( req->filesize, total);
     
@@ -77,6 +78,20 @@ void print_last_modified(request * req)
     req_write(req, lm);
 }
 
+void print_content_encoding(request * req)
+{
+    const char *name;
+
+    if (req->encoding != ENCODING_IDENTITY &&
+        (name = encoding_name(req->encoding)) != NULL) {
+        req_write(req, "Content-Encoding: ");
+        req_write(req, name);
+        req_write(req, "\r\n");
+    }
+    if (req->vary_encoding)
+        req_write(req, "Vary: Accept-Encoding\r\n");
+}
+
 void print_etag(request * req)
 {
 char buffer[sizeof("ETag: \r\n") + MAX_ETAG_LENGTH + 1] = "ETag: ";
@@ -106,7 +121,10 @@ void print_ka_phrase(request * req)
         req_write(req, "Connection: close\r\n");
 }
 
-void print_http_headers(request * req)
+/* The headers that differ on every response, even for the
+ * same file.
+ */
+void print_volatile_headers(request * req)
 {
     char date_stuff[] = "Date: "
         "                             "
@@ -115,14 +133,37 @@ void print_http_headers(request * req)
     rfc822_time_buf(date_stuff + 6, 0);
 
     req_write(req, date_stuff);
+    print_ka_phrase(req);
+}
 
+void print_server_headers(request * req)
+{
     if (!req->secure)
 	req_write(req, boa_version);
     else
 	req_write(req, boa_tls_version);
 
     req_write(req, "Accept-Ranges: bytes\r\n");
-    print_ka_phrase(req);
+}
+
+void print_http_headers(request * req)
+{
+    print_volatile_headers(req);
+    print_server_headers(req);
+}
+
+/* The headers of a 200 response for a file, except for the
+ * volatile ones. These are kept in the response cache.
+ */
+void print_file_ok_headers(request * req)
+{
+    print_server_headers(req);
+    print_content_length(req);
+    print_last_modified(req);
+    print_etag(req);
+    print_content_type(req);
+    print_content_encoding(req);
+    req_write(req, "\r\n");
 }
 
 /* The routines above are only called by the routines below.
@@ -137,15 +178,12 @@ void send_r_request_file_ok(request * req)
         return;
 
     req_write(req, HTTP_VERSION" 200 OK\r\n");
-    print_http_headers(req);
+    print_volatile_headers(req);
 
-    if (!req->is_cgi) {
-        print_content_length(req);
-        print_last_modified(req);
-        print_etag(req);
-        print_content_type(req);
-        req_write(req, "\r\n");
-    }
+    if (!req->is_cgi)
+        print_file_ok_headers(req);
+    else
+        print_server_headers(req);
 }
 
 void send_r_request_cgi_status(request * req, char* status, char* desc)
@@ -179,10 +217,47 @@ void send_r_request_partial(request * req)
         print_content_range(req);
         print_last_modified(req);
         print_content_type(req);
+        print_content_encoding(req);
         req_write(req, "\r\n");
     }
 }
 
+/* R_REQUEST_PARTIAL: 206, with more than one range.
+ * The part headers have been prepared by init_get().
+ */
+void send_r_request_multipart(request * req)
+{
+    char buf[22];
+    off_t length = 0;
+    int i;
+
+    req->response_status = R_REQUEST_PARTIAL;
+    if (req->http_version==HTTP_0_9)
+        return;
+
+    /* The closing boundary is the last entry, and has an empty body.
+     */
+    for (i = 0; i <= req->range_count; i++) {
+        length += req->ranges[i].hdr_len;
+        length += req->ranges[i].stop - req->ranges[i].start;
+    }
+
+    req_write(req, HTTP_VERSION" 206 Partial content\r\n");
+    print_http_headers(req);
+
+    req_write(req, "Content-Length: ");
+    simple_itoa( length, buf);
+    req_write(req, buf);
+    req_write(req, "\r\n");
+    print_last_modified(req);
+    print_etag(req);
+    /* the ranges are of the encoded file */
+    print_content_encoding(req);
+    req_write(req, "Content-Type: multipart/byteranges; boundary=");
+    req_write(req, req->range_headers);
+    req_write(req, "\r\n\r\n");
+}
+
 /* R_MOVED_PERM: 301 */
 void send_r_moved_perm(request * req, char *url)
 {
@@ -243,6 +318,7 @@ void send_r_not_modified(request * req)
     req_write(req, HTTP_VERSION" 304 Not Modified\r\n");
     print_http_headers(req);
     print_content_type(req);
+    print_content_encoding(req);
     print_etag(req);
     req_write(req, "\r\n");
     req_flush(req);
@@ -358,22 +434,26 @@ void send_r_range_unsatisfiable(request * req)
         return;
 
     if (req->http_version > HTTP_0_9) {
+        char total[22];
+
         req_write(req, HTTP_VERSION" 416 Range Not Satisfiable\r\n");
         print_http_headers(req);
+        simple_itoa( req->filesize, total);
+        req_write(req, "Content-Range: bytes */");
+        req_write(req, total);
+        req_write(req, "\r\n");
         req_write(req, "Content-Type: " TEXT_HTML "\r\n\r\n"); /* terminate header */
     }
     if (req->method != M_HEAD) {
-        char int1[22], int2[22];
-        char range[45];
         req_write(req, "<HTML><HEAD><TITLE>416 Range Not Satisfiable</TITLE></HEAD>\n"
                   "<BODY><H1>416 Range Not Satisfiable</H1>\nThe requested range URL ");
         req_write_escape_html(req, req->request_uri);
         req_write( req, " had illegal range");
 
-        if (simple_itoa( req->range_start, int1) > 0 &&
-           simple_itoa( req->range_stop, int2) > 0) {
-           sprintf( range, "(%s-%s)", int1, int2);
-           req_write(req, range);
+        if (req->range_header != NULL) {
+           req_write(req, " (");
+           req_write_escape_html(req, req->range_header);
+           req_write(req, ")");
         }
         req_write(req, ".\n</BODY></HTML>\n");
     }
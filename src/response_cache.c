@@ -0,0 +1,331 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the response cache. For small files, the
+ * work to prepare a response costs much more than sending it. Thus
+ * the complete response (headers and body) is kept in memory, and
+ * only the status line, the Date and the Connection headers are
+ * written for each request. process_get() sends these, and the
+ * cached response, with a single writev().
+ */
+
+#include "boa.h"
+
+int response_cache_size = 1024 * 1024;
+int response_cache_max_file_size = 4096;
+
+static struct response_entry *response_cache[RESPONSE_CACHE_HASH_SIZE];
+static size_t response_cache_bytes = 0;
+
+#ifdef ENABLE_SMP
+static pthread_mutex_t response_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define RESPONSE_HASH(dev,ino) \
+	((((unsigned long int)(ino)) ^ ((unsigned long int)(dev))) % RESPONSE_CACHE_HASH_SIZE)
+
+/* How much memory an entry uses, for the cache budget.
+ */
+#define RESPONSE_COST(e) (sizeof(struct response_entry) + (e)->len)
+
+static void free_response(struct response_entry *e)
+{
+   free(e->data);
+   free(e);
+}
+
+/* Unlinks *p from the cache. It is freed now, or when the last
+ * request that uses it is done.
+ * No locking here. The caller has to do the proper locking.
+ */
+static void remove_response(struct response_entry **p)
+{
+   struct response_entry *e = *p;
+
+   *p = e->next;
+   response_cache_bytes -= RESPONSE_COST(e);
+   e->cached = 0;
+   if (e->use_count == 0)
+      free_response(e);
+}
+
+/* Removes the unused entries, least recently used first, until
+ * bytes more fit in the cache.
+ * No locking here. The caller has to do the proper locking.
+ *
+ * Returns: 1 if there is enough room, 0 otherwise.
+ */
+static int make_room(size_t bytes)
+{
+   struct response_entry **p, **oldest;
+   int i;
+
+   if (bytes > (size_t) response_cache_size)
+      return 0;
+
+   while (response_cache_bytes + bytes > (size_t) response_cache_size) {
+      oldest = NULL;
+      for (i = 0; i < RESPONSE_CACHE_HASH_SIZE; i++) {
+	 for (p = &response_cache[i]; *p != NULL; p = &(*p)->next) {
+	    if ((*p)->use_count == 0 &&
+		(oldest == NULL || (*p)->last_used < (*oldest)->last_used))
+	       oldest = p;
+	 }
+      }
+
+      if (oldest == NULL)
+	 return 0;		/* everything is in use */
+
+      remove_response(oldest);
+   }
+
+   return 1;
+}
+
+/* Checks whether the response to req may come from the cache,
+ * or be stored in it. s describes the requested file.
+ */
+static int cacheable_request(request * req, struct stat *s)
+{
+   return (response_cache_size > 0 && req->method == M_GET &&
+	   req->http_version != HTTP_0_9 && req->range_header == NULL &&
+	   req->if_types == 0 && S_ISREG(s->st_mode) && s->st_size > 0 &&
+	   s->st_size <= response_cache_max_file_size);
+}
+
+/* Looks up the entry for the given file, and the request.
+ * Removes the entries of older versions of the file, and the
+ * expired ones, if they are not in use.
+ * No locking here. The caller has to do the proper locking.
+ */
+static struct response_entry *lookup_response(request * req,
+					      struct stat *s,
+					      const char *mime_type)
+{
+   struct response_entry **p, *e;
+
+   p = &response_cache[RESPONSE_HASH(s->st_dev, s->st_ino)];
+   while ((e = *p) != NULL) {
+      if (e->dev == s->st_dev && e->ino == s->st_ino) {
+	 if (e->mtime != s->st_mtime || e->size != s->st_size ||
+	     (e->expires != 0 && e->expires < current_time)) {
+	    if (e->use_count == 0) {
+	       remove_response(p);
+	       continue;
+	    }
+	 } else if (e->secure == req->secure && e->mime_type == mime_type &&
+		    (!e->vary || e->accept_encoding == req->accept_encoding))
+	    return e;
+      }
+      p = &e->next;
+   }
+
+   return NULL;
+}
+
+/*
+ * Name: find_cached_response
+ * Description: Returns the cached response for the file described
+ * by s, if there is one that is suitable for this request.
+ *
+ * Returns: the entry, which must be given back using
+ * release_cached_response(), or NULL.
+ */
+struct response_entry *find_cached_response(request * req, struct stat *s)
+{
+   struct response_entry *e;
+   const char *mime_type;
+
+   if (!cacheable_request(req, s))
+      return NULL;
+
+   mime_type = get_mime_type(req->request_uri);
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&response_lock);
+#endif
+   e = lookup_response(req, s, mime_type);
+   if (e != NULL) {
+      e->use_count++;
+      e->last_used = current_time;
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&response_lock);
+#endif
+
+   return e;
+}
+
+/*
+ * Name: send_cached_response
+ * Description: Prepares req to send req->response_entry_var. The
+ * status line and the volatile headers are written to the buffer,
+ * and the rest is sent by process_get() from req->data_mem.
+ */
+void send_cached_response(request * req)
+{
+   struct response_entry *e = req->response_entry_var;
+
+   req->response_status = R_REQUEST_OK;
+   req_write(req, HTTP_VERSION " 200 OK\r\n");
+   print_volatile_headers(req);
+
+   req->data_mem = e->data;
+   req->filesize = e->len;
+   req->filepos = req->range_start = 0;
+   req->range_stop = e->len;
+}
+
+/*
+ * Name: cache_response
+ * Description: Adds the response that init_get() has prepared, to the
+ * cache. orig describes the requested file, and data_fd the file
+ * that is sent (a precompressed version of the file maybe). The body
+ * is read from req->compressed_entry_var if set, or from data_fd.
+ */
+void cache_response(request * req, struct stat *orig, int data_fd)
+{
+   struct response_entry *e;
+   const char *mime_type;
+   int start, n;
+   size_t pos;
+
+   if (!cacheable_request(req, orig) || req->ranges != NULL ||
+       req->range_start != 0 || req->range_stop != req->filesize ||
+       req->status == DEAD)
+      return;
+
+   mime_type = get_mime_type(req->request_uri);
+
+   /* The headers are written after the ones in the buffer, and
+    * are removed when copied.
+    */
+   start = req->buffer_end;
+   print_file_ok_headers(req);
+   if (req->status == DEAD) {
+      /* ran out of buffer space */
+      req->status = WRITE;
+      req->buffer_end = start;
+      return;
+   }
+
+   e = calloc(1, sizeof(struct response_entry));
+   if (e == NULL) {
+      req->buffer_end = start;
+      return;
+   }
+
+   e->header_len = req->buffer_end - start;
+   e->len = e->header_len + req->filesize;
+   e->data = malloc(e->len);
+   if (e->data == NULL) {
+      req->buffer_end = start;
+      free(e);
+      return;
+   }
+
+   memcpy(e->data, req->buffer + start, e->header_len);
+   req->buffer_end = start;
+
+#ifdef HAVE_LIBZ
+   if (req->compressed_entry_var != NULL)
+      memcpy(e->data + e->header_len, req->compressed_entry_var->data,
+	     req->filesize);
+   else
+#endif
+   {
+      for (pos = 0; pos < (size_t) req->filesize; pos += n) {
+	 n = pread(data_fd, e->data + e->header_len + pos,
+		   req->filesize - pos, pos);
+	 if (n <= 0) {
+	    if (n == -1 && errno == EINTR) {
+	       n = 0;
+	       continue;
+	    }
+	    /* error, or the file was truncated */
+	    free_response(e);
+	    return;
+	 }
+      }
+   }
+
+   e->dev = orig->st_dev;
+   e->ino = orig->st_ino;
+   e->mtime = orig->st_mtime;
+   e->size = orig->st_size;
+   e->secure = req->secure;
+   e->mime_type = mime_type;
+   e->vary = req->vary_encoding;
+   e->accept_encoding = req->accept_encoding;
+   /* the precompressed versions of the file may change */
+   if (e->vary && precompressed_files)
+      e->expires = current_time + PRECOMPRESSED_RECHECK_TIME;
+   e->last_used = current_time;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&response_lock);
+#endif
+   if (lookup_response(req, orig, mime_type) == NULL &&
+       make_room(RESPONSE_COST(e))) {
+      unsigned int i = RESPONSE_HASH(e->dev, e->ino);
+
+      e->cached = 1;
+      e->next = response_cache[i];
+      response_cache[i] = e;
+      response_cache_bytes += RESPONSE_COST(e);
+   }
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&response_lock);
+#endif
+
+   if (!e->cached)
+      free_response(e);
+}
+
+void release_cached_response(struct response_entry *e)
+{
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&response_lock);
+#endif
+   e->use_count--;
+   if (e->use_count == 0 && !e->cached)
+      free_response(e);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&response_lock);
+#endif
+}
+
+/* Removes all the entries. Called when the configuration is
+ * read again, since the responses depend on it (ie. on the
+ * mime types).
+ */
+void flush_response_cache(void)
+{
+   int i;
+
+#ifdef ENABLE_SMP
+   pthread_mutex_lock(&response_lock);
+#endif
+   for (i = 0; i < RESPONSE_CACHE_HASH_SIZE; i++)
+      while (response_cache[i] != NULL)
+	 remove_response(&response_cache[i]);
+#ifdef ENABLE_SMP
+   pthread_mutex_unlock(&response_lock);
+#endif
+}
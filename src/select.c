@@ -74,6 +74,9 @@ void *select_loop(void *_params)
 #endif
       }
 
+      if (params->async_fd[0] != -1)
+	 BOA_FD_SET(req, params->async_fd[0], &params->block_read_fdset);
+
       SET_TIMEOUT(params->req_timeout.tv_sec, 1, -1);
       params->req_timeout.tv_usec = 0l;	/* reset timeout */
 
@@ -102,6 +105,12 @@ void *select_loop(void *_params)
 		      &params->block_read_fdset))
 	 params->server_s[1].pending_requests = 1;
 #endif
+
+      if (params->async_fd[0] != -1
+	  && FD_ISSET(params->async_fd[0], &params->block_read_fdset)) {
+	 FD_CLR(params->async_fd[0], &params->block_read_fdset);
+	 async_io_complete(params);
+      }
    }
 
    return NULL;
@@ -131,6 +140,14 @@ static void fdset_update(server_params * params)
       time_t time_since = current_time - current->time_last;
       next = current->next;
 
+      /* waiting for an async I/O thread, not for an fd */
+      if (current->status == ASYNC_OPEN)
+	 continue;
+#ifdef ENABLE_SSL
+      if (current->handshake != NULL)
+	 continue;		/* or for a handshake thread */
+#endif
+
       /* hmm, what if we are in "the middle" of a request and not
        * just waiting for a new one... perhaps check to see if anything
        * has been read via header position, etc... */
@@ -153,13 +170,6 @@ static void fdset_update(server_params * params)
       } else {
 	 switch (current->status) {
 	 case IOSHUFFLE:
-#ifndef HAVE_SENDFILE
-	    if (current->buffer_end - current->buffer_start == 0) {
-	       if (FD_ISSET(current->data_fd, &block_read_fdset))
-		  ready_request(params, current);
-	       break;
-	    }
-#endif
 	 case WRITE:
 	 case PIPE_WRITE:
 	    if (FD_ISSET(current->fd, &params->block_write_fdset))
@@ -178,6 +188,14 @@ static void fdset_update(server_params * params)
 			  &params->block_write_fdset);
 	    }
 	    break;
+	 case ZEROCOPY_WAIT:
+	    if (FD_ISSET(current->fd, &params->block_read_fdset))
+	       ready_request(params, current);
+	    else {
+	       BOA_FD_SET(current, current->fd,
+			  &params->block_read_fdset);
+	    }
+	    break;
 	 case PIPE_READ:
 	    if (FD_ISSET(current->data_fd, &params->block_read_fdset))
 	       ready_request(params, current);
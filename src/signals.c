@@ -43,6 +43,7 @@ void sigint(int);
 void sigchld(int);
 void sigalrm(int);
 void sigusr1(int);
+void sigio(int);
 
 /*
  * Name: init_signals
@@ -66,6 +67,7 @@ void init_signals(void)
    sigaddset(&sa.sa_mask, SIGALRM);
    sigaddset(&sa.sa_mask, SIGUSR1);
    sigaddset(&sa.sa_mask, SIGUSR2);
+   sigaddset(&sa.sa_mask, SIGIO);
 
    sa.sa_handler = sigsegv;
    sigaction(SIGSEGV, &sa, NULL);
@@ -94,6 +96,10 @@ void init_signals(void)
    sa.sa_handler = sigusr1;
    sigaction(SIGUSR1, &sa, NULL);
 
+   /* file lease breaks (see mmap_cache.c) */
+   sa.sa_handler = sigio;
+   sigaction(SIGIO, &sa, NULL);
+
 }
 
 /* Blocks all signals that should be handled by
@@ -110,6 +116,7 @@ void block_main_signals()
    sigaddset(&sigset, SIGUSR2);
    sigaddset(&sigset, SIGTERM);
    sigaddset(&sigset, SIGINT);
+   sigaddset(&sigset, SIGIO);
 
    sigprocmask(SIG_BLOCK, &sigset, NULL);
 }
@@ -125,6 +132,7 @@ void unblock_main_signals()
    sigaddset(&sigset, SIGTERM);
    sigaddset(&sigset, SIGHUP);
    sigaddset(&sigset, SIGINT);
+   sigaddset(&sigset, SIGIO);
 
    sigprocmask(SIG_UNBLOCK, &sigset, NULL);
 }
@@ -160,30 +168,11 @@ void sigsegv(int dummy)
    abort();
 }
 
+/* The mapped files are leased (see mmap_cache.c), and are never
+ * truncated while they are sent. Thus a SIGBUS is a bug, as a SIGSEGV.
+ */
 void sigbus(int dummy)
 {
-   server_params *params = &global_server_params[0];
-
-/* Note that in multithreaded cases the SIGBUS is catched
- * by the same thread that did the violation. So the following
- * code should be ok.
- */
-
-#ifdef ENABLE_SMP
-   pthread_t tid = pthread_self();
-   int i;
-
-   for (i = 0; i < global_server_params_size; i++) {
-      if (pthread_equal(global_server_params[i].tid, tid)) {
-	 params = &global_server_params[i];
-	 break;
-      }
-   }
-#endif
-
-   if (params->handle_sigbus) {
-      longjmp(params->env, dummy);
-   }
    time(&current_time);
    log_error_time();
    fprintf(stderr, "caught SIGBUS, dumping core in %s\n", tempdir);
@@ -266,6 +255,7 @@ void sigterm_stage2_run()
    fprintf(stderr,
 	   "exiting Hydra normally (uptime %d seconds)\n",
 	   (int) (current_time - start_time));
+   write_mmap_manifest();
    chdir(tempdir);
    clear_common_env();
    dump_mime();
@@ -342,15 +332,22 @@ void sighup_run()
       dump_virthost();
       dump_directory_index();
       dump_cgi_action_modules();
+      dump_compress_types();
 
       log_error_time();
       fputs("re-reading configuration files\n", stderr);
       read_config_files();
+      release_previous_packs();
 
       /* We now need to dispatch the threads again */
       smp_reinit();
       ssl_reinit();
       mmap_reinit();
+      start_mmap_warmup();
+      flush_response_cache();
+      flush_dir_listings();
+      flush_mmap_windows();
+      flush_negative_cache();
 
       log_error_time();
       fputs("successful restart\n", stderr);
@@ -419,10 +416,16 @@ void sigalrm_run(void)
    SET_PTH_SIGFLAG(sigalrm_flag, 0);
 
 #ifdef ENABLE_SSL
-   if (boa_ssl)
+   if (boa_ssl) {
       ssl_regenerate_params();
+      if (ssl_session_tickets)
+	 ssl_rotate_ticket_key();
+   }
 #endif
 
+   /* before the hot files are removed */
+   write_mmap_manifest();
+
    log_error_time();
    fprintf(stderr, "Cleaning up file caches.\n");
 #ifdef ENABLE_SMP
@@ -470,8 +473,24 @@ void sigusr1_run(void)
       fprintf(stderr, "Running SSL connections: %ld\n",
          get_total_global_connections(1));
    }
+   if (boa_ssl)
+      show_ssl_handshake_stats();
 #endif
 
    show_hash_stats();
 
 }
+
+void sigio(int dummy)
+{
+   SET_PTH_SIGFLAG(sigio_flag, 1);
+}
+
+void sigio_run(void)
+{
+   SET_PTH_SIGFLAG(sigio_flag, 0);
+
+   check_mmap_leases();
+   check_window_leases();
+   check_pack_leases();
+}
@@ -21,6 +21,14 @@
 #include "boa.h"
 #include "ssl.h"
 
+#ifdef HAVE_LINUX_ERRQUEUE_H
+# include <linux/errqueue.h>
+#endif
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+# define USE_MSG_ZEROCOPY
+#endif
+
 ssize_t socket_recv( request* req, void* buf, size_t buf_size)
 {
 ssize_t bytes;
@@ -66,12 +74,40 @@ ssize_t bytes;
 	return bytes;
 }
 
+#ifdef ENABLE_SSL
+/* Returns the size of the next record to send, for dynamic
+ * record sizing (see defines.h).
+ */
+static size_t ssl_record_size( request* req)
+{
+	if (ssl_dynamic_record_threshold <= 0)
+	    return SSL_MAX_RECORD_SIZE;
+
+	if (current_time - req->ssl_last_send > SSL_RECORD_IDLE_TIME)
+	    req->ssl_record_bytes = 0;	/* a new response, or was idle */
+	req->ssl_last_send = current_time;
+
+	if (req->ssl_record_bytes < ssl_dynamic_record_threshold)
+	    return SSL_SMALL_RECORD_SIZE;
+	return SSL_MAX_RECORD_SIZE;
+}
+#endif
+
 ssize_t socket_send( request* req, const void* buf, size_t buf_size)
 {
 ssize_t bytes;
+#ifdef ENABLE_SSL
+size_t record_size;
+int small;
+#endif
 
 #ifdef ENABLE_SSL
 	if ( req->secure) {
+	    record_size = ssl_record_size( req);
+	    small = (record_size == SSL_SMALL_RECORD_SIZE);
+	    if (buf_size > record_size)
+		buf_size = record_size;
+
 	    bytes = gnutls_record_send(req->ssl_state,
 				       buf, buf_size);
 
@@ -85,6 +121,9 @@ ssize_t bytes;
 		fprintf(stderr, "TLS sending error \"%s\"\n", gnutls_strerror( bytes));
 		return BOA_E_UNKNOWN;
 	    }
+
+	    if (small)
+		req->ssl_record_bytes += bytes;
 	} else {
 #endif
 	    bytes =
@@ -110,6 +149,202 @@ ssize_t bytes;
 	return bytes;
 }
 
+/* Sends several buffers at once. On plain connections this is a single
+ * writev(), so that the response headers and the first part of the body
+ * leave in the same system call (and usually the same packet).
+ * TLS connections cannot do that (unless the kernel makes the records),
+ * so only the first non empty buffer is sent. The callers must be
+ * prepared for short writes anyway.
+ */
+ssize_t socket_sendv( request* req, const struct iovec* iov, int iovcnt)
+{
+ssize_t bytes;
+
+#ifdef ENABLE_SSL
+	if ( req->secure && !req->ktls_send) {
+	    while (iovcnt > 1 && iov->iov_len == 0) {
+	        iov++;
+	        iovcnt--;
+	    }
+	    return socket_send( req, iov->iov_base, iov->iov_len);
+	}
+#endif
+	bytes = writev(req->fd, iov, iovcnt);
+
+	if (bytes == -1) {
+	    if (errno == EINTR)
+		return BOA_E_INTR;
+	    if (errno == EPIPE)
+		return BOA_E_PIPE;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)	/* request blocked */
+		return BOA_E_AGAIN;
+
+	    log_error_doc(req);
+	    perror("writev");	/* don't need to save errno because log_error_doc does */
+	    return BOA_E_UNKNOWN;
+	}
+
+	return bytes;
+}
+
+/* Bulk sends. gnutls_record_send() writes each record with a system
+ * call of its own. For large files in TLS connections, the records of
+ * a whole chunk are collected in req->ssl_bulk instead (by redirecting
+ * the push function of the session), and written with a single send().
+ */
+#if defined(ENABLE_SSL) && defined(GNUTLS_VERSION_NUMBER) && \
+    GNUTLS_VERSION_NUMBER >= 0x020c00
+# define ENABLE_SSL_BULK
+#endif
+
+#ifdef ENABLE_SSL_BULK
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+/* The push function of sessions that have used socket_send_bulk().
+ * gnutls cannot give back its own one, so this one writes to the
+ * socket as it does, with MSG_NOSIGNAL.
+ */
+static ssize_t ssl_writev( gnutls_transport_ptr_t ptr, const giovec_t * iov, int iovcnt)
+{
+struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+
+	return sendmsg((int)(long) ptr, &msg, MSG_NOSIGNAL);
+}
+
+/* The push function while records are collected; ptr is the request.
+ */
+static ssize_t ssl_bulk_push( gnutls_transport_ptr_t ptr, const giovec_t * iov, int iovcnt)
+{
+request *req = ptr;
+ssize_t total = 0;
+char *p;
+int i, size;
+
+	for (i = 0; i < iovcnt; i++)
+	    total += iov[i].iov_len;
+
+	if (req->ssl_bulk_end + total > req->ssl_bulk_size) {
+	    size = req->ssl_bulk_end + total + IO_BUFFER_SIZE / 4;
+	    p = realloc(req->ssl_bulk, size);
+	    if (p == NULL) {
+		errno = ENOMEM;
+		return -1;
+	    }
+	    req->ssl_bulk = p;
+	    req->ssl_bulk_size = size;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+	    memcpy(req->ssl_bulk + req->ssl_bulk_end, iov[i].iov_base, iov[i].iov_len);
+	    req->ssl_bulk_end += iov[i].iov_len;
+	}
+
+	return total;
+}
+
+/* Encrypts buf into records, in req->ssl_bulk.
+ */
+static ssize_t ssl_bulk_encrypt( request* req, const char* buf, size_t buf_size)
+{
+gnutls_transport_ptr_t fd = (gnutls_transport_ptr_t)(long) req->fd;
+ssize_t bytes = 0;
+size_t record_size, total;
+int small;
+
+	/* redirected only while the records of buf are made */
+	gnutls_transport_set_vec_push_function(req->ssl_state, ssl_bulk_push);
+	gnutls_transport_set_ptr2(req->ssl_state, fd, req);
+
+	for (total = 0; total < buf_size; total += bytes) {
+	    /* the size chosen, not the last (shorter) record */
+	    record_size = ssl_record_size( req);
+	    small = (record_size == SSL_SMALL_RECORD_SIZE);
+	    if (record_size > buf_size - total)
+		record_size = buf_size - total;
+
+	    bytes = gnutls_record_send(req->ssl_state, buf + total, record_size);
+	    if (bytes < 0)
+		break;
+
+	    if (small)
+		req->ssl_record_bytes += bytes;
+	}
+
+	gnutls_transport_set_ptr2(req->ssl_state, fd, fd);
+	gnutls_transport_set_vec_push_function(req->ssl_state, ssl_writev);
+
+	if (bytes < 0) {
+	    log_error_doc(req);
+	    fprintf(stderr, "TLS sending error \"%s\"\n", gnutls_strerror( bytes));
+	    req->ssl_bulk_start = req->ssl_bulk_end = 0;
+	    return BOA_E_UNKNOWN;
+	}
+
+	req->ssl_bulk_start = 0;
+	req->ssl_bulk_plain = total;
+	return total;
+}
+
+#endif
+
+/*
+ * Name: socket_send_bulk
+ * Description: Sends a chunk of a large file, as socket_send() does.
+ * In TLS connections, the whole chunk is encrypted at once, and its
+ * records are written with a single send(). If that blocks, the
+ * caller must call again with the same data, as with
+ * gnutls_record_send().
+ *
+ * Returns: the bytes of buf sent, or a BOA_E_* error.
+ */
+ssize_t socket_send_bulk( request* req, const void* buf, size_t buf_size)
+{
+#ifdef ENABLE_SSL_BULK
+ssize_t bytes;
+
+	if ( !req->secure || req->ktls_send)
+	    return socket_send( req, buf, buf_size);
+
+	if (req->ssl_bulk_end == 0) {
+	    bytes = ssl_bulk_encrypt( req, buf, buf_size);
+	    if (bytes < 0)
+		return bytes;
+	}
+
+	while (req->ssl_bulk_start < req->ssl_bulk_end) {
+	    bytes = send(req->fd, req->ssl_bulk + req->ssl_bulk_start,
+			 req->ssl_bulk_end - req->ssl_bulk_start, MSG_NOSIGNAL);
+
+	    if (bytes == -1) {
+		if (errno == EINTR)
+		    continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)	/* request blocked */
+		    return BOA_E_AGAIN;
+		if (errno == EPIPE)
+		    return BOA_E_PIPE;
+
+		log_error_doc(req);
+		perror("bulk send");	/* don't need to save errno because log_error_doc does */
+		return BOA_E_UNKNOWN;
+	    }
+
+	    req->ssl_bulk_start += bytes;
+	}
+
+	req->ssl_bulk_start = req->ssl_bulk_end = 0;
+	return req->ssl_bulk_plain;
+#else
+	return socket_send( req, buf, buf_size);
+#endif
+}
+
 #ifdef HAVE_TCP_CORK
 void socket_flush( int fd)
 {
@@ -124,6 +359,129 @@ void socket_flush( int fd)
 }
 #endif
 
+/* Zero copy sends. With MSG_ZEROCOPY the kernel sends the pages of
+ * the mapped file, instead of copying them to the socket buffer. The
+ * pages must not change until the kernel is done with them, which is
+ * reported on the error queue of the socket. Each send is numbered
+ * (per socket) and req->zerocopy_done counts the completed ones.
+ */
+#ifdef USE_MSG_ZEROCOPY
+
+/* Returns 1 if MSG_ZEROCOPY can be used on the connection of req.
+ */
+int socket_zerocopy( request* req)
+{
+int one = 1;
+
+	if (req->secure)
+	    return 0;
+
+	if (setsockopt(req->fd, SOL_SOCKET, SO_ZEROCOPY,
+		       (void *) &one, sizeof (one)) == -1)
+	    return 0;
+
+	return 1;
+}
+
+ssize_t socket_sendv_zerocopy( request* req, const struct iovec* iov, int iovcnt)
+{
+struct msghdr msg;
+ssize_t bytes;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+
+	bytes = sendmsg(req->fd, &msg, MSG_ZEROCOPY);
+
+	if (bytes == -1) {
+	    if (errno == ENOBUFS)	/* too many pending; copy this time */
+		return socket_sendv( req, iov, iovcnt);
+	    if (errno == EINTR)
+		return BOA_E_INTR;
+	    if (errno == EPIPE)
+		return BOA_E_PIPE;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)	/* request blocked */
+		return BOA_E_AGAIN;
+
+	    log_error_doc(req);
+	    perror("sendmsg");	/* don't need to save errno because log_error_doc does */
+	    return BOA_E_UNKNOWN;
+	}
+
+	req->zerocopy_sends++;
+	return bytes;
+}
+
+/* Reads the completions of zero copy sends from the error queue.
+ *
+ * Returns: 1 if all the sends are complete, 0 if some are pending,
+ * or -1 on error.
+ */
+int socket_zerocopy_complete( request* req)
+{
+struct msghdr msg;
+struct cmsghdr *cm;
+struct sock_extended_err *serr;
+char control[128];
+
+	while (req->zerocopy_done != req->zerocopy_sends) {
+	    memset(&msg, 0, sizeof(msg));
+	    msg.msg_control = control;
+	    msg.msg_controllen = sizeof(control);
+
+	    /* this never blocks */
+	    if (recvmsg(req->fd, &msg, MSG_ERRQUEUE) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		    return 0;
+		if (errno == EINTR)
+		    continue;
+		return -1;
+	    }
+
+	    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+		    !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+		    continue;
+
+		serr = (struct sock_extended_err *) CMSG_DATA(cm);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+		    continue;
+
+		/* the sends ee_info to ee_data are complete */
+		if ((int) (serr->ee_data + 1 - req->zerocopy_done) > 0)
+		    req->zerocopy_done = serr->ee_data + 1;
+
+		/* The kernel copied the data anyway (ie. the loopback
+		 * device). Copying them ourselves is cheaper.
+		 */
+		if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+		    req->zerocopy = 0;
+	    }
+	}
+
+	return 1;
+}
+
+#else
+
+int socket_zerocopy( request* req)
+{
+	return 0;
+}
+
+ssize_t socket_sendv_zerocopy( request* req, const struct iovec* iov, int iovcnt)
+{
+	return socket_sendv( req, iov, iovcnt);
+}
+
+int socket_zerocopy_complete( request* req)
+{
+	return 1;
+}
+
+#endif /* USE_MSG_ZEROCOPY */
+
 void socket_set_options( int fd) {
 #ifdef HAVE_TCP_CORK /* Linux */
 int one = 1;
@@ -1,5 +1,10 @@
 ssize_t socket_recv( request* req, void* buf, size_t buf_size);
 ssize_t socket_send( request* req, const void* buf, size_t buf_size);
+ssize_t socket_sendv( request* req, const struct iovec* iov, int iovcnt);
+ssize_t socket_send_bulk( request* req, const void* buf, size_t buf_size);
+int socket_zerocopy( request* req);
+ssize_t socket_sendv_zerocopy( request* req, const struct iovec* iov, int iovcnt);
+int socket_zerocopy_complete( request* req);
 void socket_set_options( int fd);
 
 #ifdef HAVE_TCP_CORK
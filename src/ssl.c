@@ -30,20 +30,26 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #include <gcrypt.h>
+#include <signal.h>
 #ifdef ENABLE_SMP
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
-
-pthread_mutex_t ssl_session_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 extern int ssl_session_cache;
+extern char *ssl_session_cache_file;
 extern int ssl_session_timeout;
 
+extern char *ca_cert;
+extern char *server_cert;
+extern char *server_key;
+
 extern char* ssl_ciphers;
 extern char* ssl_kx;
+extern char* ssl_curves;
 extern char* ssl_mac;
 extern char* ssl_comp;
 extern char* ssl_protocol;
+extern char* ssl_priority;
 extern int ssl_verify; /* 0 no verify, 1 request certificate, and validate
                         * if sent, 2 require certificate and validate.
                         * 3 is request one, and try to verify it. Does not fail in
@@ -63,21 +69,154 @@ static int need_dh_params = 0; /* whether we need to generate DHE
  */
 static int need_rsa_params = 0;
 
+/* Session tickets (RFC 5077) let the clients keep their session state,
+ * encrypted with a key of ours, so that any server that has the key
+ * can resume the session. There are two keys: the current one, and
+ * the previous one, which is not freed before the next rotation
+ * since sessions may still use it.
+ */
+#if defined(GNUTLS_VERSION_NUMBER) && GNUTLS_VERSION_NUMBER >= 0x020a00
+# define ENABLE_SESSION_TICKETS
+#endif
+
+#define SSL_TICKET_KEY_SIZE 64
+
+/* Kernel TLS. If ktls is enabled in the gnutls configuration, and
+ * the tls module is loaded, gnutls gives the keys to the kernel at
+ * the end of the handshake. The kernel makes the records of what is
+ * written to the socket then, thus sendfile() and writev() can be
+ * used as in plain connections.
+ */
+#if defined(GNUTLS_VERSION_NUMBER) && GNUTLS_VERSION_NUMBER >= 0x030703 && \
+    defined(HAVE_SENDFILE)
+# include <gnutls/socket.h>
+# define ENABLE_KTLS
+#endif
+
+extern char *ssl_ticket_key_file;
+
+/* The certificates of the virtual hosts (SSLVirtualHostCertificate),
+ * chosen by the name that the client asks for (SNI). They are read
+ * when first needed (without the lock), and kept in a hash table by
+ * hostname. After a SIGHUP they are read again. A certificate is held
+ * by the sessions that use it, and is freed with the last of them
+ * (see ssl_session_done()).
+ */
+#if defined(GNUTLS_VERSION_NUMBER) && GNUTLS_VERSION_NUMBER >= 0x020a00
+# define ENABLE_SNI
+#endif
+
+#ifdef ENABLE_SNI
+struct sni_certificate {
+    gnutls_certificate_credentials credentials;
+    int use_count;			/* the table, and the sessions */
+};
+
+struct sni_credentials {
+    char *host;
+    int generation;			/* of the configuration */
+    struct sni_certificate *cert;
+    struct sni_credentials *next;
+};
+
+static struct sni_credentials *sni_hashtable[VIRTHOST_HASHTABLE_SIZE];
+static int sni_generation = 0;
+#ifdef ENABLE_SMP
+static pthread_mutex_t sni_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#endif
+
+#ifdef ENABLE_SESSION_TICKETS
+static int cur_ticket = 0;
+static gnutls_datum ticket_keys[2] = { { NULL, 0 }, { NULL, 0 } };
+#endif
+
 
 /* we use primes up to 1024 in this server.
  * otherwise we should add them here.
  */
 extern int ssl_dh_bits;
+extern char *ssl_dh_params_file;
+extern char *ssl_rsa_params_file;
 
 gnutls_dh_params _dh_params[2];
 gnutls_rsa_params _rsa_params[2];
 
+#ifdef ENABLE_SMP
+/* cur is changed under this lock, when new parameters are ready */
+static pthread_mutex_t params_lock = PTHREAD_MUTEX_INITIALIZER;
+static int regenerating = 0;
+#endif
+
+/* Reads the whole (PEM) file into data, which has to be freed.
+ */
+static int read_params_file(const char *file, gnutls_datum * data)
+{
+    struct stat st;
+    int fd, ret;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1) {
+	log_error_time();
+	perror(file);
+	return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0 ||
+	(data->data = malloc(st.st_size)) == NULL) {
+	log_error_time();
+	fprintf(stderr, "tls: Could not read '%s'.\n", file);
+	close(fd);
+	return -1;
+    }
+
+    ret = read(fd, data->data, st.st_size);
+    close(fd);
+    if (ret != st.st_size) {
+	log_error_time();
+	fprintf(stderr, "tls: Could not read '%s'.\n", file);
+	free(data->data);
+	return -1;
+    }
+    data->size = st.st_size;
+
+    return 0;
+}
+
 static int generate_dh_primes( gnutls_dh_params* dh_params)
 {
+    gnutls_datum data;
+    int ret;
+
     if (gnutls_dh_params_init( dh_params) < 0) {
         log_error_time();
 	fprintf(stderr, "tls: Error in dh parameter initialization\n");
-	exit(1);
+	return -1;
+    }
+
+    /* Precomputed parameters (PKCS #3, as "certtool
+     * --generate-dh-params" writes them) are read again every time.
+     */
+    if (ssl_dh_params_file != NULL) {
+	if (read_params_file( ssl_dh_params_file, &data) < 0) {
+	    gnutls_dh_params_deinit( *dh_params);
+	    return -1;
+	}
+	ret = gnutls_dh_params_import_pkcs3( *dh_params, &data,
+					     GNUTLS_X509_FMT_PEM);
+	free(data.data);
+	if (ret < 0) {
+	    log_error_time();
+	    fprintf(stderr, "tls: Could not import the DH parameters of '%s'.\n",
+		    ssl_dh_params_file);
+	    gnutls_dh_params_deinit( *dh_params);
+	    return -1;
+	}
+
+	log_error_time();
+	fprintf(stderr, "tls: Loaded Diffie Hellman parameters from '%s'.\n",
+		ssl_dh_params_file);
+	return 0;
     }
 
     /* Generate Diffie Hellman parameters - for use with DHE
@@ -89,7 +228,8 @@ static int generate_dh_primes( gnutls_dh_params* dh_params)
      if (gnutls_dh_params_generate2( *dh_params, ssl_dh_bits) < 0) {
 	    log_error_time();
 	    fprintf(stderr, "tls: Error in prime generation\n");
-	    exit(1);
+	    gnutls_dh_params_deinit( *dh_params);
+	    return -1;
      }
 
      log_error_time();
@@ -103,10 +243,36 @@ static int generate_dh_primes( gnutls_dh_params* dh_params)
 
 static int generate_rsa_params( gnutls_rsa_params* rsa_params)
 {
+    gnutls_datum data;
+    int ret;
+
     if (gnutls_rsa_params_init( rsa_params) < 0) {
 	log_error_time();
 	fprintf(stderr, "tls: Error in rsa parameter initialization\n");
-	exit(1);
+	return -1;
+    }
+
+    /* a precomputed (PKCS #1) RSA key */
+    if (ssl_rsa_params_file != NULL) {
+	if (read_params_file( ssl_rsa_params_file, &data) < 0) {
+	    gnutls_rsa_params_deinit( *rsa_params);
+	    return -1;
+	}
+	ret = gnutls_rsa_params_import_pkcs1( *rsa_params, &data,
+					      GNUTLS_X509_FMT_PEM);
+	free(data.data);
+	if (ret < 0) {
+	    log_error_time();
+	    fprintf(stderr, "tls: Could not import the RSA parameters of '%s'.\n",
+		    ssl_rsa_params_file);
+	    gnutls_rsa_params_deinit( *rsa_params);
+	    return -1;
+	}
+
+	log_error_time();
+	fprintf(stderr, "tls: Loaded temporary RSA parameters from '%s'.\n",
+		ssl_rsa_params_file);
+	return 0;
     }
 
     /* Generate RSA parameters - for use with RSA-export
@@ -118,7 +284,8 @@ static int generate_rsa_params( gnutls_rsa_params* rsa_params)
     if (gnutls_rsa_params_generate2( *rsa_params, 512) < 0) {
 	log_error_time();
 	fprintf(stderr, "tls: Error in rsa parameter generation\n");
-	exit(1);
+	gnutls_rsa_params_deinit( *rsa_params);
+	return -1;
     }
 
     log_error_time();
@@ -128,38 +295,419 @@ static int generate_rsa_params( gnutls_rsa_params* rsa_params)
     return 0;
 }
 
-static int protocol_priority[16];
-static int kx_priority[16];
-static int cipher_priority[16];
-static int mac_priority[16];
-static int comp_priority[16];
+/* The algorithms are given to gnutls as a priority string, built
+ * from SSLProtocols, SSLCiphers, SSLKeyExchangeAlgorithms, SSLCurves,
+ * SSLMACAlgorithms and SSLCompressionMethods (in the order they are
+ * listed), unless SSLPriority gives the whole string. The previous
+ * priority cache is not freed before the next one is made, since
+ * sessions may still use it.
+ */
+#define SSL_DEFAULT_PROTOCOLS "TLS1.3, TLS1.2, TLS1.1, TLS1.0"
+#define SSL_DEFAULT_CIPHERS "AES-128-GCM, CHACHA20-POLY1305, AES-256-GCM, AES"
+#define SSL_DEFAULT_KX "ECDHE-RSA, RSA"
+#define SSL_DEFAULT_CURVES "X25519, P-256"
+#define SSL_DEFAULT_MACS "SHA1, SHA256"
+#define SSL_DEFAULT_COMP "NULL"
+
+#define NEED_DH 1
+#define NEED_RSA 2
+#define NEED_AEAD 4
+
+struct priority_name {
+    const char *name;		/* in the configuration file */
+    const char *priority;	/* in the gnutls priority string */
+    int needs;
+};
+
+static const struct priority_name protocol_names[] = {
+    { "TLS1.3", "VERS-TLS1.3", 0 },
+    { "TLS1.2", "VERS-TLS1.2", 0 },
+    { "TLS1.1", "VERS-TLS1.1", 0 },
+    { "TLS1.0", "VERS-TLS1.0", 0 },
+    { "SSL3.0", "VERS-SSL3.0", 0 },
+    { NULL, NULL, 0 }
+};
+
+static const struct priority_name cipher_names[] = {
+    { "AES-128-GCM", "AES-128-GCM", NEED_AEAD },
+    { "AES-256-GCM", "AES-256-GCM", NEED_AEAD },
+    { "CHACHA20-POLY1305", "CHACHA20-POLY1305", NEED_AEAD },
+    { "AES", "AES-128-CBC", 0 },
+    { "AES-256", "AES-256-CBC", 0 },
+    { "3DES", "3DES-CBC", 0 },
+    { "ARCFOUR-128", "ARCFOUR-128", 0 },
+    { "ARCFOUR-40", "ARCFOUR-40", 0 },
+    { NULL, NULL, 0 }
+};
+
+static const struct priority_name kx_names[] = {
+    { "ECDHE-RSA", "ECDHE-RSA", 0 },
+    { "ECDHE-ECDSA", "ECDHE-ECDSA", 0 },
+    { "RSA", "RSA", 0 },
+    { "DHE-RSA", "DHE-RSA", NEED_DH },
+    { "DHE-DSS", "DHE-DSS", NEED_DH },
+    { "RSA-EXPORT", "RSA-EXPORT", NEED_RSA },
+    { NULL, NULL, 0 }
+};
+
+static const struct priority_name curve_names[] = {
+    { "X25519", "CURVE-X25519", 0 },
+    { "P-256", "CURVE-SECP256R1", 0 },
+    { "P-384", "CURVE-SECP384R1", 0 },
+    { NULL, NULL, 0 }
+};
+
+static const struct priority_name mac_names[] = {
+    { "SHA1", "SHA1", 0 },
+    { "SHA256", "SHA256", 0 },
+    { "MD5", "MD5", 0 },
+    { "RMD160", "RMD160", 0 },
+    { NULL, NULL, 0 }
+};
+
+static const struct priority_name comp_names[] = {
+    { "NULL", "COMP-NULL", 0 },
+    { "ZLIB", "COMP-DEFLATE", 0 },
+    { NULL, NULL, 0 }
+};
+
+static int cur_priority = 0;
+static gnutls_priority_t priorities[2] = { NULL, NULL };
+
+/* Appends ":+ALGORITHM" to buf, for each of the comma separated
+ * names in list (or in default_list, if it is NULL), and returns
+ * the NEED_* flags of them.
+ */
+static int add_priorities(char *buf, int size, const char *directive,
+			  const char *list, const char *default_list,
+			  const struct priority_name *names)
+{
+    const char *p;
+    int len, i, needs = 0;
+
+    if (list == NULL)
+	list = default_list;
+
+    for (p = list; *p != 0; p += len) {
+	p += strspn(p, ", ");
+	len = strcspn(p, ", ");
+	if (len == 0)
+	    break;
+
+	for (i = 0; names[i].name != NULL; i++)
+	    if (strlen(names[i].name) == len &&
+		strncasecmp(names[i].name, p, len) == 0)
+		break;
+
+	if (names[i].name == NULL) {
+	    log_error_time();
+	    fprintf(stderr, "tls: Unknown algorithm '%.*s' in %s.\n",
+		    len, p, directive);
+	    continue;
+	}
+
+	if (strlen(buf) + strlen(names[i].priority) + 2 < size) {
+	    strcat(buf, ":+");
+	    strcat(buf, names[i].priority);
+	    needs |= names[i].needs;
+	}
+    }
+
+    return needs;
+}
 
-/* Parses a string in the form:
- * CIPHER1, CIPHER2, ... and tries to find the given algorithm.
- * This is inefficient. Returns true or false.
+/* Makes the priority cache of the configured algorithms the current
+ * one, and sets need_dh_params and need_rsa_params.
+ *
+ * Returns: 0, or -1 if gnutls did not accept the priorities.
  */
-static int parse_cs_string( const char* string, const char* algo)
-{
-char *broken_list[MAX_COMMA_SEP_ELEMENTS];
-int broken_list_size, i;
-char list[64];
-
-	if (string == NULL || algo == NULL) return 0;
-	
-	if (strlen( string) > sizeof(list)-1) return 0;
-
-	strcpy( list, string);
-	
-	break_comma_list( list, broken_list, &broken_list_size);
-	
-	for (i=0;i<broken_list_size;i++) {
-  	   if (strcmp( broken_list[i], algo) == 0) {
-		return 1;
-           }
+static int set_priorities(void)
+{
+    char buf[512];
+    const char *err;
+    gnutls_priority_t prio;
+    int ret, len, needs = 0, _cur = (cur_priority + 1) % 2;
+    /* the room left for ":+AEAD:+SIGN-ALL", appended below */
+    int size = sizeof(buf) - sizeof(":+AEAD:+SIGN-ALL");
+
+    if (ssl_priority != NULL) {
+	/* the DH parameters are there, in case it uses DHE */
+	strncpy(buf, ssl_priority, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	needs = NEED_DH;
+	if (strstr(ssl_priority, "RSA-EXPORT") != NULL)
+	    needs |= NEED_RSA;
+    } else {
+	strcpy(buf, "NONE");
+	add_priorities(buf, size, "SSLProtocols", ssl_protocol,
+		       SSL_DEFAULT_PROTOCOLS, protocol_names);
+	needs |= add_priorities(buf, size, "SSLCiphers", ssl_ciphers,
+				SSL_DEFAULT_CIPHERS, cipher_names);
+	needs |= add_priorities(buf, size, "SSLKeyExchangeAlgorithms",
+				ssl_kx, SSL_DEFAULT_KX, kx_names);
+	add_priorities(buf, size, "SSLCurves", ssl_curves,
+		       SSL_DEFAULT_CURVES, curve_names);
+	add_priorities(buf, size, "SSLMACAlgorithms", ssl_mac,
+		       SSL_DEFAULT_MACS, mac_names);
+	add_priorities(buf, size, "SSLCompressionMethods", ssl_comp,
+		       SSL_DEFAULT_COMP, comp_names);
+
+	/* the AEAD ciphers have no separate MAC */
+	if (needs & NEED_AEAD)
+	    strcat(buf, ":+AEAD");
+	strcat(buf, ":+SIGN-ALL");
+    }
+
+    while ((ret = gnutls_priority_init( &prio, buf, &err)) < 0) {
+	/* leave out the algorithms that this gnutls does not know */
+	if (ssl_priority == NULL && err != NULL && err > buf &&
+	    err[-1] == ':' && err[0] == '+') {
+	    len = strcspn(err, ":");
+	    log_error_time();
+	    fprintf(stderr, "tls: %.*s is not supported by this GnuTLS.\n",
+		    len - 1, err + 1);
+	    memmove((char *) err - 1, err + len, strlen(err + len) + 1);
+	    continue;
 	}
-		
-	return 0;
 
+	log_error_time();
+	fprintf(stderr, "tls: Invalid priorities '%s': %s.\n", buf,
+		gnutls_strerror(ret));
+	return -1;
+    }
+
+    /* the previous one is freed now */
+    if (priorities[ _cur] != NULL)
+	gnutls_priority_deinit( priorities[ _cur]);
+    priorities[ _cur] = prio;
+    cur_priority = _cur;
+
+    need_dh_params = (needs & NEED_DH) ? 1 : 0;
+    need_rsa_params = (needs & NEED_RSA) ? 1 : 0;
+
+    return 0;
+}
+
+#ifdef ENABLE_SNI
+
+/* Reads the certificate and key of a virtual host.
+ * Returns: the credentials, or NULL on error (which is logged).
+ */
+static gnutls_certificate_credentials load_vhost_credentials(virthost * vhost)
+{
+    gnutls_certificate_credentials c;
+
+    if (gnutls_certificate_allocate_credentials( &c) < 0) {
+	log_error_time();
+	fprintf(stderr, "tls: certificate allocation error\n");
+	return NULL;
+    }
+
+    if (gnutls_certificate_set_x509_key_file
+	( c, vhost->ssl_cert, vhost->ssl_key, GNUTLS_X509_FMT_PEM) < 0) {
+	log_error_time();
+	fprintf(stderr, "tls: could not find '%s' or '%s' (for %s).\n",
+		vhost->ssl_cert, vhost->ssl_key, vhost->host);
+	gnutls_certificate_free_credentials( c);
+	return NULL;
+    }
+
+    if (ca_cert != NULL && gnutls_certificate_set_x509_trust_file
+	( c, ca_cert, GNUTLS_X509_FMT_PEM) < 0) {
+	log_error_time();
+	fprintf(stderr, "tls: could not find '%s'.\n", ca_cert);
+	gnutls_certificate_free_credentials( c);
+	return NULL;
+    }
+
+    if (need_rsa_params)
+	gnutls_certificate_set_rsa_export_params( c, _rsa_params[ cur]);
+    if (need_dh_params)
+	gnutls_certificate_set_dh_params( c, _dh_params[ cur]);
+
+    log_error_time();
+    fprintf(stderr, "tls: Loaded the certificate of %s.\n", vhost->host);
+
+    return c;
+}
+
+/* Gives back a hold on cert.
+ * No locking here. The caller has to do the proper locking.
+ *
+ * Returns: cert, if it should be freed (once the lock is released),
+ * or NULL.
+ */
+static struct sni_certificate *release_sni_certificate(struct sni_certificate *cert)
+{
+    if (--cert->use_count > 0)
+	return NULL;
+    return cert;
+}
+
+static void free_sni_certificate(struct sni_certificate *cert)
+{
+    if (cert == NULL)
+	return;
+    gnutls_certificate_free_credentials( cert->credentials);
+    free(cert);
+}
+
+/* Returns the certificate of the virtual host name, held once, or NULL
+ * if the default certificate should be used.
+ */
+static struct sni_certificate *find_sni_credentials(const char *name)
+{
+    struct sni_credentials *e;
+    struct sni_certificate *cert, *old = NULL;
+    gnutls_certificate_credentials c;
+    virthost *vhost;
+    int hash;
+
+    vhost = find_virthost(name, 0);
+    if (vhost == NULL || vhost->ssl_cert == NULL)
+	return NULL;
+
+    hash = get_host_hash_value(vhost->host);
+
+#ifdef ENABLE_SMP
+    pthread_mutex_lock( &sni_lock);
+#endif
+    for (e = sni_hashtable[hash]; e != NULL; e = e->next)
+	if (strcmp(e->host, vhost->host) == 0)
+	    break;
+
+    if (e == NULL) {
+	e = calloc(1, sizeof(struct sni_credentials));
+	if (e == NULL || (e->host = strdup(vhost->host)) == NULL) {
+	    free(e);
+#ifdef ENABLE_SMP
+	    pthread_mutex_unlock( &sni_lock);
+#endif
+	    return NULL;
+	}
+	e->generation = sni_generation - 1;
+	e->next = sni_hashtable[hash];
+	sni_hashtable[hash] = e;
+    }
+
+    if (e->generation != sni_generation) {
+	/* the first handshake for this host, since the configuration
+	 * was read. The other handshakes use the old certificate (or
+	 * the default) while it is read. If it cannot be read, it is
+	 * not tried again.
+	 */
+	e->generation = sni_generation;
+#ifdef ENABLE_SMP
+	pthread_mutex_unlock( &sni_lock);
+#endif
+	c = load_vhost_credentials(vhost);
+	cert = NULL;
+	if (c != NULL) {
+	    cert = calloc(1, sizeof(struct sni_certificate));
+	    if (cert == NULL)
+		gnutls_certificate_free_credentials( c);
+	    else {
+		cert->credentials = c;
+		cert->use_count = 1;
+	    }
+	}
+#ifdef ENABLE_SMP
+	pthread_mutex_lock( &sni_lock);
+#endif
+	if (cert != NULL) {
+	    if (e->cert != NULL)
+		old = release_sni_certificate(e->cert);
+	    e->cert = cert;
+	}
+    }
+    cert = e->cert;
+    if (cert != NULL)
+	cert->use_count++;
+#ifdef ENABLE_SMP
+    pthread_mutex_unlock( &sni_lock);
+#endif
+    free_sni_certificate(old);
+
+    return cert;
+}
+
+/* Called by gnutls once the client hello was read. Sets the
+ * certificate of the server name that the client asked for.
+ */
+static int sni_callback(gnutls_session state)
+{
+    char name[MAX_SITENAME_LENGTH];
+    size_t size = sizeof(name);
+    unsigned int type;
+    struct sni_certificate *cert;
+
+    if (gnutls_server_name_get( state, name, &size, &type, 0) < 0 ||
+	type != GNUTLS_NAME_DNS)
+	return 0;		/* no name, the default certificate */
+
+    cert = find_sni_credentials(name);
+    if (cert != NULL) {
+	ssl_session_done( state);	/* a renegotiation */
+	gnutls_credentials_set( state, GNUTLS_CRD_CERTIFICATE, cert->credentials);
+	gnutls_session_set_ptr( state, cert);
+    }
+
+    return 0;
+}
+
+/* Sets the current RSA and DH parameters to the certificates of the
+ * virtual hosts. Called when they were regenerated.
+ */
+static void set_sni_params(void)
+{
+    struct sni_credentials *e;
+    int i;
+
+#ifdef ENABLE_SMP
+    pthread_mutex_lock( &sni_lock);
+#endif
+    for (i = 0; i < VIRTHOST_HASHTABLE_SIZE; i++) {
+	for (e = sni_hashtable[i]; e != NULL; e = e->next) {
+	    if (e->cert == NULL)
+		continue;
+	    if (need_rsa_params)
+		gnutls_certificate_set_rsa_export_params( e->cert->credentials,
+		    _rsa_params[ cur]);
+	    if (need_dh_params)
+		gnutls_certificate_set_dh_params( e->cert->credentials,
+		    _dh_params[ cur]);
+	}
+    }
+#ifdef ENABLE_SMP
+    pthread_mutex_unlock( &sni_lock);
+#endif
+}
+
+#endif /* ENABLE_SNI */
+
+/*
+ * Name: ssl_session_done
+ * Description: Gives back the certificate of the virtual host that
+ * the session used. Called before the session is deinitialized.
+ */
+void ssl_session_done(gnutls_session state)
+{
+#ifdef ENABLE_SNI
+    struct sni_certificate *cert = gnutls_session_get_ptr( state);
+
+    if (cert == NULL)
+	return;
+    gnutls_session_set_ptr( state, NULL);
+
+#ifdef ENABLE_SMP
+    pthread_mutex_lock( &sni_lock);
+#endif
+    cert = release_sni_certificate(cert);
+#ifdef ENABLE_SMP
+    pthread_mutex_unlock( &sni_lock);
+#endif
+    free_sni_certificate(cert);
+#endif
 }
 
 /* Initializes a single SSL/TLS session. That is set the algorithm,
@@ -171,13 +719,15 @@ gnutls_session initialize_ssl_session(void)
     
     gnutls_init(&state, GNUTLS_SERVER);
 
-    gnutls_cipher_set_priority(state, cipher_priority);
-    gnutls_compression_set_priority(state, comp_priority);
-    gnutls_kx_set_priority(state, kx_priority);
-    gnutls_protocol_set_priority(state, protocol_priority);
-    gnutls_mac_set_priority(state, mac_priority);
+    gnutls_priority_set(state, priorities[ cur_priority]);
 
+#ifdef ENABLE_SMP
+    pthread_mutex_lock( &params_lock);
+#endif
     gnutls_credentials_set(state, GNUTLS_CRD_CERTIFICATE, credentials[ cur]);
+#ifdef ENABLE_SMP
+    pthread_mutex_unlock( &params_lock);
+#endif
 
     gnutls_certificate_server_set_request(state, GNUTLS_CERT_IGNORE);
 
@@ -189,6 +739,15 @@ gnutls_session initialize_ssl_session(void)
     }
     gnutls_db_set_cache_expiration( state, ssl_session_timeout);
 
+#ifdef ENABLE_SNI
+    gnutls_handshake_set_post_client_hello_function( state, sni_callback);
+#endif
+
+#ifdef ENABLE_SESSION_TICKETS
+    if (ticket_keys[ cur_ticket].data != NULL)
+	gnutls_session_ticket_enable_server( state, &ticket_keys[ cur_ticket]);
+#endif
+
     /* gnutls_handshake_set_private_extensions( state, 1); */
 
     if (ssl_verify == 1 || ssl_verify == 3) {
@@ -203,16 +762,10 @@ gnutls_session initialize_ssl_session(void)
     return state;
 }
 
-extern char *ca_cert;
-extern char *server_cert;
-extern char *server_key;
-
 /* Initialization of gnutls' global state
  */
 int initialize_ssl(void)
 {
-    int i;
-
     log_error_time();
     fprintf(stderr, "tls: Initializing GnuTLS/%s.\n", gnutls_check_version(NULL));
 #ifdef ENABLE_SMP
@@ -244,80 +797,23 @@ int initialize_ssl(void)
     if (ssl_session_cache != 0)
 	wrap_db_init();
 
-    /* Add ciphers 
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_ciphers, "AES") != 0)
-    	cipher_priority[i++] = GNUTLS_CIPHER_RIJNDAEL_128_CBC;
-    if ( parse_cs_string( ssl_ciphers, "ARCFOUR-128") != 0)
-    	cipher_priority[i++] = GNUTLS_CIPHER_ARCFOUR_128;
-    if ( parse_cs_string( ssl_ciphers, "3DES") != 0)
-    	cipher_priority[i++] = GNUTLS_CIPHER_3DES_CBC;
-    if ( parse_cs_string( ssl_ciphers, "ARCFOUR-40") != 0)
-    	cipher_priority[i++] = GNUTLS_CIPHER_ARCFOUR_40;
-    cipher_priority[i] = 0;
-
-    /* Add key exchange methods
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_kx, "RSA") != 0)
-    	kx_priority[i++] = GNUTLS_KX_RSA;
-    if ( parse_cs_string( ssl_kx, "RSA-EXPORT") != 0) {
-    	kx_priority[i++] = GNUTLS_KX_RSA_EXPORT;
-    	need_rsa_params = 1;
-    }
-    if ( parse_cs_string( ssl_kx, "DHE-RSA") != 0) {
-    	kx_priority[i++] = GNUTLS_KX_DHE_RSA;
-    	need_dh_params = 1; /* generate DH parameters */
-    }
-    if ( parse_cs_string( ssl_kx, "DHE-DSS") != 0) {
-    	kx_priority[i++] = GNUTLS_KX_DHE_DSS;
-    	need_dh_params = 1;
-    }
-    kx_priority[i] = 0;
+    if (ssl_session_tickets != 0 && ssl_rotate_ticket_key() < 0)
+	exit(1);
 
-    /* Add MAC Algorithms
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_mac, "MD5") != 0)
-    	mac_priority[i++] = GNUTLS_MAC_MD5;
-    if ( parse_cs_string( ssl_mac, "SHA1") != 0)
-    	mac_priority[i++] = GNUTLS_MAC_SHA;
-    if ( parse_cs_string( ssl_mac, "RMD160") != 0)
-    	mac_priority[i++] = GNUTLS_MAC_RMD160;
-    mac_priority[i] = 0;
-
-    /* Add Compression algorithms
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_comp, "NULL") != 0)
-    	comp_priority[i++] = GNUTLS_COMP_NULL;
-    if ( parse_cs_string( ssl_comp, "ZLIB") != 0)
-    	comp_priority[i++] = GNUTLS_COMP_ZLIB;
-    if ( parse_cs_string( ssl_comp, "LZO") != 0)
-    	comp_priority[i++] = GNUTLS_COMP_LZO;
-    comp_priority[i] = 0;
-
-    /* Add protocols
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_protocol, "TLS1.0") != 0)
-    	protocol_priority[i++] = GNUTLS_TLS1;
-    if ( parse_cs_string( ssl_protocol, "TLS1.1") != 0)
-    	protocol_priority[i++] = GNUTLS_TLS1_1;
-    if ( parse_cs_string( ssl_protocol, "SSL3.0") != 0)
-    	protocol_priority[i++] = GNUTLS_SSL3;
-    protocol_priority[i] = 0;
+    if (set_priorities() < 0)
+	exit(1);
 
     /* Generate temporary parameters -- if needed.
      */
     if (need_rsa_params) {
-    	generate_rsa_params( &_rsa_params[0]);
+    	if (generate_rsa_params( &_rsa_params[0]) < 0)
+	    exit(1);
 	gnutls_certificate_set_rsa_export_params(credentials[0], _rsa_params[0]);
     }
 
     if (need_dh_params) {
-	generate_dh_primes( &_dh_params[0]);
+	if (generate_dh_primes( &_dh_params[0]) < 0)
+	    exit(1);
 	gnutls_certificate_set_dh_params(credentials[0], _dh_params[0]);
     }
 
@@ -328,17 +824,11 @@ int initialize_ssl(void)
  * any need for downtime.
  */
 
-void ssl_regenerate_params(void)
+static void regenerate_params(void)
 {
-static int already_here; /* static so the default value == 0 */
 int _cur = (cur + 1) % 2;
-
-   /* There is a rare situation where we have been here, because of
-    * a SIGHUP signal, and the process receives a SIGALRM as well.
-    * We try to avoid messing everything up.
-    */
-   if (already_here != 0) return;
-   already_here = 1;
+gnutls_rsa_params rsa_params = NULL;
+gnutls_dh_params dh_params = NULL;
 
 /* The hint here, is that we keep a copy of 2 certificate credentials.
  * When we come here, we free the unused copy and allocate new
@@ -346,102 +836,420 @@ int _cur = (cur + 1) % 2;
  *
  * We don't free the previous copy because we don't know if anyone
  * is using it. (this has to be fixed)
+ *
+ * The new parameters are generated first, and the unused copy is
+ * only touched if that worked. Otherwise the current one is kept.
  */
 
-    time(&current_time);
+    if (need_rsa_params && generate_rsa_params( &rsa_params) < 0)
+	goto fail;
+
+    if (need_dh_params && generate_dh_primes( &dh_params) < 0)
+	goto fail;
 
     if ( !credentials[_cur]) {
        if (gnutls_certificate_allocate_credentials( &credentials[ _cur]) < 0) {
  	  log_error_time();
  	  fprintf(stderr, "tls: certificate allocation error\n");
-	  exit(1);
+	  goto fail;
        }
 
        if (gnutls_certificate_set_x509_key_file
   	   ( credentials[_cur], server_cert, server_key, GNUTLS_X509_FMT_PEM) < 0) {
 	   log_error_time();
-	   fprintf(stderr, "tls: could not find '%s' or '%s'.", server_cert,
+	   fprintf(stderr, "tls: could not find '%s' or '%s'.\n", server_cert,
 		server_key);
-	   exit(1);
+	   gnutls_certificate_free_credentials( credentials[ _cur]);
+	   credentials[ _cur] = NULL;
+	   goto fail;
        }
 
        if (ca_cert!=NULL && gnutls_certificate_set_x509_trust_file
    	  ( credentials[_cur], ca_cert, GNUTLS_X509_FMT_PEM) < 0) {
    	  log_error_time();
    	  fprintf(stderr, "tls: could not find '%s'.\n", ca_cert);
-   	  exit(1);
+	  gnutls_certificate_free_credentials( credentials[ _cur]);
+	  credentials[ _cur] = NULL;
+	  goto fail;
        }
     }
-    
+
     if (need_rsa_params) {
-	gnutls_rsa_params_deinit( _rsa_params[ _cur]);
-	generate_rsa_params( &_rsa_params[ _cur]);
+	if (_rsa_params[ _cur] != NULL)
+	    gnutls_rsa_params_deinit( _rsa_params[ _cur]);
+	_rsa_params[ _cur] = rsa_params;
         gnutls_certificate_set_rsa_export_params(credentials[_cur], _rsa_params[ _cur]);
     }
 
     if (need_dh_params) {
-	gnutls_dh_params_deinit( _dh_params[ _cur]);
-        generate_dh_primes( &_dh_params[ _cur]);
+	if (_dh_params[ _cur] != NULL)
+	    gnutls_dh_params_deinit( _dh_params[ _cur]);
+	_dh_params[ _cur] = dh_params;
         gnutls_certificate_set_dh_params(credentials[_cur], _dh_params[ _cur]);
     }
 
+#ifdef ENABLE_SMP
+    pthread_mutex_lock( &params_lock);
+#endif
     cur = _cur;
+#ifdef ENABLE_SMP
+    pthread_mutex_unlock( &params_lock);
+#endif
 
-    already_here = 0;
+#ifdef ENABLE_SNI
+    set_sni_params();
+#endif
     return;
+
+ fail:
+    if (rsa_params != NULL)
+	gnutls_rsa_params_deinit( rsa_params);
+    if (dh_params != NULL)
+	gnutls_dh_params_deinit( dh_params);
+    log_error_time();
+    fprintf(stderr, "tls: Keeping the current parameters.\n");
+}
+
+#ifdef ENABLE_SMP
+static void *regenerate_params_thread(void *arg)
+{
+    regenerate_params();
+
+    pthread_mutex_lock( &params_lock);
+    regenerating = 0;
+    pthread_mutex_unlock( &params_lock);
+
+    return NULL;
+}
+#endif
+
+/*
+ * Name: ssl_regenerate_params
+ * Description: Generates (or reads) new RSA and DH parameters. With
+ * threads, this is done by a thread of its own, since generating
+ * primes takes seconds; the new parameters are used as soon as they
+ * are ready. Called on SIGALRM and SIGHUP.
+ */
+void ssl_regenerate_params(void)
+{
+#ifdef ENABLE_SMP
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigset_t set, oldset;
+    int ret;
+
+    /* There is a rare situation where we have been here, because of
+     * a SIGHUP signal, and the process receives a SIGALRM as well.
+     * The parameters are already being regenerated then.
+     */
+    pthread_mutex_lock( &params_lock);
+    if (regenerating) {
+	pthread_mutex_unlock( &params_lock);
+	return;
+    }
+    regenerating = 1;
+    pthread_mutex_unlock( &params_lock);
+
+    /* the signals are handled by the server threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&tid, &attr, &regenerate_params_thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (ret != 0)		/* do it here, then */
+	regenerate_params_thread(NULL);
+#else
+    static int already_here; /* static so the default value == 0 */
+
+    if (already_here != 0) return;
+    already_here = 1;
+
+    time(&current_time);
+    regenerate_params();
+
+    already_here = 0;
+#endif
 }
 
+/* Reads the session ticket key from ssl_ticket_key_file, which
+ * holds SSL_TICKET_KEY_SIZE random bytes.
+ */
+#ifdef ENABLE_SESSION_TICKETS
+static int read_ticket_key(gnutls_datum * key)
+{
+    struct stat st;
+    int fd, ret;
+
+    fd = open(ssl_ticket_key_file, O_RDONLY);
+    if (fd == -1) {
+	log_error_time();
+	perror(ssl_ticket_key_file);
+	return -1;
+    }
 
-/* Session resuming: 
+    if (fstat(fd, &st) == -1 || st.st_size != SSL_TICKET_KEY_SIZE) {
+	log_error_time();
+	fprintf(stderr, "tls: '%s' should hold %d random bytes.\n",
+		ssl_ticket_key_file, SSL_TICKET_KEY_SIZE);
+	close(fd);
+	return -1;
+    }
+
+    key->data = gnutls_malloc(SSL_TICKET_KEY_SIZE);
+    if (key->data == NULL) {
+	close(fd);
+	return -1;
+    }
+
+    ret = read(fd, key->data, SSL_TICKET_KEY_SIZE);
+    close(fd);
+    if (ret != SSL_TICKET_KEY_SIZE) {
+	log_error_time();
+	fprintf(stderr, "tls: Could not read '%s'.\n", ssl_ticket_key_file);
+	gnutls_free(key->data);
+	key->data = NULL;
+	return -1;
+    }
+    key->size = SSL_TICKET_KEY_SIZE;
+
+    return 0;
+}
+#endif
+
+/*
+ * Name: ssl_rotate_ticket_key
+ * Description: Makes a new session ticket key the current one. It is
+ * read from SSLSessionTicketKey (so that the servers that share the
+ * file can resume each other's sessions), or generated if no file is
+ * given. Called at startup, and at each maintenance interval.
+ *
+ * Returns: 0, or -1 if the key could not be read (the current key is
+ * then kept).
+ */
+int ssl_rotate_ticket_key(void)
+{
+#ifdef ENABLE_SESSION_TICKETS
+    gnutls_datum key = { NULL, 0 };
+    int _cur = (cur_ticket + 1) % 2;
+
+    if (ssl_ticket_key_file != NULL) {
+	if (read_ticket_key(&key) < 0)
+	    return -1;
+
+	/* the file was not replaced */
+	if (ticket_keys[ cur_ticket].data != NULL &&
+	    memcmp(key.data, ticket_keys[ cur_ticket].data, key.size) == 0) {
+	    memset(key.data, 0, key.size);
+	    gnutls_free(key.data);
+	    return 0;
+	}
+    } else if (gnutls_session_ticket_key_generate(&key) < 0) {
+	log_error_time();
+	fprintf(stderr, "tls: Could not generate a session ticket key.\n");
+	return -1;
+    }
+
+    /* the previous key is freed now */
+    if (ticket_keys[ _cur].data != NULL) {
+	memset(ticket_keys[ _cur].data, 0, ticket_keys[ _cur].size);
+	gnutls_free(ticket_keys[ _cur].data);
+    }
+    ticket_keys[ _cur] = key;
+    cur_ticket = _cur;
+
+    log_error_time();
+    fprintf(stderr, "tls: %s session ticket key.\n",
+	    ssl_ticket_key_file != NULL ? "Loaded a" : "Generated a new");
+#endif
+    return 0;
+}
+
+/* Session resuming:
+ *
+ * The sessions are kept in SSL_CACHE_SHARDS shards, each with its own
+ * lock, so that threads resuming different sessions do not wait for
+ * each other. A shard is a hash table of the session IDs, over a ring
+ * of ssl_session_cache / SSL_CACHE_SHARDS entries: a new session
+ * replaces the oldest one of its shard (which is removed from the
+ * hash table first). Since all the sessions live for
+ * ssl_session_timeout seconds, the oldest is also the first to expire.
+ *
+ * If SSLSessionCacheFile is set, the sessions are kept in that file
+ * instead, and shared with the other hydra processes (see
+ * ssl_shm_cache.c).
  */
 
 #define SESSION_ID_SIZE 32
 #define SESSION_DATA_SIZE 1024
 
-typedef struct {
+#define SSL_CACHE_SHARDS 16
+
+typedef struct cache_entry {
+    struct cache_entry *next;	/* in the hash chain */
+    unsigned int hash;
+    time_t expires;
+
     char session_id[SESSION_ID_SIZE];
-    int session_id_size;
+    int session_id_size;		/* 0 if the entry is unused */
 
     char session_data[SESSION_DATA_SIZE];
     int session_data_size;
 } CACHE;
 
-static CACHE *cache_db;
-static int cache_db_ptr;
+typedef struct {
+#ifdef ENABLE_SMP
+    pthread_mutex_t lock;
+#endif
+    CACHE **buckets;		/* size hash chains */
+    CACHE *ring;			/* size entries */
+    int size;
+    int pos;				/* the oldest entry */
+} CACHE_SHARD;
+
+static CACHE_SHARD cache_db[SSL_CACHE_SHARDS];
+static int cache_db_size = 0;		/* entries per shard */
 
 static void wrap_db_init(void)
 {
+    int i, size;
+
+    if (ssl_session_cache_file != NULL) {
+	if (open_shm_session_cache(ssl_session_cache_file,
+				   ssl_session_cache) == 0)
+	    return;
+	log_error_time();
+	fprintf(stderr, "tls: Using a session cache of this process only.\n");
+    }
 
-    /* allocate cache_db */
-    cache_db = calloc(1, ssl_session_cache * sizeof(CACHE));
+    size = (ssl_session_cache + SSL_CACHE_SHARDS - 1) / SSL_CACHE_SHARDS;
+    if (size <= 0)
+	return;
+
+    for (i = 0; i < SSL_CACHE_SHARDS; i++) {
+#ifdef ENABLE_SMP
+	pthread_mutex_init( &cache_db[i].lock, NULL);
+#endif
+	cache_db[i].buckets = calloc(size, sizeof(CACHE *));
+	cache_db[i].ring = calloc(size, sizeof(CACHE));
+	if (cache_db[i].buckets == NULL || cache_db[i].ring == NULL) {
+	    log_error_time();
+	    fprintf(stderr, "tls: Could not allocate the session cache.\n");
+	    return;
+	}
+	cache_db[i].size = size;
+	cache_db[i].pos = 0;
+    }
+
+    cache_db_size = size;
+}
+
+static unsigned int session_id_hash(const gnutls_datum * key)
+{
+    unsigned int hash = 2166136261U;	/* FNV-1a */
+    unsigned int i;
+
+    for (i = 0; i < key->size; i++) {
+	hash ^= key->data[i];
+	hash *= 16777619;
+    }
+
+    return hash;
+}
+
+#define CACHE_SHARD_OF(hash) (&cache_db[(hash) % SSL_CACHE_SHARDS])
+#define CACHE_BUCKET(shard, hash) \
+	(&(shard)->buckets[((hash) / SSL_CACHE_SHARDS) % (shard)->size])
+
+/* Returns the link that points to the entry of key, or to the
+ * NULL at the end of its hash chain.
+ * No locking here. The caller has to lock the shard.
+ */
+static CACHE **find_session(CACHE_SHARD * shard, const gnutls_datum * key,
+			    unsigned int hash)
+{
+    CACHE **p;
+
+    for (p = CACHE_BUCKET(shard, hash); *p != NULL; p = &(*p)->next) {
+	if ((*p)->hash == hash && (*p)->session_id_size == key->size &&
+	    memcmp((*p)->session_id, key->data, key->size) == 0)
+	    break;
+    }
+
+    return p;
+}
+
+/* Removes the entry *p from its hash chain.
+ * No locking here. The caller has to lock the shard.
+ */
+static void remove_session(CACHE ** p)
+{
+    CACHE *e = *p;
+
+    *p = e->next;
+    e->next = NULL;
+    e->session_id_size = 0;
+    e->session_data_size = 0;
 }
 
 static int wrap_db_store(void *dbf, gnutls_datum key, gnutls_datum data)
 {
+    CACHE_SHARD *shard;
+    CACHE *e, **p;
+    unsigned int hash;
+
+    if (shm_session_cache_enabled())
+	return shm_session_store(&key, session_id_hash(&key), &data,
+				 current_time + ssl_session_timeout);
 
-    if (cache_db == NULL)
+    if (cache_db_size == 0)
 	return -1;
 
-    if (key.size > SESSION_ID_SIZE)
+    if (key.size == 0 || key.size > SESSION_ID_SIZE)
 	return -1;
     if (data.size > SESSION_DATA_SIZE)
 	return -1;
 
+    hash = session_id_hash(&key);
+    shard = CACHE_SHARD_OF(hash);
+
 #ifdef ENABLE_SMP
-    pthread_mutex_lock( &ssl_session_cache_lock);
+    pthread_mutex_lock( &shard->lock);
 #endif
 
-    memcpy(cache_db[cache_db_ptr].session_id, key.data, key.size);
-    cache_db[cache_db_ptr].session_id_size = key.size;
+    p = find_session(shard, &key, hash);
+    if (*p != NULL) {
+	e = *p;			/* the same session, stored again */
+    } else {
+	/* reuse the oldest entry */
+	e = &shard->ring[shard->pos];
+	if (e->session_id_size != 0) {
+	    p = CACHE_BUCKET(shard, e->hash);
+	    while (*p != e)
+		p = &(*p)->next;
+	    remove_session(p);
+	}
+	shard->pos = (shard->pos + 1) % shard->size;
 
-    memcpy(cache_db[cache_db_ptr].session_data, data.data, data.size);
-    cache_db[cache_db_ptr].session_data_size = data.size;
+	memcpy(e->session_id, key.data, key.size);
+	e->session_id_size = key.size;
+	e->hash = hash;
 
-    cache_db_ptr++;
-    cache_db_ptr %= ssl_session_cache;
+	p = CACHE_BUCKET(shard, hash);
+	e->next = *p;
+	*p = e;
+    }
+
+    memcpy(e->session_data, data.data, data.size);
+    e->session_data_size = data.size;
+    e->expires = current_time + ssl_session_timeout;
 
 #ifdef ENABLE_SMP
-    pthread_mutex_unlock( &ssl_session_cache_lock);
+    pthread_mutex_unlock( &shard->lock);
 #endif
 
     return 0;
@@ -450,40 +1258,38 @@ static int wrap_db_store(void *dbf, gnutls_datum key, gnutls_datum data)
 static gnutls_datum wrap_db_fetch(void *dbf, gnutls_datum key)
 {
     gnutls_datum res = { NULL, 0 };
-    int i;
+    CACHE_SHARD *shard;
+    CACHE **p;
+    unsigned int hash;
 
-    if (cache_db == NULL)
-	return res;
-
-#ifdef ENABLE_SMP
-    pthread_mutex_lock( &ssl_session_cache_lock);
-#endif
+    if (shm_session_cache_enabled())
+	return shm_session_fetch(&key, session_id_hash(&key));
 
-    for (i = 0; i < ssl_session_cache; i++) {
-	if (key.size == cache_db[i].session_id_size &&
-	    memcmp(key.data, cache_db[i].session_id, key.size) == 0) {
+    if (cache_db_size == 0)
+	return res;
 
-	    res.size = cache_db[i].session_data_size;
+    hash = session_id_hash(&key);
+    shard = CACHE_SHARD_OF(hash);
 
-	    res.data = malloc(res.size);
-	    if (res.data == NULL) {
 #ifdef ENABLE_SMP
-                pthread_mutex_unlock( &ssl_session_cache_lock);
+    pthread_mutex_lock( &shard->lock);
 #endif
-		return res;
-            }
-
-	    memcpy(res.data, cache_db[i].session_data, res.size);
 
-#ifdef ENABLE_SMP
-            pthread_mutex_unlock( &ssl_session_cache_lock);
-#endif
-	    return res;
+    p = find_session(shard, &key, hash);
+    if (*p != NULL) {
+	if ((*p)->expires <= current_time) {
+	    remove_session(p);
+	} else {
+	    res.data = malloc((*p)->session_data_size);
+	    if (res.data != NULL) {
+		res.size = (*p)->session_data_size;
+		memcpy(res.data, (*p)->session_data, res.size);
+	    }
 	}
     }
 
 #ifdef ENABLE_SMP
-    pthread_mutex_unlock( &ssl_session_cache_lock);
+    pthread_mutex_unlock( &shard->lock);
 #endif
 
     return res;
@@ -491,35 +1297,35 @@ static gnutls_datum wrap_db_fetch(void *dbf, gnutls_datum key)
 
 static int wrap_db_delete(void *dbf, gnutls_datum key)
 {
-int i;
+    CACHE_SHARD *shard;
+    CACHE **p;
+    unsigned int hash;
+    int ret = -1;
 
-    if (cache_db == NULL)
-	return -1;
-
-#ifdef ENABLE_SMP
-    pthread_mutex_lock( &ssl_session_cache_lock);
-#endif
+    if (shm_session_cache_enabled())
+	return shm_session_delete(&key, session_id_hash(&key));
 
-    for (i = 0; i < ssl_session_cache; i++) {
-	if (key.size == cache_db[i].session_id_size &&
-	    memcmp(key.data, cache_db[i].session_id, key.size) == 0) {
+    if (cache_db_size == 0)
+	return -1;
 
-	    cache_db[i].session_id_size = 0;
-	    cache_db[i].session_data_size = 0;
+    hash = session_id_hash(&key);
+    shard = CACHE_SHARD_OF(hash);
 
 #ifdef ENABLE_SMP
-            pthread_mutex_unlock( &ssl_session_cache_lock);
+    pthread_mutex_lock( &shard->lock);
 #endif
 
-	    return 0;
-	}
+    p = find_session(shard, &key, hash);
+    if (*p != NULL) {
+	remove_session(p);
+	ret = 0;
     }
 
 #ifdef ENABLE_SMP
-    pthread_mutex_unlock( &ssl_session_cache_lock);
+    pthread_mutex_unlock( &shard->lock);
 #endif
-    return -1;
 
+    return ret;
 }
 
 void check_ssl_alert( request* req, int ret)
@@ -534,12 +1340,10 @@ void check_ssl_alert( request* req, int ret)
    }
 }
 
-int finish_handshake(request * current)
+/* Acts on the result of gnutls_handshake().
+ */
+static int handshake_result(request * current, int retval)
 {
-    int retval;
-
-    retval = gnutls_handshake(current->ssl_state);
-
     if (retval == GNUTLS_E_AGAIN)
 	retval = -1;
     else if (retval == GNUTLS_E_INTERRUPTED)
@@ -653,6 +1457,10 @@ int finish_handshake(request * current)
         
            gnutls_x509_crt_deinit(crt);
         }
+#ifdef ENABLE_KTLS
+	if (gnutls_transport_is_ktls_enabled(current->ssl_state) & GNUTLS_KTLS_SEND)
+	    current->ktls_send = 1;
+#endif
 	retval = 1;
 	current->status = READ_HEADER;
     }
@@ -660,6 +1468,28 @@ int finish_handshake(request * current)
     return retval;
 }
 
+int finish_handshake(server_params * params, request * current)
+{
+    int retval;
+
+    if (current->handshake != NULL) {
+	/* a handshake thread did (or does) it */
+	if (!current->handshake->done) {
+	    /* ssl_handshake_complete() moves it to the ready queue */
+	    current->handshake->parked = 1;
+	    return -1;
+	}
+	retval = current->handshake->result;
+	free(current->handshake);
+	current->handshake = NULL;
+    } else if (ssl_handshake_offload(params, current))
+	return 1;
+    else
+	retval = gnutls_handshake(current->ssl_state);
+
+    return handshake_result(current, retval);
+}
+
 int send_alert(request * current)
 {
     int retval;
@@ -684,77 +1514,28 @@ int send_alert(request * current)
  */
 void ssl_reinit()
 {
-    int i;
-    
-    need_dh_params = 0;
-    need_rsa_params = 0;
-
-    /* Add ciphers 
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_ciphers, "AES") != 0)
-    	cipher_priority[i++] = GNUTLS_CIPHER_RIJNDAEL_128_CBC;
-    if ( parse_cs_string( ssl_ciphers, "ARCFOUR-128") != 0)
-    	cipher_priority[i++] = GNUTLS_CIPHER_ARCFOUR_128;
-    if ( parse_cs_string( ssl_ciphers, "3DES") != 0)
-    	cipher_priority[i++] = GNUTLS_CIPHER_3DES_CBC;
-    if ( parse_cs_string( ssl_ciphers, "ARCFOUR-40") != 0)
-    	cipher_priority[i++] = GNUTLS_CIPHER_ARCFOUR_40;
-    cipher_priority[i] = 0;
-
-    /* Add key exchange methods
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_kx, "RSA") != 0)
-    	kx_priority[i++] = GNUTLS_KX_RSA;
-    if ( parse_cs_string( ssl_kx, "RSA-EXPORT") != 0) {
-    	kx_priority[i++] = GNUTLS_KX_RSA_EXPORT;
-    	need_rsa_params = 1;
-    }
-    if ( parse_cs_string( ssl_kx, "DHE-RSA") != 0) {
-    	kx_priority[i++] = GNUTLS_KX_DHE_RSA;
-    	need_dh_params = 1; /* generate DH parameters */
-    }
-    if ( parse_cs_string( ssl_kx, "DHE-DSS") != 0) {
-    	kx_priority[i++] = GNUTLS_KX_DHE_DSS;
-    	need_dh_params = 1;
-    }
-    kx_priority[i] = 0;
-
-    /* Add MAC Algorithms
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_mac, "MD5") != 0)
-    	mac_priority[i++] = GNUTLS_MAC_MD5;
-    if ( parse_cs_string( ssl_mac, "SHA1") != 0)
-    	mac_priority[i++] = GNUTLS_MAC_SHA;
-    mac_priority[i] = 0;
-
-    /* Add Compression algorithms
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_comp, "NULL") != 0)
-    	comp_priority[i++] = GNUTLS_COMP_NULL;
-    if ( parse_cs_string( ssl_comp, "ZLIB") != 0)
-    	comp_priority[i++] = GNUTLS_COMP_ZLIB;
-    if ( parse_cs_string( ssl_comp, "LZO") != 0)
-    	comp_priority[i++] = GNUTLS_COMP_LZO;
-    comp_priority[i] = 0;
-
-    /* Add protocols
-     */
-    i = 0;
-    if ( parse_cs_string( ssl_protocol, "TLS1.0") != 0)
-    	protocol_priority[i++] = GNUTLS_TLS1;
-    if ( parse_cs_string( ssl_protocol, "SSL3.0") != 0)
-    	protocol_priority[i++] = GNUTLS_SSL3;
-    protocol_priority[i] = 0;
-
+    /* the old algorithms are kept, if the new ones are invalid */
+    set_priorities();
     
     /* Generate temporary parameters -- if needed.
      */
     ssl_regenerate_params();
 
+#ifdef ENABLE_SNI
+    /* the virtual host certificates are read again */
+# ifdef ENABLE_SMP
+    pthread_mutex_lock( &sni_lock);
+# endif
+    sni_generation++;
+# ifdef ENABLE_SMP
+    pthread_mutex_unlock( &sni_lock);
+# endif
+#endif
+
+    /* the key file may have been replaced */
+    if (ssl_session_tickets != 0 && ssl_ticket_key_file != NULL)
+	ssl_rotate_ticket_key();
+
     return;
 }
 
@@ -1,10 +1,26 @@
 #ifdef ENABLE_SSL
 
 gnutls_session initialize_ssl_session(void);
+void ssl_session_done(gnutls_session state);
 void check_ssl_alert( request* req, int ret);
 int send_alert(request * current);
-int finish_handshake(request * current);
+int finish_handshake(server_params * params, request * current);
+
+/* ssl_handshake */
+void init_ssl_handshake_threads(server_params * params, int n);
+int ssl_handshake_offload(server_params * params, request * req);
+void ssl_handshake_complete(server_params * params);
+void show_ssl_handshake_stats(void);
 void ssl_regenerate_params(void);
+int ssl_rotate_ticket_key(void);
+
+/* ssl_shm_cache */
+int open_shm_session_cache(const char *path, int entries);
+int shm_session_cache_enabled(void);
+int shm_session_store(const gnutls_datum * key, unsigned int hash,
+		      const gnutls_datum * data, time_t expires);
+gnutls_datum shm_session_fetch(const gnutls_datum * key, unsigned int hash);
+int shm_session_delete(const gnutls_datum * key, unsigned int hash);
 void generate_x509_dn(char *buf, int sizeof_buf,
 			const gnutls_datum * cert, int issuer);
 
@@ -0,0 +1,257 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the TLS handshake threads. The private key
+ * operation of a handshake (RSA decryption, or the signature of the
+ * DHE parameters) takes milliseconds, and blocks every connection of
+ * the server thread that does it. Thus, if SSLHandshakeThreads is set,
+ * finish_handshake() hands each gnutls_handshake() call to these
+ * threads. The request stays in the FINISH_HANDSHAKE status, with
+ * req->handshake set, and is woken up through the eventfd of its
+ * server thread, as in async_io.c.
+ *
+ * The number of waiting handshakes, and the time they took (from the
+ * queue to the result), are logged on SIGUSR1.
+ */
+
+#include "boa.h"
+#include <stdint.h>
+
+#ifdef ENABLE_SSL
+
+#include "ssl.h"
+
+#ifdef ENABLE_SMP
+
+static struct ssl_handshake *handshake_queue = NULL;	/* to be done */
+static struct ssl_handshake **handshake_queue_tail = &handshake_queue;
+
+static pthread_mutex_t handshake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handshake_cond = PTHREAD_COND_INITIALIZER;
+
+/* statistics, under handshake_lock */
+static int handshakes_waiting = 0;
+static int handshakes_waiting_max = 0;
+static unsigned long handshakes_done = 0;
+static double handshake_time = 0;	/* total, in seconds */
+static double handshake_time_max = 0;
+
+static double elapsed_since(struct timeval *tv)
+{
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+   return (now.tv_sec - tv->tv_sec) + (now.tv_usec - tv->tv_usec) / 1e6;
+}
+
+static void *ssl_handshake_thread(void *arg)
+{
+   struct ssl_handshake *job;
+   server_params *params;
+   uint64_t one = 1;
+   double t;
+
+   while (1) {
+      pthread_mutex_lock(&handshake_lock);
+      while (handshake_queue == NULL)
+	 pthread_cond_wait(&handshake_cond, &handshake_lock);
+      job = handshake_queue;
+      handshake_queue = job->next;
+      if (handshake_queue == NULL)
+	 handshake_queue_tail = &handshake_queue;
+      handshakes_waiting--;
+      pthread_mutex_unlock(&handshake_lock);
+
+      /* the server thread does not touch the session meanwhile */
+      job->result = gnutls_handshake(job->req->ssl_state);
+      t = elapsed_since(&job->queued);
+
+      /* job may be freed as soon as it is on the done list */
+      params = job->params;
+
+      pthread_mutex_lock(&handshake_lock);
+      handshakes_done++;
+      handshake_time += t;
+      if (t > handshake_time_max)
+	 handshake_time_max = t;
+      job->next = params->handshake_done;
+      params->handshake_done = job;
+      pthread_mutex_unlock(&handshake_lock);
+
+      /* if this fails, the eventfd (or pipe) is already readable */
+      write(params->async_fd[1], &one, sizeof(one));
+   }
+
+   return NULL;
+}
+
+/*
+ * Name: init_ssl_handshake_threads
+ * Description: Starts the handshake threads, if SSLHandshakeThreads
+ * was set, for the n server threads in params.
+ */
+void init_ssl_handshake_threads(server_params * params, int n)
+{
+   pthread_attr_t attr;
+   pthread_t tid;
+   int i;
+
+   if (ssl_handshake_threads <= 0)
+      return;
+
+   for (i = 0; i < n; i++) {
+      if (init_async_fd(&params[i]) == -1) {
+	 DIE("could not create the handshake eventfd");
+      }
+   }
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+   for (i = 0; i < ssl_handshake_threads; i++) {
+      if (pthread_create(&tid, &attr, &ssl_handshake_thread, NULL) != 0) {
+	 log_error_time();
+	 fprintf(stderr, "Could not dispatch TLS handshake threads.\n");
+	 exit(1);
+      }
+   }
+
+   pthread_attr_destroy(&attr);
+
+   log_error_time();
+   fprintf(stderr, "%s: Dispatched %d TLS handshake threads.\n",
+	   SERVER_NAME, ssl_handshake_threads);
+}
+
+/*
+ * Name: ssl_handshake_offload
+ * Description: Hands the next gnutls_handshake() of req to the
+ * handshake threads. finish_handshake() is called again (and
+ * parks the request) until the result is in req->handshake.
+ *
+ * Returns: 1 if the handshake threads do it, or 0 if the caller
+ * has to call gnutls_handshake().
+ */
+int ssl_handshake_offload(server_params * params, request * req)
+{
+   struct ssl_handshake *job;
+
+   if (ssl_handshake_threads <= 0 || params->async_fd[0] == -1)
+      return 0;
+
+   job = calloc(1, sizeof(struct ssl_handshake));
+   if (job == NULL)
+      return 0;
+
+   job->req = req;
+   job->params = params;
+   gettimeofday(&job->queued, NULL);
+
+   req->handshake = job;
+
+   pthread_mutex_lock(&handshake_lock);
+   *handshake_queue_tail = job;
+   handshake_queue_tail = &job->next;
+   if (++handshakes_waiting > handshakes_waiting_max)
+      handshakes_waiting_max = handshakes_waiting;
+   pthread_cond_signal(&handshake_cond);
+   pthread_mutex_unlock(&handshake_lock);
+
+   return 1;
+}
+
+/*
+ * Name: ssl_handshake_complete
+ * Description: Called by the server thread when its eventfd is
+ * readable (from async_io_complete(), which reads it). The requests
+ * whose handshakes were done are moved to the ready queue.
+ */
+void ssl_handshake_complete(server_params * params)
+{
+   struct ssl_handshake *job, *next;
+
+   pthread_mutex_lock(&handshake_lock);
+   job = params->handshake_done;
+   params->handshake_done = NULL;
+   pthread_mutex_unlock(&handshake_lock);
+
+   for (; job != NULL; job = next) {
+      next = job->next;
+      job->next = NULL;
+      job->done = 1;
+      if (job->parked) {
+	 job->parked = 0;
+	 ready_request(params, job->req);
+      }
+   }
+}
+
+/*
+ * Name: show_ssl_handshake_stats
+ * Description: Logs the handshake queue statistics, since the
+ * previous time. Called on SIGUSR1.
+ */
+void show_ssl_handshake_stats(void)
+{
+   if (ssl_handshake_threads <= 0)
+      return;
+
+   pthread_mutex_lock(&handshake_lock);
+   log_error_time();
+   fprintf(stderr, "TLS handshakes: %d waiting (at most %d), %lu done, "
+	   "%.1f ms average, %.1f ms max\n", handshakes_waiting,
+	   handshakes_waiting_max, handshakes_done,
+	   handshakes_done ? handshake_time * 1000 / handshakes_done : 0.0,
+	   handshake_time_max * 1000);
+
+   handshakes_waiting_max = handshakes_waiting;
+   handshakes_done = 0;
+   handshake_time = 0;
+   handshake_time_max = 0;
+   pthread_mutex_unlock(&handshake_lock);
+}
+
+#else				/* ENABLE_SMP */
+
+void init_ssl_handshake_threads(server_params * params, int n)
+{
+   if (ssl_handshake_threads > 0) {
+      log_error_time();
+      fputs("SSLHandshakeThreads requires a server built with threads. "
+	    "Ignoring it.\n", stderr);
+      ssl_handshake_threads = 0;
+   }
+}
+
+int ssl_handshake_offload(server_params * params, request * req)
+{
+   return 0;
+}
+
+void ssl_handshake_complete(server_params * params)
+{
+}
+
+void show_ssl_handshake_stats(void)
+{
+}
+
+#endif				/* ENABLE_SMP */
+
+#endif				/* ENABLE_SSL */
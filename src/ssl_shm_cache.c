@@ -0,0 +1,361 @@
+/*
+ *  Hydra, an http server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 1, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* This file contains the shared TLS session cache. If
+ * SSLSessionCacheFile is set, the sessions are kept in that file
+ * (which should be on a tmpfs, such as /dev/shm), mapped by every
+ * hydra process that names it. Thus a client may resume its session
+ * with any of them, and the sessions outlive the restart of a process.
+ *
+ * The file is a hash table of fixed size entries. A session is stored
+ * in one of the SHM_CACHE_PROBES entries that follow its hash bucket
+ * (the one that holds the same session, or an unused or expired one,
+ * or else the one that expires first).
+ *
+ * Each entry is protected by a sequence number (a seqlock), which is
+ * odd while the entry is written. Writers take an entry by making the
+ * number odd with a compare and swap, and give up if another one has
+ * it. The pid of the writer is in the same word, so that it is set
+ * by the same compare and swap. Readers do not lock: they copy the
+ * entry, and use the copy only if the number was even, and did not
+ * change meanwhile. An entry that is left odd by a process that died
+ * is taken over.
+ */
+
+#include "boa.h"
+#include <stdint.h>
+#include <signal.h>
+
+#ifdef ENABLE_SSL
+
+#include "ssl.h"
+
+#define SHM_CACHE_MAGIC 0x48796453	/* "HydS" */
+#define SHM_CACHE_VERSION 2
+#define SHM_CACHE_PROBES 8
+
+#ifndef O_NOFOLLOW
+# define O_NOFOLLOW 0
+#endif
+
+#define SHM_SESSION_ID_SIZE 32
+#define SHM_SESSION_DATA_SIZE 2048
+
+struct shm_cache_header {
+   uint32_t magic;		/* written last, by the creator */
+   uint32_t version;
+   uint32_t entries;
+   uint32_t entry_size;
+};
+
+struct shm_cache_entry {
+   volatile uint64_t lock;	/* the pid that writes it, and the seq */
+   uint32_t hash;
+   uint16_t id_size;		/* 0 if unused */
+   uint16_t data_size;
+   int64_t expires;
+   unsigned char id[SHM_SESSION_ID_SIZE];
+   unsigned char data[SHM_SESSION_DATA_SIZE];
+};
+
+/* The sequence number is the low half of the lock word; it is odd
+ * while the entry is written, by the pid in the high half.
+ */
+#define LOCK_SEQ(lock) ((uint32_t) (lock))
+#define LOCK_PID(lock) ((pid_t) ((lock) >> 32))
+#define MAKE_LOCK(pid, seq) (((uint64_t) (pid) << 32) | (uint32_t) (seq))
+
+static struct shm_cache_header *shm_cache = NULL;
+static struct shm_cache_entry *shm_entries;
+static unsigned int shm_cache_entries = 0;
+
+/*
+ * Name: open_shm_session_cache
+ * Description: Maps the session cache file path, and creates it (with
+ * entries entries) if it does not exist. An existing file keeps its
+ * own number of entries. Since the file is usually in a world writable
+ * directory, an existing one is used only if it is a regular file of
+ * our user, that no one else may read or write.
+ *
+ * Returns: 0 on success, or -1 (after logging why).
+ */
+int open_shm_session_cache(const char *path, int entries)
+{
+   struct shm_cache_header *hdr;
+   struct stat st;
+   size_t size;
+   int fd, created = 0, tries;
+   void *p;
+
+   if (entries < SHM_CACHE_PROBES)
+      entries = SHM_CACHE_PROBES;
+
+   fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+   if (fd != -1) {
+      created = 1;
+      size = sizeof(struct shm_cache_header) +
+	  (size_t) entries * sizeof(struct shm_cache_entry);
+      if (ftruncate(fd, size) == -1) {
+	 log_error_time();
+	 fprintf(stderr, "tls: Could not size the session cache file '%s': %s\n",
+		 path, strerror(errno));
+	 close(fd);
+	 unlink(path);
+	 return -1;
+      }
+   } else if (errno == EEXIST)
+      fd = open(path, O_RDWR | O_NOFOLLOW);
+
+   if (fd == -1) {
+      log_error_time();
+      fprintf(stderr, "tls: Could not open the session cache file '%s': %s\n",
+	      path, strerror(errno));
+      return -1;
+   }
+
+   if (!created && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		    st.st_uid != geteuid() || (st.st_mode & 077) != 0)) {
+      log_error_time();
+      fprintf(stderr, "tls: The session cache file '%s' is not a file of "
+	      "user %d with mode 0600. Refusing to use it.\n", path,
+	      (int) geteuid());
+      close(fd);
+      return -1;
+   }
+
+   /* another process may be creating it */
+   for (tries = 0; ; tries++) {
+      if (fstat(fd, &st) == -1) {
+	 close(fd);
+	 return -1;
+      }
+      if (st.st_size >= sizeof(struct shm_cache_header) || tries == 3)
+	 break;
+      sleep(1);
+   }
+
+   size = st.st_size;
+   if (size < sizeof(struct shm_cache_header)) {
+      log_error_time();
+      fprintf(stderr, "tls: The session cache file '%s' is empty.\n", path);
+      close(fd);
+      return -1;
+   }
+
+   p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) {
+      log_error_time();
+      fprintf(stderr, "tls: Could not map the session cache file '%s': %s\n",
+	      path, strerror(errno));
+      return -1;
+   }
+   hdr = p;
+
+   if (created) {
+      hdr->version = SHM_CACHE_VERSION;
+      hdr->entries = entries;
+      hdr->entry_size = sizeof(struct shm_cache_entry);
+      __sync_synchronize();
+      hdr->magic = SHM_CACHE_MAGIC;
+   } else {
+      for (tries = 0; hdr->magic != SHM_CACHE_MAGIC && tries < 3; tries++)
+	 sleep(1);
+      __sync_synchronize();
+   }
+
+   if (hdr->magic != SHM_CACHE_MAGIC || hdr->version != SHM_CACHE_VERSION ||
+       hdr->entry_size != sizeof(struct shm_cache_entry) ||
+       hdr->entries < SHM_CACHE_PROBES ||
+       sizeof(struct shm_cache_header) +
+       (size_t) hdr->entries * hdr->entry_size > size) {
+      log_error_time();
+      fprintf(stderr, "tls: '%s' is not a session cache file of this "
+	      "version of %s. Remove it.\n", path, SERVER_NAME);
+      munmap(p, size);
+      return -1;
+   }
+
+   shm_entries = (struct shm_cache_entry *) (hdr + 1);
+   shm_cache_entries = hdr->entries;
+   shm_cache = hdr;
+
+   log_error_time();
+   fprintf(stderr, "tls: %s the shared session cache '%s' (%u sessions).\n",
+	   created ? "Created" : "Attached to", path, shm_cache_entries);
+   return 0;
+}
+
+int shm_session_cache_enabled(void)
+{
+   return shm_cache != NULL;
+}
+
+/* Makes the sequence number of e odd, and puts our pid in its
+ * lock word, if no one else writes it.
+ *
+ * Returns: 0 if e may be written, or -1.
+ */
+static int lock_entry(struct shm_cache_entry *e)
+{
+   uint64_t lock = __sync_fetch_and_add(&e->lock, 0);
+   uint32_t seq = LOCK_SEQ(lock);
+   pid_t pid;
+
+   if (seq & 1) {
+      /* a writer that died may have left it */
+      pid = LOCK_PID(lock);
+      if (kill(pid, 0) == 0 || errno != ESRCH)
+	 return -1;
+      seq += 2;
+   } else
+      seq += 1;
+
+   if (!__sync_bool_compare_and_swap(&e->lock, lock,
+				     MAKE_LOCK(getpid(), seq)))
+      return -1;
+
+   return 0;
+}
+
+static void unlock_entry(struct shm_cache_entry *e)
+{
+   uint64_t lock = __sync_fetch_and_add(&e->lock, 0);
+
+   /* no one else changes it while we have it */
+   __sync_bool_compare_and_swap(&e->lock, lock,
+				MAKE_LOCK(0, LOCK_SEQ(lock) + 1));
+}
+
+#define ENTRY_MATCHES(e, hash, key) \
+	((e)->hash == (hash) && (e)->id_size == (key)->size && \
+	 memcmp((e)->id, (key)->data, (key)->size) == 0)
+
+int shm_session_store(const gnutls_datum * key, unsigned int hash,
+		      const gnutls_datum * data, time_t expires)
+{
+   struct shm_cache_entry *e, *victim = NULL;
+   unsigned int i;
+
+   if (key->size == 0 || key->size > SHM_SESSION_ID_SIZE ||
+       data->size > SHM_SESSION_DATA_SIZE)
+      return -1;
+
+   /* the entries are read without the lock; a wrong choice
+    * only costs a session.
+    */
+   for (i = 0; i < SHM_CACHE_PROBES; i++) {
+      e = &shm_entries[(hash + i) % shm_cache_entries];
+      if (ENTRY_MATCHES(e, hash, key)) {
+	 victim = e;
+	 break;
+      }
+      if (victim == NULL || victim->expires > e->expires)
+	 victim = e;
+   }
+
+   if (lock_entry(victim) == -1)
+      return -1;
+
+   victim->hash = hash;
+   victim->id_size = key->size;
+   memcpy(victim->id, key->data, key->size);
+   victim->data_size = data->size;
+   memcpy(victim->data, data->data, data->size);
+   victim->expires = expires;
+
+   unlock_entry(victim);
+   return 0;
+}
+
+/*
+ * Name: shm_session_fetch
+ * Description: Looks up the session key.
+ *
+ * Returns: a copy of the session data (to be freed by gnutls), or
+ * { NULL, 0 } if it was not found.
+ */
+gnutls_datum shm_session_fetch(const gnutls_datum * key, unsigned int hash)
+{
+   gnutls_datum res = { NULL, 0 };
+   struct shm_cache_entry *e;
+   unsigned char buf[SHM_SESSION_DATA_SIZE];
+   unsigned int i, size;
+   uint32_t seq;
+
+   if (key->size == 0 || key->size > SHM_SESSION_ID_SIZE)
+      return res;
+
+   for (i = 0; i < SHM_CACHE_PROBES; i++) {
+      e = &shm_entries[(hash + i) % shm_cache_entries];
+
+      seq = LOCK_SEQ(e->lock);
+      if (seq & 1)
+	 continue;		/* being written */
+      __sync_synchronize();
+
+      if (!ENTRY_MATCHES(e, hash, key) || e->expires <= current_time)
+	 continue;
+      size = e->data_size;
+      if (size > SHM_SESSION_DATA_SIZE)
+	 continue;
+      memcpy(buf, e->data, size);
+
+      __sync_synchronize();
+      if (LOCK_SEQ(e->lock) != seq)
+	 continue;		/* changed while it was copied */
+
+      res.data = malloc(size);
+      if (res.data != NULL) {
+	 memcpy(res.data, buf, size);
+	 res.size = size;
+      }
+      break;
+   }
+
+   return res;
+}
+
+int shm_session_delete(const gnutls_datum * key, unsigned int hash)
+{
+   struct shm_cache_entry *e;
+   unsigned int i;
+
+   if (key->size == 0 || key->size > SHM_SESSION_ID_SIZE)
+      return -1;
+
+   for (i = 0; i < SHM_CACHE_PROBES; i++) {
+      e = &shm_entries[(hash + i) % shm_cache_entries];
+      if (!ENTRY_MATCHES(e, hash, key))
+	 continue;
+
+      if (lock_entry(e) == -1)
+	 return -1;
+      if (ENTRY_MATCHES(e, hash, key)) {
+	 e->id_size = 0;
+	 e->expires = 0;
+      }
+      unlock_entry(e);
+      return 0;
+   }
+
+   return -1;
+}
+
+#endif				/* ENABLE_SSL */
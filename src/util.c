@@ -605,6 +605,22 @@ int set_cloexec_fd(int fd)
    return flags;
 }
 
+/*
+ * Name: reopen_fd
+ * Description: Opens the file of fd again, for reading. Unlike with
+ * dup(), the new descriptor does not share the open file, nor a lease
+ * taken on it.
+ *
+ * Returns: the new descriptor, or -1 (ie. /proc is not mounted).
+ */
+int reopen_fd(int fd)
+{
+   char path[32];
+
+   snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+   return open(path, O_RDONLY);
+}
+
 void create_url(char *buffer, int buffer_size, int secure,
 		const char *hostname, int port, const char *request_uri)
 {
@@ -24,6 +24,50 @@
 
 static virthost *virthost_hashtable[VIRTHOST_HASHTABLE_SIZE];
 
+/* The packs of the previous configuration, kept by dump_virthost()
+ * until the configuration is read again. A pack that cannot be opened
+ * on a reload is replaced by the one of the same document root.
+ */
+struct previous_pack {
+    char *document_root;
+    struct pack_file *pack;
+    struct previous_pack *next;
+};
+
+static struct previous_pack *previous_packs = NULL;
+static int reloading = 0;
+
+static struct pack_file *find_previous_pack(const char *document_root)
+{
+    struct previous_pack *p;
+
+    for (p = previous_packs; p; p = p->next) {
+        if (strcmp(p->document_root, document_root) == 0)
+            return p->pack->broken ? NULL : hold_pack(p->pack);
+    }
+    return NULL;
+}
+
+/*
+ * Name: release_previous_packs
+ *
+ * Description: Releases the packs of the previous configuration,
+ * once the new one is read.
+ */
+
+void release_previous_packs(void)
+{
+    struct previous_pack *p;
+
+    while (previous_packs) {
+        p = previous_packs;
+        previous_packs = p->next;
+        release_pack(p->pack); /* requests may still use it */
+        free(p->document_root);
+        free(p);
+    }
+}
+
 /*
  * Name: add_virthost
  *
@@ -36,6 +80,7 @@ void add_virthost(const char *host, const char *ip, const char* document_root,
     int hash;
     virthost *old, *new;
     int hostlen, iplen, document_root_len, user_dir_len = 0;
+    struct stat statbuf;
 
     /* sanity checking */
     if (host == NULL || ip == NULL || document_root == NULL) {
@@ -115,6 +160,23 @@ void add_virthost(const char *host, const char *ip, const char* document_root,
     }
     new->document_root_len = document_root_len;
 
+    /* a regular file is a pack (see pack.c) */
+    if (stat(document_root, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+        new->pack = open_pack(document_root);
+        if (!new->pack && !reloading) {
+            DIE("could not use the pack file as document root");
+        }
+        if (!new->pack) {
+            /* the error was logged by open_pack() */
+            new->pack = find_previous_pack(document_root);
+            log_error_time();
+            fprintf(stderr, "Could not use the pack file %s as document "
+                    "root; %s.\n", document_root, new->pack ?
+                    "the previous one is kept" : "it has no documents");
+        }
+    } else
+        new->docroot = open_docroot(document_root);
+
     new->next = NULL;
 }
 
@@ -182,6 +244,71 @@ virthost *find_virthost(const char *_host, int hostlen)
 
 
 
+/*
+ * Name: add_virthost_certificate
+ *
+ * Description: Sets the certificate and key files of the virtual host
+ * host, that are used for TLS connections which ask for it (SNI).
+ */
+
+void add_virthost_certificate(const char *host, const char *cert,
+                              const char *key)
+{
+    virthost *vhost;
+
+    vhost = find_virthost(host, 0);
+    if (vhost == NULL) {
+        DIE("SSLVirtualHostCertificate given before its VirtualHost");
+    }
+
+    free(vhost->ssl_cert);
+    free(vhost->ssl_key);
+    vhost->ssl_cert = strdup(cert);
+    vhost->ssl_key = strdup(key);
+    if (!vhost->ssl_cert || !vhost->ssl_key) {
+        DIE("failed strdup");
+    }
+}
+
+/*
+ * Warns about the document roots whose files cannot be kept in the
+ * file cache (see check_docroot_leases()), and has the breaks of
+ * the pack leases reported to this process (see own_pack_lease()).
+ */
+
+void check_virthost_leases(void)
+{
+    int i;
+    virthost *temp;
+
+    for (i = 0; i < VIRTHOST_HASHTABLE_SIZE; ++i) {
+        for (temp = virthost_hashtable[i]; temp; temp = temp->next) {
+            if (temp->pack == NULL)
+                check_docroot_leases(temp->document_root);
+            else
+                own_pack_lease(temp->pack);
+        }
+    }
+}
+
+/*
+ * Called after a SIGIO: marks the packs that are being written as
+ * broken (see check_pack_lease()).
+ */
+
+void check_pack_leases(void)
+{
+    int i;
+    virthost *temp;
+
+    for (i = 0; i < VIRTHOST_HASHTABLE_SIZE; ++i) {
+        for (temp = virthost_hashtable[i]; temp; temp = temp->next) {
+            if (temp->pack)
+                check_pack_lease(temp->pack, temp->document_root);
+        }
+    }
+}
+
 /*
  * Empties the virthost hashtable, deallocating any allocated memory.
  */
@@ -190,6 +317,9 @@ void dump_virthost(void)
 {
     int i;
     virthost *temp;
+    struct previous_pack *p;
+
+    reloading = 1;
 
     for (i = 0; i < VIRTHOST_HASHTABLE_SIZE; ++i) { /* these limits OK? */
         if (virthost_hashtable[i]) {
@@ -202,10 +332,26 @@ void dump_virthost(void)
                 free(temp->access_nodes);
                 if (temp->ip)
                     free(temp->ip);
+                if (temp->pack) {
+                    /* see release_previous_packs() */
+                    p = malloc(sizeof(struct previous_pack));
+                    if (p) {
+                        p->document_root = temp->document_root;
+                        p->pack = temp->pack;
+                        p->next = previous_packs;
+                        previous_packs = p;
+                        temp->document_root = NULL;
+                    } else
+                        release_pack(temp->pack); /* requests may still use it */
+                }
                 if (temp->document_root)
                     free(temp->document_root);
                 if (temp->user_dir)
                     free(temp->user_dir);
+                free(temp->ssl_cert);
+                free(temp->ssl_key);
+                if (temp->docroot)
+                    release_docroot(temp->docroot);
                 dump_alias( temp); /* clear all aliases */
 
                 temp_next = temp->next;